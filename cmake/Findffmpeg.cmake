@@ -22,6 +22,10 @@
 # AVUTIL_INCLUDE_DIRS
 # AVUTIL_LIBRARIES
 
+# SWRESAMPLE_FOUND
+# SWRESAMPLE_INCLUDE_DIRS
+# SWRESAMPLE_LIBRARIES
+
 find_path(AVFILTER_INCLUDE_DIRS NAMES libavfilter/avfilter.h)
 find_library(AVFILTER_LIBRARIES NAMES avfilter)
 if(AVFILTER_LIBRARIES AND AVFILTER_INCLUDE_DIRS)
@@ -54,18 +58,28 @@ else()
   set(AVUTIL_FOUND FALSE)
 endif()
 
-if(AVFILTER_FOUND AND AVFORMAT_FOUND AND AVCODEC_FOUND AND AVUTIL_FOUND)
+find_path(SWRESAMPLE_INCLUDE_DIRS NAMES libswresample/swresample.h)
+find_library(SWRESAMPLE_LIBRARIES NAMES swresample)
+if(SWRESAMPLE_LIBRARIES AND SWRESAMPLE_INCLUDE_DIRS)
+  set(SWRESAMPLE_FOUND TRUE)
+else()
+  set(SWRESAMPLE_FOUND FALSE)
+endif()
+
+if(AVFILTER_FOUND AND AVFORMAT_FOUND AND AVCODEC_FOUND AND AVUTIL_FOUND AND SWRESAMPLE_FOUND)
   set(FFMPEG_FOUND TRUE)
   set(FFMPEG_INCLUDE_DIRS
     ${AVFILTER_INCLUDE_DIRS}
     ${AVFORMAT_INCLUDE_DIRS}
     ${AVCODEC_INCLUDE_DIRS}
-    ${AVUTIL_INCLUDE_DIRS})
+    ${AVUTIL_INCLUDE_DIRS}
+    ${SWRESAMPLE_INCLUDE_DIRS})
   set(FFMPEG_LIBRARIES
     ${AVFILTER_LIBRARIES}
     ${AVFORMAT_LIBRARIES}
     ${AVCODEC_LIBRARIES}
-    ${AVUTIL_LIBRARIES})
+    ${AVUTIL_LIBRARIES}
+    ${SWRESAMPLE_LIBRARIES})
 else()
   set(FFMPEG_FOUND FALSE)
 endif()
@@ -75,10 +89,12 @@ find_package_handle_standard_args(FFMPEG DEFAULT_MSG
   AVFILTER_LIBRARIES AVFILTER_INCLUDE_DIRS
   AVFORMAT_LIBRARIES AVFORMAT_INCLUDE_DIRS
   AVCODEC_LIBRARIES AVCODEC_INCLUDE_DIRS
-  AVUTIL_LIBRARIES AVUTIL_INCLUDE_DIRS)
+  AVUTIL_LIBRARIES AVUTIL_INCLUDE_DIRS
+  SWRESAMPLE_LIBRARIES SWRESAMPLE_INCLUDE_DIRS)
 
 mark_as_advanced(
   AVFILTER_INCLUDE_DIRS AVFILTER_LIBRARIES
   AVFORMAT_INCLUDE_DIRS AVFORMAT_LIBRARIES
   AVCODEC_INCLUDE_DIRS AVCODEC_LIBRARIES
-  AVUTIL_INCLUDE_DIRS AVUTIL_LIBRARIES)
+  AVUTIL_INCLUDE_DIRS AVUTIL_LIBRARIES
+  SWRESAMPLE_INCLUDE_DIRS SWRESAMPLE_LIBRARIES)
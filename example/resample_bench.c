@@ -0,0 +1,127 @@
+/* measure how fast each resample preset converts a file */
+
+// for clock_gettime
+#define _POSIX_C_SOURCE 200809L
+
+#include <groove/groove.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *preset_names[] = {
+    "default",
+    "fastest",
+    "best",
+};
+
+static double get_time(void) {
+    struct timespec tms;
+    clock_gettime(CLOCK_MONOTONIC, &tms);
+    return tms.tv_sec + tms.tv_nsec / 1000000000.0;
+}
+
+static int usage(const char *exe) {
+    fprintf(stderr, "Usage: %s [--rate 44100] file\n", exe);
+    return 1;
+}
+
+static int bench(struct Groove *groove, const char *filename, int sample_rate,
+        enum GrooveResamplePreset preset)
+{
+    struct GrooveFile *file = groove_file_create(groove);
+    if (!file) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    int err;
+    if ((err = groove_file_open(file, filename, filename))) {
+        fprintf(stderr, "Unable to open %s: %s\n", filename, groove_strerror(err));
+        return 1;
+    }
+
+    struct GroovePlaylist *playlist = groove_playlist_create(groove);
+    struct GrooveSink *sink = groove_sink_create(groove);
+    if (!playlist || !sink) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    struct GrooveAudioFormat audio_format;
+    audio_format.sample_rate = sample_rate;
+    audio_format.layout = *soundio_channel_layout_get_builtin(SoundIoChannelLayoutIdStereo);
+    audio_format.format = SoundIoFormatFloat32NE;
+    audio_format.is_planar = false;
+    groove_sink_set_only_format(sink, &audio_format);
+    groove_sink_set_resample_preset(sink, preset);
+
+    double start = get_time();
+
+    groove_playlist_insert(playlist, file, 1.0, 1.0, NULL);
+    if ((err = groove_sink_attach(sink, playlist))) {
+        fprintf(stderr, "error attaching sink: %s\n", groove_strerror(err));
+        return 1;
+    }
+
+    long frame_count = 0;
+    struct GrooveBuffer *buffer;
+    while (groove_sink_buffer_get(sink, &buffer, 1) == GROOVE_BUFFER_YES) {
+        frame_count += buffer->frame_count;
+        groove_buffer_unref(buffer);
+    }
+
+    double elapsed = get_time() - start;
+    double duration = frame_count / (double)sample_rate;
+    fprintf(stderr, "%-8s %8.3fs  %6.1fx realtime  %10.0f frames/s\n",
+            preset_names[preset], elapsed, duration / elapsed, frame_count / elapsed);
+
+    groove_sink_detach(sink);
+    groove_sink_destroy(sink);
+    groove_playlist_clear(playlist);
+    groove_playlist_destroy(playlist);
+    groove_file_destroy(file);
+    return 0;
+}
+
+int main(int argc, char * argv[]) {
+    int sample_rate = 44100;
+    const char *filename = NULL;
+
+    for (int i = 1; i < argc; i += 1) {
+        char *arg = argv[i];
+        if (arg[0] == '-' && arg[1] == '-') {
+            arg += 2;
+            if (i + 1 >= argc) {
+                return usage(argv[0]);
+            } else if (strcmp(arg, "rate") == 0) {
+                sample_rate = atoi(argv[++i]);
+            } else {
+                return usage(argv[0]);
+            }
+        } else if (!filename) {
+            filename = arg;
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (!filename || sample_rate <= 0)
+        return usage(argv[0]);
+
+    struct Groove *groove;
+    int err;
+    if ((err = groove_create(&groove))) {
+        fprintf(stderr, "unable to initialize libgroove: %s\n", groove_strerror(err));
+        return 1;
+    }
+    groove_set_logging(GROOVE_LOG_QUIET);
+
+    // pick a rate that differs from the file, otherwise nothing is resampled
+    fprintf(stderr, "resampling %s to %d Hz\n", filename, sample_rate);
+    for (int preset = 0; preset < 3; preset += 1) {
+        if (bench(groove, filename, sample_rate, (enum GrooveResamplePreset)preset))
+            return 1;
+    }
+
+    groove_destroy(groove);
+    return 0;
+}
@@ -0,0 +1,179 @@
+/* decode files into shared memory and read them back from a second process */
+
+// for fork, pipe and waitpid
+#define _POSIX_C_SOURCE 200809L
+
+#include <groove/shm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int usage(const char *exe) {
+    fprintf(stderr, "Usage: %s [--name /groove-example] file1 [file2 ...]\n", exe);
+    return 1;
+}
+
+// The other process. It waits for the name to exist, then reads until the
+// end of the playlist, printing where each item starts.
+static int run_reader(const char *name, int ready_fd) {
+    char c;
+    if (read(ready_fd, &c, 1) != 1)
+        return 1;
+
+    struct GrooveShmReader *reader;
+    int err;
+    if ((err = groove_shm_reader_open(name, &reader))) {
+        fprintf(stderr, "unable to open %s: %s\n", name, groove_strerror(err));
+        return 1;
+    }
+
+    struct GrooveAudioFormat audio_format;
+    groove_shm_reader_audio_format(reader, &audio_format);
+    int bytes_per_frame = soundio_get_bytes_per_frame(audio_format.format,
+            audio_format.layout.channel_count);
+
+    long long byte_count = 0;
+    unsigned long checksum = 0;
+    uint64_t item_id = 0;
+    int item_count = 0;
+    struct GrooveShmRegion region;
+    for (;;) {
+        int result = groove_shm_reader_get(reader, &region, 1);
+        if (result == GROOVE_BUFFER_END) {
+            break;
+        } else if (result != GROOVE_BUFFER_YES) {
+            fprintf(stderr, "writer went away\n");
+            groove_shm_reader_close(reader);
+            return 1;
+        }
+        if (region.item_id != item_id) {
+            item_id = region.item_id;
+            item_count += 1;
+            fprintf(stderr, "item %d starts at %.3fs\n", item_count, region.pos);
+        }
+        // the audio is read where it is, without copying
+        for (int i = 0; i < region.size; i += 1)
+            checksum = checksum * 31 + region.data[i];
+        byte_count += region.size;
+        groove_shm_reader_advance(reader, region.size);
+    }
+
+    double seconds = byte_count / bytes_per_frame / (double)audio_format.sample_rate;
+    fprintf(stderr, "read %lld bytes, %.3fs of audio, checksum %08lx\n",
+            byte_count, seconds, checksum & 0xffffffff);
+    groove_shm_reader_close(reader);
+    return 0;
+}
+
+int main(int argc, char * argv[]) {
+    const char *name = "/groove-example";
+    int first_file = 0;
+
+    for (int i = 1; i < argc; i += 1) {
+        char *arg = argv[i];
+        if (arg[0] == '-' && arg[1] == '-') {
+            arg += 2;
+            if (i + 1 >= argc) {
+                return usage(argv[0]);
+            } else if (strcmp(arg, "name") == 0) {
+                name = argv[++i];
+            } else {
+                return usage(argv[0]);
+            }
+        } else {
+            first_file = i;
+            break;
+        }
+    }
+    if (!first_file)
+        return usage(argv[0]);
+
+    // fork before libgroove starts any threads
+    int ready_fds[2];
+    if (pipe(ready_fds)) {
+        fprintf(stderr, "unable to create pipe\n");
+        return 1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "unable to fork\n");
+        return 1;
+    }
+    if (pid == 0) {
+        close(ready_fds[1]);
+        return run_reader(name, ready_fds[0]);
+    }
+    close(ready_fds[0]);
+
+    struct Groove *groove;
+    int err;
+    if ((err = groove_create(&groove))) {
+        fprintf(stderr, "unable to initialize libgroove: %s\n", groove_strerror(err));
+        return 1;
+    }
+    groove_set_logging(GROOVE_LOG_INFO);
+
+    struct GroovePlaylist *playlist = groove_playlist_create(groove);
+    struct GrooveSink *sink = groove_sink_create(groove);
+    if (!playlist || !sink) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    struct GrooveAudioFormat audio_format;
+    audio_format.sample_rate = 44100;
+    audio_format.layout = *soundio_channel_layout_get_builtin(SoundIoChannelLayoutIdStereo);
+    audio_format.format = SoundIoFormatS16NE;
+    audio_format.is_planar = false;
+    int bytes_per_frame = soundio_get_bytes_per_frame(audio_format.format,
+            audio_format.layout.channel_count);
+    // about a second of audio
+    if ((err = groove_sink_set_shm(sink, name, 44100 * bytes_per_frame, &audio_format))) {
+        fprintf(stderr, "unable to create %s: %s\n", name, groove_strerror(err));
+        return 1;
+    }
+    if (write(ready_fds[1], "r", 1) != 1) {
+        fprintf(stderr, "unable to start reader\n");
+        return 1;
+    }
+    close(ready_fds[1]);
+
+    for (int i = first_file; i < argc; i += 1) {
+        struct GrooveFile *file = groove_file_create(groove);
+        if (!file) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        if ((err = groove_file_open(file, argv[i], argv[i]))) {
+            fprintf(stderr, "Unable to open %s: %s\n", argv[i], groove_strerror(err));
+            continue;
+        }
+        groove_playlist_insert(playlist, file, 1.0, 1.0, NULL);
+    }
+
+    if ((err = groove_sink_attach(sink, playlist))) {
+        fprintf(stderr, "error attaching sink: %s\n", groove_strerror(err));
+        return 1;
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+
+    groove_sink_detach(sink);
+    groove_sink_destroy(sink);
+
+    struct GroovePlaylistItem *item = playlist->head;
+    while (item) {
+        struct GrooveFile *file = item->file;
+        struct GroovePlaylistItem *next = item->next;
+        groove_playlist_remove(playlist, item);
+        groove_file_destroy(file);
+        item = next;
+    }
+    groove_playlist_destroy(playlist);
+    groove_destroy(groove);
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
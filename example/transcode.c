@@ -1,10 +1,15 @@
 /* transcode one or more files into one output file */
 
+// for open and close
+#define _POSIX_C_SOURCE 200809L
+
 #include <groove/groove.h>
 #include <groove/encoder.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 static int usage(char *arg0) {
     fprintf(stderr, "Usage: %s file1 [file2 ...] --output outputfile [--bitrate 320] [--format name] [--codec name] [--mime mimetype]\n", arg0);
@@ -80,28 +85,36 @@ int main(int argc, char * argv[]) {
         }
     }
 
-    if (groove_encoder_attach(encoder, playlist) < 0) {
-        fprintf(stderr, "error attaching encoder\n");
+    int fd = open(output_file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening output file %s\n", output_file_name);
+        return 1;
+    }
+    // the encoder writes the file itself, and can seek back to finish it
+    if ((err = groove_encoder_set_output_fd(encoder, fd))) {
+        fprintf(stderr, "Error setting output file: %s\n", groove_strerror(err));
         return 1;
     }
 
-    FILE *f = fopen(output_file_name, "wb");
-    if (!f) {
-        fprintf(stderr, "Error opening output file %s\n", output_file_name);
+    if (groove_encoder_attach(encoder, playlist) < 0) {
+        fprintf(stderr, "error attaching encoder\n");
         return 1;
     }
 
+    // returns once the trailer is written
+    int status = 0;
     struct GrooveBuffer *buffer;
-
-    while (groove_encoder_buffer_get(encoder, &buffer, 1) == GROOVE_BUFFER_YES) {
-        fwrite(buffer->data[0], 1, buffer->size, f);
-        groove_buffer_unref(buffer);
+    if (groove_encoder_buffer_get(encoder, &buffer, 1) != GROOVE_BUFFER_END) {
+        fprintf(stderr, "Error encoding %s\n", output_file_name);
+        status = 1;
     }
 
-    fclose(f);
-
     groove_encoder_detach(encoder);
     groove_encoder_destroy(encoder);
+    if (close(fd)) {
+        fprintf(stderr, "Error writing %s\n", output_file_name);
+        status = 1;
+    }
 
     struct GroovePlaylistItem *item = playlist->head;
     while (item) {
@@ -115,5 +128,5 @@ int main(int argc, char * argv[]) {
 
     groove_destroy(groove);
 
-    return 0;
+    return status;
 }
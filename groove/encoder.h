@@ -50,6 +50,12 @@ struct GrooveEncoder {
     /// ::groove_encoder_create defaults this to 16384
     int encoded_buffer_size;
 
+    /// The most encoded bytes in each buffer from ::groove_encoder_buffer_get.
+    /// Larger buffers mean fewer of them for high bit rates and lossless
+    /// formats. The buffers are handed out without copying the muxer's output.
+    /// Read when attaching. ::groove_encoder_create defaults this to 4096
+    int avio_buffer_size;
+
     /// This volume adjustment to make to this player.
     /// It is recommended that you leave this at 1.0 and instead adjust the
     /// gain of the underlying playlist.
@@ -89,6 +95,33 @@ GROOVE_EXPORT int groove_encoder_buffer_get(struct GrooveEncoder *encoder,
 /// if block is 1, block until buffer is ready
 GROOVE_EXPORT int groove_encoder_buffer_peek(struct GrooveEncoder *encoder, int block);
 
+/// Like ::groove_sink_get_fd, readable while ::groove_encoder_buffer_peek
+/// would return 1.
+GROOVE_EXPORT int groove_encoder_buffer_get_fd(struct GrooveEncoder *encoder);
+
+/// Writes the encoded audio straight to `custom_io` as the encoder makes it,
+/// instead of handing it out with ::groove_encoder_buffer_get. That function
+/// then only returns #GROOVE_BUFFER_END, after the trailer is written.
+/// GrooveCustomIo::write_packet is required. If GrooveCustomIo::seek is set,
+/// the output is seekable, so formats such as mp4 can write their index at
+/// the end. The callbacks run on the worker threads of the Groove, so a slow
+/// output holds one of them up. Pass `NULL` to go back to buffers. Call it
+/// while detached; `custom_io` must outlive the attachment. Call it again
+/// after changing the callbacks of `custom_io`.
+///
+/// Possible errors:
+/// * #GrooveErrorInvalid
+GROOVE_EXPORT int groove_encoder_set_output(struct GrooveEncoder *encoder,
+        struct GrooveCustomIo *custom_io);
+
+/// Like ::groove_encoder_set_output, writing to a file descriptor, which the
+/// caller keeps open and closes. It is seekable if the file descriptor is.
+/// Pass -1 to go back to buffers.
+///
+/// Possible errors:
+/// * #GrooveErrorInvalid
+GROOVE_EXPORT int groove_encoder_set_output_fd(struct GrooveEncoder *encoder, int fd);
+
 /// see docs for groove_file_metadata_get
 GROOVE_EXPORT struct GrooveTag *groove_encoder_metadata_get(struct GrooveEncoder *encoder,
         const char *key, const struct GrooveTag *prev, int flags);
@@ -38,6 +38,10 @@ struct GrooveFingerprinter {
     /// ::groove_fingerprinter_create defaults this to 64KB
     int sink_buffer_size_bytes;
 
+    /// If set when attaching, fingerprints are computed as each buffer is
+    /// decoded. See GrooveSink::process.
+    int process_inline;
+
     /// read-only. set when attached and cleared when detached
     struct GroovePlaylist *playlist;
 };
@@ -63,6 +67,10 @@ GROOVE_EXPORT void groove_fingerprinter_free_info(struct GrooveFingerprinterInfo
 GROOVE_EXPORT int groove_fingerprinter_info_peek(struct GrooveFingerprinter *printer,
         int block);
 
+/// Like ::groove_sink_get_fd, readable while ::groove_fingerprinter_info_peek
+/// would return 1.
+GROOVE_EXPORT int groove_fingerprinter_info_get_fd(struct GrooveFingerprinter *printer);
+
 /// get the position of the printer head
 /// both the current playlist item and the position in seconds in the playlist
 /// item are given. item will be set to NULL if the playlist is empty
@@ -106,6 +106,27 @@ enum GrooveFillMode {
 enum GrooveSinkFlags {
     GrooveSinkFlagPlanarOk = 0x1,
     GrooveSinkFlagInterleavedOk = 0x2,
+    GrooveSinkFlagConvertOnGet = 0x4,
+};
+
+/// Which resampler converts sample rates for a sink. See GrooveSink::resampler
+enum GrooveResampler {
+    /// libswresample. Always available.
+    GrooveResamplerSwr,
+    /// The SoX resampler. Only available if FFmpeg was built with libsoxr;
+    /// otherwise #GrooveResamplerSwr is used instead.
+    GrooveResamplerSoxr,
+};
+
+/// See ::groove_sink_set_resample_preset
+enum GrooveResamplePreset {
+    /// The resampler's own defaults.
+    GrooveResamplePresetDefault,
+    /// A short filter without interpolation. Audibly worse, but good enough
+    /// for analysis such as waveforms and loudness.
+    GrooveResamplePresetFastest,
+    /// soxr at very high precision if available, otherwise a long swr filter.
+    GrooveResamplePresetBest,
 };
 
 #define GROOVE_LOG_QUIET    -8
@@ -199,6 +220,11 @@ struct GroovePlaylistItem {
     /// See also ::groove_playlist_insert
     struct GroovePlaylistItem *prev;
     struct GroovePlaylistItem *next;
+
+    /// read-only. Numbers the items of a playlist in the order they were
+    /// added, starting at 1. Never reused within the playlist, so unlike the
+    /// item's address it still means the same item after it is removed.
+    uint64_t id;
 };
 
 struct GroovePlaylist {
@@ -217,6 +243,21 @@ struct GroovePlaylist {
     double gain;
 };
 
+/// See ::groove_buffer_stats
+struct GrooveBufferStats {
+    /// Buffer objects allocated from the heap since ::groove_create.
+    long alloc_count;
+    /// Buffers which reused an object that was freed earlier instead.
+    long reuse_count;
+    /// Buffers which are currently referenced.
+    long live_count;
+    /// Freed buffer objects kept for reuse.
+    long free_count;
+    /// AVFrames allocated for decoded audio since ::groove_create. Frames are
+    /// reused like buffer objects.
+    long frame_alloc_count;
+};
+
 struct GrooveBuffer {
     /// read-only.
     /// * for interleaved audio, data[0] is the buffer.
@@ -301,18 +342,35 @@ struct GrooveSink {
     /// * If #GrooveSinkFlagInterleavedOk is set, buffers in this sink may be
     ///   interleaved.
     /// Leaving both of these flags unset is the same as having them both set.
+    /// * If #GrooveSinkFlagConvertOnGet is set, the sink receives decoded audio
+    ///   as it is, and resampling, format conversion and regrouping to
+    ///   GrooveSink::buffer_sample_count happen in ::groove_sink_buffer_get
+    ///   on the calling thread instead of on the playlist's decode thread.
+    ///   ::groove_sink_buffer_peek may then report a buffer that
+    ///   ::groove_sink_buffer_get still needs more input for.
     /// See also ::groove_sink_set_only_format
     uint32_t flags;
 
     /// If you leave this to its default of 0, frames pulled from the sink
     /// will have sample count determined by efficiency.
     /// If you set this to a positive number, frames pulled from the sink
-    /// will always have this number of samples.
+    /// will always have this number of samples. When no conversion is needed,
+    /// these buffers share the decoded audio instead of copying it, except
+    /// for blocks which span two decoded frames.
     int buffer_sample_count;
 
     /// ::groove_sink_create defaults this to 64KB
     int buffer_size_bytes;
 
+    /// If you set this to a positive number of seconds, consecutive decoded
+    /// frames are copied together so that buffers pulled from the sink hold
+    /// at least this much audio, except at the end of a playlist item or
+    /// when the format changes. This saves per buffer overhead for sinks
+    /// which care about throughput rather than latency.
+    /// If GrooveSink::buffer_sample_count is set, that decides the size instead.
+    /// Defaults to 0.0, which hands out frames as they are decoded.
+    double min_buffer_duration;
+
     /// This volume adjustment only applies to this sink.
     /// It is recommended that you leave this at 1.0 and instead adjust the
     /// gain of the playlist.
@@ -321,6 +379,24 @@ struct GrooveSink {
     /// float format. Defaults to 1.0
     double gain;
 
+    /// The resampler used when the sample rate has to be converted for this
+    /// sink. Defaults to #GrooveResamplerSwr. The following fields tune it;
+    /// each of them leaves the resampler's default alone if it is 0, or -1
+    /// for GrooveSink::resample_linear_interp.
+    /// Like the format fields, these must be set before attaching.
+    /// See also ::groove_sink_set_resample_preset
+    enum GrooveResampler resampler;
+    /// Length of the resampling filter. Longer is better and slower. swr only.
+    int resample_filter_size;
+    /// Cutoff frequency as a fraction of the Nyquist frequency, for example
+    /// 0.97.
+    double resample_cutoff;
+    /// 1 to interpolate linearly between filter phases, 0 not to. swr only.
+    /// ::groove_sink_create defaults this to -1.
+    int resample_linear_interp;
+    /// Bits of precision. soxr only.
+    int resample_precision;
+
     /// set to whatever you want, defaults to `NULL`.
     void *userdata;
     /// called when the audio queue is flushed. For example, if you seek to a
@@ -336,6 +412,20 @@ struct GrooveSink {
     /// Called when a buffer is put into the sink. This is called from a thread
     /// context in which it is undefined behavior to call any libgroove functions.
     void (*filled)(struct GrooveSink *);
+    /// If set before attaching, the sink is inline: rather than queueing
+    /// buffers for ::groove_sink_buffer_get, the decode thread hands each one
+    /// to this function as soon as it is made, while the audio is still in
+    /// cache. `buffer` is `NULL` at the end of the playlist. Call
+    /// ::groove_buffer_ref to keep it. This runs on the decode thread with
+    /// the playlist locked, so it must be quick and must not call playlist
+    /// or sink functions. An inline sink never holds up decoding, and
+    /// ::groove_sink_attach clears #GrooveSinkFlagConvertOnGet for it.
+    ///
+    /// The `process_inline` option of the fingerprinter, loudness detector
+    /// and waveform uses this. Their work then runs on the decode thread
+    /// instead of the shared worker threads, which suits batch scans, and
+    /// their info queue size no longer holds up decoding.
+    void (*process)(struct GrooveSink *, struct GrooveBuffer *buffer);
 
     /// read-only. set when you call ::groove_sink_attach. cleared when you call
     /// ::groove_sink_detach
@@ -344,11 +434,15 @@ struct GrooveSink {
 
 
 /// You should only need one of these Groove contexts.
+/// Encoders, loudness detectors, fingerprinters and waveforms created with it
+/// share one thread per core, started when the first one is attached, however
+/// many of them there are.
 ///
 /// Possible errors:
 /// * GrooveErrorSystemResources
 /// * GrooveErrorNoMem
 GROOVE_EXPORT int groove_create(struct Groove **groove);
+/// Detach everything created with `groove` first.
 GROOVE_EXPORT void groove_destroy(struct Groove *groove);
 
 GROOVE_EXPORT const char *groove_strerror(int error);
@@ -485,9 +579,42 @@ GROOVE_EXPORT void groove_playlist_set_item_gain_peak(
 GROOVE_EXPORT void groove_playlist_set_fill_mode(struct GroovePlaylist *playlist,
         enum GrooveFillMode mode);
 
+/// Serialize the playlist so that it can be restored quickly later, for
+/// example after a process restart. The snapshot contains every item with its
+/// file path, probe results (duration, audio format, short names, metadata),
+/// gain and peak, as well as the playlist gain and the position of the decode
+/// head, both as a timestamp and as a byte offset. A playlist that has
+/// played to the end is restored without a decode head.
+/// Every file in the playlist must have been opened with ::groove_file_open;
+/// files opened with ::groove_file_open_custom cannot be reopened and cause
+/// #GrooveErrorInvalid.
+/// The snapshot is not portable between machines with different endianness.
+/// Free `out_data` with ::groove_playlist_snapshot_free.
+GROOVE_EXPORT int groove_playlist_snapshot(struct GroovePlaylist *playlist,
+        uint8_t **out_data, int *out_size);
+GROOVE_EXPORT void groove_playlist_snapshot_free(uint8_t *data);
+
+/// Restore a snapshot created with ::groove_playlist_snapshot into an empty
+/// playlist. Only the file at the decode head is opened and seeked right away.
+/// The other files are created from the saved probe results and are opened
+/// when the decode head reaches them, so ::groove_file_duration,
+/// ::groove_file_audio_format and ::groove_file_metadata_get work without
+/// touching the disk.
+/// The restored GrooveFile instances belong to the caller; destroy them with
+/// ::groove_file_destroy after removing them from the playlist.
+/// Possible errors:
+/// * #GrooveErrorInvalid - the playlist is not empty or the snapshot is corrupt
+/// * #GrooveErrorNoMem
+GROOVE_EXPORT int groove_playlist_restore(struct GroovePlaylist *playlist,
+        const uint8_t *data, int size);
+
 GROOVE_EXPORT void groove_buffer_ref(struct GrooveBuffer *buffer);
 GROOVE_EXPORT void groove_buffer_unref(struct GrooveBuffer *buffer);
 
+/// Reports how buffers have been allocated. Once playback reaches a steady
+/// state, GrooveBufferStats::alloc_count should stop growing.
+GROOVE_EXPORT void groove_buffer_stats(struct Groove *groove, struct GrooveBufferStats *stats);
+
 GROOVE_EXPORT struct GrooveSink *groove_sink_create(struct Groove *);
 GROOVE_EXPORT void groove_sink_destroy(struct GrooveSink *sink);
 
@@ -507,6 +634,12 @@ GROOVE_EXPORT void groove_sink_destroy(struct GrooveSink *sink);
 GROOVE_EXPORT void groove_sink_set_only_format(struct GrooveSink *sink,
         const struct GrooveAudioFormat *audio_format);
 
+/// Sets GrooveSink::resampler and the resample fields after it to match
+/// `preset`. Sinks which only analyze audio, such as GrooveWaveform, should
+/// use #GrooveResamplePresetFastest.
+GROOVE_EXPORT void groove_sink_set_resample_preset(struct GrooveSink *sink,
+        enum GrooveResamplePreset preset);
+
 /// before calling this, set audio_format
 /// returns 0 on success, < 0 on error
 GROOVE_EXPORT int groove_sink_attach(struct GrooveSink *sink, struct GroovePlaylist *playlist);
@@ -520,12 +653,28 @@ GROOVE_EXPORT int groove_sink_detach(struct GrooveSink *sink);
 GROOVE_EXPORT int groove_sink_buffer_get(struct GrooveSink *sink,
         struct GrooveBuffer **buffer, int block);
 
+/// Like ::groove_sink_buffer_get, but gets up to `max` buffers at once for
+/// the cost of one. If block is 1, blocks until at least one is ready.
+/// returns < 0 on error, 0 on aborted or no buffer ready, otherwise the
+/// number of buffers stored in `buffers`. The end of the playlist is stored
+/// as `NULL`, and is always the last buffer stored.
+GROOVE_EXPORT int groove_sink_buffer_get_many(struct GrooveSink *sink,
+        struct GrooveBuffer **buffers, int max, int block);
+
 /// returns < 0 on error, 0 on no buffer ready, 1 on buffer ready
 /// if block is 1, block until buffer is ready
 GROOVE_EXPORT int groove_sink_buffer_peek(struct GrooveSink *sink, int block);
 
+/// Returns a file descriptor which is readable while ::groove_sink_buffer_peek
+/// would return 1 or the sink is detached, so that one event loop can wait on
+/// many sinks. It belongs to the sink; do not read from it or close it.
+/// Returns a GrooveError on failure, and always on Windows.
+GROOVE_EXPORT int groove_sink_get_fd(struct GrooveSink *sink);
+
 /// See the gain property of GrooveSink. It is recommended that you leave this
 /// at 1.0 and instead adjust the gain of the playlist.
+/// The change is ramped over a few milliseconds and does not affect other
+/// sinks.
 /// returns 0 on success, < 0 on error
 GROOVE_EXPORT int groove_sink_set_gain(struct GrooveSink *sink, double gain);
 
@@ -536,7 +685,47 @@ GROOVE_EXPORT void groove_sink_set_buffer_size_bytes(struct GrooveSink *sink, in
 GROOVE_EXPORT int groove_sink_get_fill_level(struct GrooveSink *sink);
 
 /// Returns 1 if the sink contains the end of playlist sentinel, 0 otherwise.
+/// For a ring sink, this means the end of the playlist is at or after
+/// ::groove_sink_ring_read_index.
 GROOVE_EXPORT int groove_sink_contains_end_of_playlist(struct GrooveSink *sink);
 
+/// Makes `sink` a ring sink. The decode thread then writes the sink's audio
+/// straight into `memory`, which the caller owns, instead of handing out
+/// GrooveBuffer objects. `memory` holds `capacity` bytes of interleaved audio
+/// in `audio_format`, and `capacity` must be a whole number of frames. This
+/// calls ::groove_sink_set_only_format. Pass `NULL` for `memory` to make it
+/// an ordinary sink again. Call it while the sink is detached. Both indexes
+/// are set back to 0.
+///
+/// A ring sink is full when the ring is. The audio which does not fit waits
+/// inside the sink until ::groove_sink_ring_advance_read_index makes room.
+/// ::groove_sink_buffer_get, ::groove_sink_buffer_get_many,
+/// ::groove_sink_buffer_peek and ::groove_sink_get_fd return
+/// #GrooveErrorInvalid for a ring sink. On a flush, such as a seek, audio
+/// already in the ring stays there; skip it from GrooveSink::flush if you
+/// need to. GrooveSink::filled is called after each write.
+///
+/// Possible errors:
+/// * #GrooveErrorInvalid
+GROOVE_EXPORT int groove_sink_set_ring(struct GrooveSink *sink, void *memory, int capacity,
+        const struct GrooveAudioFormat *audio_format);
+
+/// How many bytes the decode thread has written into the ring so far. Byte
+/// `i` of the stream is at `memory[i % capacity]`. The bytes from
+/// ::groove_sink_ring_read_index up to this index are ready to read. Safe to
+/// call from any thread.
+GROOVE_EXPORT int64_t groove_sink_ring_write_index(struct GrooveSink *sink);
+
+/// How many bytes of the ring have been read so far.
+GROOVE_EXPORT int64_t groove_sink_ring_read_index(struct GrooveSink *sink);
+
+/// Marks `bytes` more of the ring as read, which lets the decode thread
+/// write over them. Call this from one thread only.
+///
+/// Possible errors:
+/// * #GrooveErrorInvalid - `bytes` is negative or would advance past
+///   ::groove_sink_ring_write_index. Nothing is marked as read.
+GROOVE_EXPORT int groove_sink_ring_advance_read_index(struct GrooveSink *sink, int bytes);
+
 
 #endif
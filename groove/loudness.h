@@ -48,6 +48,10 @@ struct GrooveLoudnessDetector {
     /// less memory than computing both.
     int disable_album;
 
+    /// If set when attaching, loudness is measured as each buffer is
+    /// decoded. See GrooveSink::process.
+    int process_inline;
+
     /// read-only. set when attached and cleared when detached
     struct GroovePlaylist *playlist;
 };
@@ -70,6 +74,10 @@ GROOVE_EXPORT int groove_loudness_detector_info_get(struct GrooveLoudnessDetecto
 GROOVE_EXPORT int groove_loudness_detector_info_peek(struct GrooveLoudnessDetector *detector,
         int block);
 
+/// Like ::groove_sink_get_fd, readable while
+/// ::groove_loudness_detector_info_peek would return 1.
+GROOVE_EXPORT int groove_loudness_detector_info_get_fd(struct GrooveLoudnessDetector *detector);
+
 /// get the position of the detect head
 /// both the current playlist item and the position in seconds in the playlist
 /// item are given. item will be set to NULL if the playlist is empty
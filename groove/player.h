@@ -94,6 +94,10 @@ GROOVE_EXPORT int groove_player_event_get(struct GroovePlayer *player,
 /// if block is 1, block until event is ready
 GROOVE_EXPORT int groove_player_event_peek(struct GroovePlayer *player, int block);
 
+/// Like ::groove_sink_get_fd, readable while ::groove_player_event_peek
+/// would return 1.
+GROOVE_EXPORT int groove_player_event_get_fd(struct GroovePlayer *player);
+
 /// wakes up a blocking call to groove_player_event_get or
 /// groove_player_event_peek with a GROOVE_EVENT_WAKEUP.
 GROOVE_EXPORT void groove_player_event_wakeup(struct GroovePlayer *player);
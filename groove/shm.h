@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of libgroove, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#ifndef GROOVE_SHM_H
+#define GROOVE_SHM_H
+
+#include <groove/groove.h>
+
+#include <stdint.h>
+
+/// Makes `sink` a ring sink, see ::groove_sink_set_ring, whose ring is in a
+/// new POSIX shared memory object called `name`. Another process opens it
+/// with ::groove_shm_reader_open and reads the audio in place. `name` follows
+/// the rules of `shm_open`: one leading slash and no others. The object is
+/// unlinked when the sink is destroyed or ::groove_sink_set_ring is called
+/// on it. Call it while the sink is detached. This header is only installed
+/// on platforms with POSIX shared memory.
+///
+/// Along with the audio the object describes its format, which playlist item
+/// and position each byte came from, flushes and the end of the playlist.
+///
+/// Possible errors:
+/// * #GrooveErrorInvalid
+/// * #GrooveErrorNoMem
+/// * #GrooveErrorPermissions
+/// * #GrooveErrorFileSystem - `name` is taken
+/// * #GrooveErrorSystemResources
+GROOVE_EXPORT int groove_sink_set_shm(struct GrooveSink *sink, const char *name, int capacity,
+        const struct GrooveAudioFormat *audio_format);
+
+/// Reads what a sink made by ::groove_sink_set_shm writes, usually from
+/// another process. This does not need a Groove instance. Only one reader
+/// may use a shared memory object at a time.
+struct GrooveShmReader;
+
+/// Audio ready to read, which points into the shared memory.
+struct GrooveShmRegion {
+    /// interleaved audio in the format from ::groove_shm_reader_audio_format
+    const uint8_t *data;
+    /// in bytes, always a whole number of frames
+    int size;
+
+    /// GroovePlaylistItem::id of the item the first frame is from, in the
+    /// writing process. 0 if it is no longer known.
+    uint64_t item_id;
+    /// Seconds into the item of the first frame, or -1.0 if not known.
+    double pos;
+
+    /// Goes up by one each time the playlist is flushed, for example by a
+    /// seek. Audio from before the flush is skipped.
+    int flush_generation;
+};
+
+/// Possible errors:
+/// * #GrooveErrorNoMem
+/// * #GrooveErrorFileNotFound
+/// * #GrooveErrorPermissions
+/// * #GrooveErrorInvalid - not made by ::groove_sink_set_shm, or by an
+///   incompatible version
+/// * #GrooveErrorSystemResources
+GROOVE_EXPORT int groove_shm_reader_open(const char *name, struct GrooveShmReader **out_reader);
+GROOVE_EXPORT void groove_shm_reader_close(struct GrooveShmReader *reader);
+
+/// The format the ring holds. Always interleaved.
+GROOVE_EXPORT void groove_shm_reader_audio_format(struct GrooveShmReader *reader,
+        struct GrooveAudioFormat *audio_format);
+
+/// Looks for audio to read. Returns #GROOVE_BUFFER_YES and fills in `region`
+/// with as much as is ready in one piece, #GROOVE_BUFFER_END once when the
+/// read position reaches the end of the playlist, or #GROOVE_BUFFER_NO if
+/// nothing is ready (block=0) or the sink went away (block=1). Audio past the
+/// end of a playlist comes out after #GROOVE_BUFFER_END, if more items are
+/// inserted.
+///
+/// The region stays valid until ::groove_shm_reader_advance.
+GROOVE_EXPORT int groove_shm_reader_get(struct GrooveShmReader *reader,
+        struct GrooveShmRegion *region, int block);
+
+/// Marks `bytes` at the read position as read, which lets the writer use
+/// them again.
+///
+/// Possible errors:
+/// * #GrooveErrorInvalid - `bytes` is negative or more than is ready. Nothing
+///   is marked as read.
+GROOVE_EXPORT int groove_shm_reader_advance(struct GrooveShmReader *reader, int bytes);
+
+/// Returns 1 once the sink has gone away, 0 otherwise. What it wrote can
+/// still be read.
+GROOVE_EXPORT int groove_shm_reader_closed(struct GrooveShmReader *reader);
+
+#endif
@@ -62,6 +62,10 @@ struct GrooveWaveform {
     /// how big the sink buffer should be
     /// ::groove_waveform_create defaults this to 64KB
     int sink_buffer_size_bytes;
+
+    /// If set when attaching, the waveform is measured as each buffer is
+    /// decoded. See GrooveSink::process.
+    int process_inline;
 };
 
 GROOVE_EXPORT struct GrooveWaveform *groove_waveform_create(struct Groove *);
@@ -84,6 +88,10 @@ GROOVE_EXPORT int groove_waveform_info_get(struct GrooveWaveform *waveform,
 /// if block is 1, block until info is ready
 GROOVE_EXPORT int groove_waveform_info_peek(struct GrooveWaveform *waveform, int block);
 
+/// Like ::groove_sink_get_fd, readable while ::groove_waveform_info_peek
+/// would return 1.
+GROOVE_EXPORT int groove_waveform_info_get_fd(struct GrooveWaveform *waveform);
+
 /// get the position of the detect head
 /// both the current playlist item and the position in seconds in the playlist
 /// item are given. item will be set to NULL if the playlist is empty
@@ -17,6 +17,10 @@ struct GrooveAtomicLong {
     atomic_long x;
 };
 
+struct GrooveAtomicLongLong {
+    atomic_llong x;
+};
+
 struct GrooveAtomicInt {
     atomic_int x;
 };
@@ -29,5 +33,7 @@ struct GrooveAtomicBool {
 #define GROOVE_ATOMIC_FETCH_ADD(a, delta) atomic_fetch_add(&a.x, delta)
 #define GROOVE_ATOMIC_STORE(a, value) atomic_store(&a.x, value)
 #define GROOVE_ATOMIC_EXCHANGE(a, value) atomic_exchange(&a.x, value)
+#define GROOVE_ATOMIC_COMPARE_EXCHANGE(a, expected, desired) \
+    atomic_compare_exchange_strong(&a.x, &expected, desired)
 
 #endif
@@ -6,14 +6,148 @@
  */
 
 #include "buffer.h"
+#include "groove_private.h"
 #include "util.h"
 
+#include <string.h>
+
+int groove_buffer_pool_init(struct GrooveBufferPool *pool) {
+    memset(pool, 0, sizeof(struct GrooveBufferPool));
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0)
+        return GrooveErrorSystemResources;
+    pool->mutex_inited = true;
+    return 0;
+}
+
+void groove_buffer_pool_deinit(struct GrooveBufferPool *pool) {
+    while (pool->free_head) {
+        struct GrooveBufferPrivate *b = pool->free_head;
+        pool->free_head = b->next_free;
+        DEALLOCATE(b);
+    }
+    pool->stats.free_count = 0;
+    for (int i = 0; i < pool->free_frame_count; i += 1)
+        av_frame_free(&pool->free_frames[i]);
+    pool->free_frame_count = 0;
+    if (pool->mutex_inited) {
+        pthread_mutex_destroy(&pool->mutex);
+        pool->mutex_inited = false;
+    }
+}
+
+struct GrooveBufferPrivate *groove_buffer_create(struct Groove *groove) {
+    struct GrooveBufferPool *pool = &groove->buffer_pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    struct GrooveBufferPrivate *b = pool->free_head;
+    if (b) {
+        pool->free_head = b->next_free;
+        pool->stats.free_count -= 1;
+        pool->stats.reuse_count += 1;
+        pool->stats.live_count += 1;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (b) {
+        memset(b, 0, sizeof(struct GrooveBufferPrivate));
+    } else {
+        b = ALLOCATE(struct GrooveBufferPrivate, 1);
+        if (!b)
+            return NULL;
+        pthread_mutex_lock(&pool->mutex);
+        pool->stats.alloc_count += 1;
+        pool->stats.live_count += 1;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    b->pool = pool;
+    GROOVE_ATOMIC_STORE(b->ref_count, 0);
+    return b;
+}
+
+static AVFrame *frame_pool_get(struct GrooveBufferPool *pool) {
+    AVFrame *frame = NULL;
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->free_frame_count > 0) {
+        pool->free_frame_count -= 1;
+        frame = pool->free_frames[pool->free_frame_count];
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (!frame) {
+        frame = av_frame_alloc();
+        if (!frame)
+            return NULL;
+        pthread_mutex_lock(&pool->mutex);
+        pool->stats.frame_alloc_count += 1;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return frame;
+}
+
+static void frame_pool_put(struct GrooveBufferPool *pool, AVFrame **frame) {
+    if (!*frame)
+        return;
+    // unref outside the lock; it may give sample data back to its own pool
+    av_frame_unref(*frame);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->free_frame_count < GROOVE_BUFFER_POOL_SIZE) {
+        pool->free_frames[pool->free_frame_count] = *frame;
+        pool->free_frame_count += 1;
+        *frame = NULL;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    av_frame_free(frame);
+}
+
+AVFrame *groove_frame_alloc(struct Groove *groove) {
+    return frame_pool_get(&groove->buffer_pool);
+}
+
+AVFrame *groove_frame_clone(struct Groove *groove, const AVFrame *src) {
+    AVFrame *frame = frame_pool_get(&groove->buffer_pool);
+    if (!frame)
+        return NULL;
+    if (av_frame_ref(frame, src) < 0) {
+        frame_pool_put(&groove->buffer_pool, &frame);
+        return NULL;
+    }
+    return frame;
+}
+
+void groove_frame_free(struct Groove *groove, AVFrame **frame) {
+    frame_pool_put(&groove->buffer_pool, frame);
+}
+
+void groove_buffer_free(struct GrooveBufferPrivate *b) {
+    struct GrooveBufferPool *pool = b->pool;
+
+    if (b->is_packet && b->data_ref) {
+        av_buffer_unref(&b->data_ref);
+    } else if (b->is_packet && b->data) {
+        DEALLOCATE(b->data);
+    } else if (b->frame) {
+        frame_pool_put(pool, &b->frame);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stats.live_count -= 1;
+    if (pool->stats.free_count < GROOVE_BUFFER_POOL_SIZE) {
+        b->next_free = pool->free_head;
+        pool->free_head = b;
+        pool->stats.free_count += 1;
+        b = NULL;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    DEALLOCATE(b);
+}
+
 void groove_buffer_ref(struct GrooveBuffer *buffer) {
     struct GrooveBufferPrivate *b = (struct GrooveBufferPrivate *) buffer;
-
-    pthread_mutex_lock(&b->mutex);
-    b->ref_count += 1;
-    pthread_mutex_unlock(&b->mutex);
+    GROOVE_ATOMIC_FETCH_ADD(b->ref_count, 1);
 }
 
 void groove_buffer_unref(struct GrooveBuffer *buffer) {
@@ -22,18 +156,14 @@ void groove_buffer_unref(struct GrooveBuffer *buffer) {
 
     struct GrooveBufferPrivate *b = (struct GrooveBufferPrivate *) buffer;
 
-    pthread_mutex_lock(&b->mutex);
-    b->ref_count -= 1;
-    int is_free = b->ref_count == 0;
-    pthread_mutex_unlock(&b->mutex);
-
-    if (is_free) {
-        pthread_mutex_destroy(&b->mutex);
-        if (b->is_packet && b->data) {
-            DEALLOCATE(b->data);
-        } else if (b->frame) {
-            av_frame_free(&b->frame);
-        }
-        DEALLOCATE(b);
-    }
+    // fetch_add returns the old value, so 1 means this was the last reference
+    if (GROOVE_ATOMIC_FETCH_ADD(b->ref_count, -1) == 1)
+        groove_buffer_free(b);
+}
+
+void groove_buffer_stats(struct Groove *groove, struct GrooveBufferStats *stats) {
+    struct GrooveBufferPool *pool = &groove->buffer_pool;
+    pthread_mutex_lock(&pool->mutex);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->mutex);
 }
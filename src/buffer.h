@@ -9,21 +9,66 @@
 #define GROOVE_BUFFER_H
 
 #include "groove_internal.h"
+#include "atomics.h"
 
 #include <pthread.h>
+#include <stdbool.h>
 
 #include <libavutil/frame.h>
+#include <libavutil/buffer.h>
+
+// at most this many unused buffer objects, and as many empty AVFrames, are
+// kept per Groove
+#define GROOVE_BUFFER_POOL_SIZE 256
+
+struct GrooveBufferPool;
 
 struct GrooveBufferPrivate {
     struct GrooveBuffer externals;
     AVFrame *frame;
     int is_packet;
-    int ref_count;
+    struct GrooveAtomicInt ref_count;
 
-    pthread_mutex_t mutex;
     // used for when is_packet is true
     // GrooveBuffer::data[0] will point to this
     uint8_t *data;
+    // if set, data belongs to this instead of being allocated on its own
+    AVBufferRef *data_ref;
+
+    // the pool this buffer goes back to when it is freed
+    struct GrooveBufferPool *pool;
+    struct GrooveBufferPrivate *next_free;
 };
 
+// Recycles GrooveBufferPrivate objects so that steady state decoding does not
+// allocate them. Buffers are created and freed far more often than this
+// mutex is contended, since reference counting does not take it.
+struct GrooveBufferPool {
+    pthread_mutex_t mutex;
+    bool mutex_inited;
+    struct GrooveBufferPrivate *free_head;
+    AVFrame *free_frames[GROOVE_BUFFER_POOL_SIZE];
+    int free_frame_count;
+    struct GrooveBufferStats stats;
+};
+
+int groove_buffer_pool_init(struct GrooveBufferPool *pool);
+void groove_buffer_pool_deinit(struct GrooveBufferPool *pool);
+
+// Returns a zeroed buffer with a reference count of 0, or NULL if out of
+// memory.
+struct GrooveBufferPrivate *groove_buffer_create(struct Groove *groove);
+
+// Frees what the buffer holds and gives it back to its pool. For buffers
+// which were never referenced; otherwise use groove_buffer_unref.
+void groove_buffer_free(struct GrooveBufferPrivate *b);
+
+// Returns an empty AVFrame, reusing one that a freed buffer held if there is
+// one. NULL if out of memory.
+AVFrame *groove_frame_alloc(struct Groove *groove);
+// Like av_frame_clone, with groove_frame_alloc.
+AVFrame *groove_frame_clone(struct Groove *groove, const AVFrame *src);
+// Unrefs the frame and keeps it for groove_frame_alloc. Sets *frame to NULL.
+void groove_frame_free(struct Groove *groove, AVFrame **frame);
+
 #endif
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of libgroove, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#include "decoder_pool.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+
+int groove_decoder_pool_init(struct GrooveDecoderPool *pool) {
+    memset(pool, 0, sizeof(struct GrooveDecoderPool));
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0)
+        return GrooveErrorSystemResources;
+    pool->mutex_inited = true;
+    return 0;
+}
+
+static void idle_decoder_free(struct GrooveIdleDecoder *idle) {
+    avcodec_free_context(&idle->ctx);
+    avcodec_parameters_free(&idle->par);
+}
+
+void groove_decoder_pool_deinit(struct GrooveDecoderPool *pool) {
+    for (int i = 0; i < pool->idle_count; i += 1)
+        idle_decoder_free(&pool->idle[i]);
+    pool->idle_count = 0;
+    if (pool->mutex_inited) {
+        pthread_mutex_destroy(&pool->mutex);
+        pool->mutex_inited = false;
+    }
+}
+
+// Everything a decoder reads from the stream parameters when it is opened.
+static bool params_equal(const AVCodecParameters *a, const AVCodecParameters *b) {
+    return a->codec_id == b->codec_id &&
+        a->codec_tag == b->codec_tag &&
+        a->format == b->format &&
+        a->sample_rate == b->sample_rate &&
+        av_channel_layout_compare(&a->ch_layout, &b->ch_layout) == 0 &&
+        a->bits_per_coded_sample == b->bits_per_coded_sample &&
+        a->bits_per_raw_sample == b->bits_per_raw_sample &&
+        a->block_align == b->block_align &&
+        a->frame_size == b->frame_size &&
+        a->extradata_size == b->extradata_size &&
+        (a->extradata_size == 0 || memcmp(a->extradata, b->extradata, a->extradata_size) == 0);
+}
+
+static int open_decoder(const AVCodec *codec, const AVCodecParameters *par,
+        AVCodecContext **out_ctx)
+{
+    AVCodecContext *ctx = avcodec_alloc_context3(codec);
+    if (!ctx)
+        return GrooveErrorNoMem;
+
+    if (avcodec_parameters_to_context(ctx, par) < 0) {
+        avcodec_free_context(&ctx);
+        return GrooveErrorDecoding;
+    }
+#ifdef AV_CODEC_FLAG_COPY_OPAQUE
+    // frames carry the opaque value of their packet. the playlist uses it
+    // to know the byte offset a frame was decoded from.
+    ctx->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+#endif
+    if (avcodec_open2(ctx, codec, NULL) < 0) {
+        avcodec_free_context(&ctx);
+        return GrooveErrorDecoding;
+    }
+
+    *out_ctx = ctx;
+    return 0;
+}
+
+int groove_decoder_pool_get(struct GrooveDecoderPool *pool, const AVCodec *codec,
+        const AVCodecParameters *par, AVCodecContext **out_ctx)
+{
+    pthread_mutex_lock(&pool->mutex);
+    for (int i = 0; i < pool->idle_count; i += 1) {
+        struct GrooveIdleDecoder *idle = &pool->idle[i];
+        if (idle->ctx->codec == codec && params_equal(idle->par, par)) {
+            *out_ctx = idle->ctx;
+            avcodec_parameters_free(&idle->par);
+            pool->idle_count -= 1;
+            pool->idle[i] = pool->idle[pool->idle_count];
+            pthread_mutex_unlock(&pool->mutex);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    // opening can take a while, so it happens outside the lock
+    return open_decoder(codec, par, out_ctx);
+}
+
+void groove_decoder_pool_put(struct GrooveDecoderPool *pool, const AVCodecParameters *par,
+        AVCodecContext **ctx)
+{
+    if (!*ctx)
+        return;
+
+    AVCodecParameters *par_copy = avcodec_parameters_alloc();
+    if (!par_copy || avcodec_parameters_copy(par_copy, par) < 0) {
+        avcodec_parameters_free(&par_copy);
+        avcodec_free_context(ctx);
+        return;
+    }
+    avcodec_flush_buffers(*ctx);
+
+    pthread_mutex_lock(&pool->mutex);
+    struct GrooveIdleDecoder *idle;
+    if (pool->idle_count < GROOVE_DECODER_POOL_SIZE) {
+        idle = &pool->idle[pool->idle_count];
+        pool->idle_count += 1;
+    } else {
+        idle = &pool->idle[0];
+        for (int i = 1; i < pool->idle_count; i += 1) {
+            if (pool->idle[i].last_used < idle->last_used)
+                idle = &pool->idle[i];
+        }
+        idle_decoder_free(idle);
+    }
+    idle->ctx = *ctx;
+    idle->par = par_copy;
+    idle->last_used = ++pool->clock;
+    pthread_mutex_unlock(&pool->mutex);
+
+    *ctx = NULL;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of libgroove, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#ifndef GROOVE_DECODER_POOL_H
+#define GROOVE_DECODER_POOL_H
+
+#include "groove_internal.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct AVCodec;
+struct AVCodecContext;
+struct AVCodecParameters;
+
+#define GROOVE_DECODER_POOL_SIZE 4
+
+struct GrooveIdleDecoder {
+    struct AVCodecContext *ctx;
+    // the stream parameters the decoder was opened with
+    struct AVCodecParameters *par;
+    uint64_t last_used;
+};
+
+// Opened decoders which files are not using right now. Opening a decoder
+// builds its tables and buffers, so a file borrows one opened for the same
+// stream parameters when it can, and gives it back flushed when it is done.
+struct GrooveDecoderPool {
+    pthread_mutex_t mutex;
+    bool mutex_inited;
+    struct GrooveIdleDecoder idle[GROOVE_DECODER_POOL_SIZE];
+    int idle_count;
+    uint64_t clock;
+};
+
+int groove_decoder_pool_init(struct GrooveDecoderPool *pool);
+void groove_decoder_pool_deinit(struct GrooveDecoderPool *pool);
+
+// Gives out an opened decoder for a stream with parameters `par`.
+// Returns 0 or a GrooveError.
+int groove_decoder_pool_get(struct GrooveDecoderPool *pool, const struct AVCodec *codec,
+        const struct AVCodecParameters *par, struct AVCodecContext **out_ctx);
+
+// Takes back a decoder from groove_decoder_pool_get, which must be given the
+// same `par`, and sets `*ctx` to NULL. The least recently used decoder is
+// freed if the pool is full.
+void groove_decoder_pool_put(struct GrooveDecoderPool *pool,
+        const struct AVCodecParameters *par, struct AVCodecContext **ctx);
+
+#endif
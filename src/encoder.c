@@ -5,15 +5,19 @@
  * See http://opensource.org/licenses/MIT
  */
 
-#include "groove_internal.h"
+#include "groove_private.h"
 #include "groove/encoder.h"
 #include "queue.h"
 #include "buffer.h"
 #include "util.h"
 #include "atomics.h"
+#include "worker_pool.h"
 
 #include <string.h>
 #include <pthread.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
@@ -38,20 +42,34 @@ struct GrooveEncoderPrivate {
     // encode_head_mutex applies to variables inside this block.
     pthread_mutex_t encode_head_mutex;
     char encode_head_mutex_inited;
-    // encode_thread waits on this when the encoded audio buffer queue
-    // is full.
-    pthread_cond_t drain_cond;
-    char drain_cond_inited;
     struct GroovePlaylistItem *encode_head;
     double encode_pos;
     uint64_t encode_pts;
 
     struct GrooveAudioFormat encode_format;
 
-    pthread_t thread_id;
+    // runs on the worker pool while the sink has buffers and the encoded
+    // audio buffer queue has room
+    struct GrooveWorkerTask task;
 
+    // made when attaching, and again if GrooveEncoder::avio_buffer_size
+    // changed. avio writes into avio_buf_ref, and encoded data is handed
+    // out in buffers from packet_pool, at most avio_buf_size bytes at a time.
     AVIOContext *avio;
-    unsigned char *avio_buf;
+    AVBufferRef *avio_buf_ref;
+    AVBufferPool *packet_pool;
+    int avio_buf_size;
+    // set by both output setters. the avio context is made for one output
+    // and its seek callback, and fd_io is reused for every fd, so comparing
+    // pointers cannot tell whether it still fits.
+    bool output_changed;
+
+    // set by groove_encoder_set_output. avio writes here directly instead
+    // of putting buffers in audioq.
+    struct GrooveCustomIo *output;
+    // the output for groove_encoder_set_output_fd
+    struct GrooveCustomIo fd_io;
+    int output_fd;
 
     int sent_header;
     char strbuf[512];
@@ -207,8 +225,17 @@ static int init_avcontext(struct GrooveEncoder *encoder) {
     return 0;
 }
 
-static void *encode_thread(void *arg) {
-    struct GrooveEncoder *encoder = (struct GrooveEncoder *)arg;
+static void schedule_task(struct GrooveEncoderPrivate *e) {
+    int err;
+    if ((err = groove_worker_pool_schedule(&e->groove->worker_pool, &e->task)))
+        av_log(NULL, AV_LOG_ERROR, "encoder: unable to schedule: %s\n", groove_strerror(err));
+}
+
+// Encodes what the sink has until it runs dry or the encoded audio buffer
+// queue is full. Putting a buffer in the sink or taking one out of the queue
+// schedules this again.
+static void encode_task(struct GrooveWorkerTask *task) {
+    struct GrooveEncoder *encoder = (struct GrooveEncoder *)task->context;
     struct GrooveEncoderPrivate *e = (struct GrooveEncoderPrivate *) encoder;
 
     struct GrooveBuffer *buffer;
@@ -216,17 +243,15 @@ static void *encode_thread(void *arg) {
         pthread_mutex_lock(&e->encode_head_mutex);
 
         if (e->audioq_size >= encoder->encoded_buffer_size) {
-            pthread_cond_wait(&e->drain_cond, &e->encode_head_mutex);
             pthread_mutex_unlock(&e->encode_head_mutex);
-            continue;
+            break;
         }
 
-        // we definitely want to unlock the mutex while we wait for the
-        // next buffer. Otherwise there will be a deadlock when sink_flush or
-        // sink_purge is called.
+        // the mutex must not be held while getting the buffer. Otherwise
+        // there will be a deadlock when sink_flush or sink_purge is called.
         pthread_mutex_unlock(&e->encode_head_mutex);
 
-        int result = groove_sink_buffer_get(e->sink, &buffer, 1);
+        int result = groove_sink_buffer_get(e->sink, &buffer, 0);
 
         pthread_mutex_lock(&e->encode_head_mutex);
 
@@ -280,7 +305,6 @@ static void *encode_thread(void *arg) {
         pthread_mutex_unlock(&e->encode_head_mutex);
         groove_buffer_unref(buffer);
     }
-    return NULL;
 }
 
 static void sink_purge(struct GrooveSink *sink, struct GroovePlaylistItem *item) {
@@ -296,8 +320,9 @@ static void sink_purge(struct GrooveSink *sink, struct GroovePlaylistItem *item)
         e->encode_head = NULL;
         e->encode_pos = -1.0;
     }
-    pthread_cond_signal(&e->drain_cond);
     pthread_mutex_unlock(&e->encode_head_mutex);
+
+    schedule_task(e);
 }
 
 static void sink_flush(struct GrooveSink *sink) {
@@ -310,9 +335,14 @@ static void sink_flush(struct GrooveSink *sink) {
     cleanup_avcontext(e);
     init_avcontext(encoder);
     groove_queue_put(e->audioq, end_of_q_sentinel);
-
-    pthread_cond_signal(&e->drain_cond);
     pthread_mutex_unlock(&e->encode_head_mutex);
+
+    schedule_task(e);
+}
+
+static void sink_filled(struct GrooveSink *sink) {
+    struct GrooveEncoder *encoder = (struct GrooveEncoder *)sink->userdata;
+    schedule_task((struct GrooveEncoderPrivate *) encoder);
 }
 
 static int audioq_purge(struct GrooveQueue* queue, void *obj) {
@@ -349,13 +379,38 @@ static void audioq_get(struct GrooveQueue *queue, void *obj) {
     e->audioq_size -= buffer->size;
 
     if (e->audioq_size < encoder->encoded_buffer_size)
-        pthread_cond_signal(&e->drain_cond);
+        schedule_task(e);
+}
+
+// When avio hands us its own buffer, the buffer goes out as it is and avio
+// gets a fresh one from the pool to write into next. Returns false if the
+// data has to be copied instead.
+static bool take_avio_buffer(struct GrooveEncoderPrivate *e, struct GrooveBufferPrivate *b,
+        uint8_t *buf)
+{
+    AVIOContext *avio = e->avio;
+    // a checksum is still computed over the old buffer after this returns,
+    // and libavformat may have replaced the buffer with one of its own
+    if (buf != avio->buffer || avio->update_checksum || buf != e->avio_buf_ref->data)
+        return false;
+
+    AVBufferRef *next = av_buffer_pool_get(e->packet_pool);
+    if (!next)
+        return false;
+
+    b->data_ref = e->avio_buf_ref;
+    b->data = b->data_ref->data;
+    e->avio_buf_ref = next;
+    // avio points buf_ptr back at the start of the buffer once we return
+    avio->buffer = next->data;
+    avio->buf_end = next->data + e->avio_buf_size;
+    return true;
 }
 
 static int encoder_write_packet(void *opaque, uint8_t *buf, int buf_size) {
     struct GrooveEncoderPrivate *e = (struct GrooveEncoderPrivate *)opaque;
 
-    struct GrooveBufferPrivate *b = ALLOCATE(struct GrooveBufferPrivate, 1);
+    struct GrooveBufferPrivate *b = groove_buffer_create(e->groove);
 
     if (!b) {
         return GrooveErrorNoMem;
@@ -363,36 +418,134 @@ static int encoder_write_packet(void *opaque, uint8_t *buf, int buf_size) {
 
     struct GrooveBuffer *buffer = &b->externals;
 
-    if (pthread_mutex_init(&b->mutex, NULL)) {
-        DEALLOCATE(b);
-        return GrooveErrorSystemResources;
-    }
-
     buffer->item = e->encode_head;
     buffer->pos = e->encode_pos;
     buffer->pts = e->encode_pts;
     buffer->format = e->encode_format;
 
     b->is_packet = 1;
-    b->data = ALLOCATE_NONZERO(uint8_t, buf_size);
-    if (!b->data) {
-        DEALLOCATE(buffer);
-        DEALLOCATE(b);
-        pthread_mutex_destroy(&b->mutex);
-        return GrooveErrorNoMem;
+    if (!take_avio_buffer(e, b, buf)) {
+        if (buf_size <= e->avio_buf_size) {
+            b->data_ref = av_buffer_pool_get(e->packet_pool);
+            b->data = b->data_ref ? b->data_ref->data : NULL;
+        } else {
+            b->data = ALLOCATE_NONZERO(uint8_t, buf_size);
+        }
+        if (!b->data) {
+            groove_buffer_free(b);
+            return GrooveErrorNoMem;
+        }
+        memcpy(b->data, buf, buf_size);
     }
-    memcpy(b->data, buf, buf_size);
 
     buffer->data = &b->data;
     buffer->size = buf_size;
 
-    b->ref_count = 1;
+    GROOVE_ATOMIC_STORE(b->ref_count, 1);
 
     groove_queue_put(e->audioq, buffer);
 
     return 0;
 }
 
+static int encoder_write_output(void *opaque, uint8_t *buf, int buf_size) {
+    struct GrooveEncoderPrivate *e = (struct GrooveEncoderPrivate *)opaque;
+    return e->output->write_packet(e->output, buf, buf_size);
+}
+
+static int64_t encoder_seek_output(void *opaque, int64_t offset, int whence) {
+    struct GrooveEncoderPrivate *e = (struct GrooveEncoderPrivate *)opaque;
+    return e->output->seek(e->output, offset, whence);
+}
+
+static int fd_write_packet(struct GrooveCustomIo *custom_io, uint8_t *buf, int buf_size) {
+    struct GrooveEncoderPrivate *e = (struct GrooveEncoderPrivate *)custom_io->userdata;
+    int written = 0;
+    while (written < buf_size) {
+        ssize_t amt = write(e->output_fd, buf + written, buf_size - written);
+        if (amt < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        written += amt;
+    }
+    return written;
+}
+
+static int64_t fd_seek(struct GrooveCustomIo *custom_io, int64_t offset, int whence) {
+    struct GrooveEncoderPrivate *e = (struct GrooveEncoderPrivate *)custom_io->userdata;
+
+    if (whence & GROOVE_SEEK_FORCE) {
+        // doesn't matter
+        whence -= GROOVE_SEEK_FORCE;
+    }
+
+    if (whence & GROOVE_SEEK_SIZE) {
+        struct stat st;
+        if (fstat(e->output_fd, &st))
+            return AVERROR(errno);
+        return st.st_size;
+    }
+
+    switch (whence) {
+        case SEEK_SET:
+        case SEEK_CUR:
+        case SEEK_END:
+            return lseek(e->output_fd, offset, whence);
+    }
+    return -1;
+}
+
+static void cleanup_avio(struct GrooveEncoderPrivate *e) {
+    if (e->avio)
+        av_free(e->avio);
+    e->avio = NULL;
+    av_buffer_unref(&e->avio_buf_ref);
+    av_buffer_pool_uninit(&e->packet_pool);
+}
+
+// Makes the avio context, unless there is one with the right buffer size
+// and the output has not been set since.
+static int init_avio(struct GrooveEncoder *encoder) {
+    struct GrooveEncoderPrivate *e = (struct GrooveEncoderPrivate *) encoder;
+    int buffer_size = encoder->avio_buffer_size;
+
+    if (buffer_size <= 0)
+        return GrooveErrorInvalid;
+    if (e->avio && e->avio_buf_size == buffer_size && !e->output_changed)
+        return 0;
+    cleanup_avio(e);
+
+    e->packet_pool = av_buffer_pool_init(buffer_size, NULL);
+    if (!e->packet_pool) {
+        av_log(NULL, AV_LOG_ERROR, "unable to allocate packet pool\n");
+        return GrooveErrorNoMem;
+    }
+    e->avio_buf_ref = av_buffer_pool_get(e->packet_pool);
+    if (!e->avio_buf_ref) {
+        cleanup_avio(e);
+        av_log(NULL, AV_LOG_ERROR, "unable to allocate avio buffer\n");
+        return GrooveErrorNoMem;
+    }
+    e->avio_buf_size = buffer_size;
+
+    bool seekable = e->output && e->output->seek;
+    e->avio = avio_alloc_context(e->avio_buf_ref->data, buffer_size, 1, encoder, NULL,
+            e->output ? encoder_write_output : encoder_write_packet,
+            seekable ? encoder_seek_output : NULL);
+    if (!e->avio) {
+        cleanup_avio(e);
+        av_log(NULL, AV_LOG_ERROR, "unable to allocate avio context\n");
+        return GrooveErrorNoMem;
+    }
+    // lets formats such as mp4 go back and write their index
+    if (seekable)
+        e->avio->seekable = AVIO_SEEKABLE_NORMAL;
+    e->output_changed = false;
+    return 0;
+}
+
 struct GrooveEncoder *groove_encoder_create(struct Groove *groove) {
     struct GrooveEncoderPrivate *e = ALLOCATE(struct GrooveEncoderPrivate, 1);
 
@@ -404,6 +557,7 @@ struct GrooveEncoder *groove_encoder_create(struct Groove *groove) {
 
     e->groove = groove;
     GROOVE_ATOMIC_STORE(e->abort_request, false);
+    e->output_fd = -1;
 
     e->pkt = av_packet_alloc();
     if (!e->pkt) {
@@ -412,22 +566,6 @@ struct GrooveEncoder *groove_encoder_create(struct Groove *groove) {
         return NULL;
     }
 
-    const int buffer_size = 4 * 1024;
-    e->avio_buf = ALLOCATE_NONZERO(unsigned char, buffer_size);
-    if (!e->avio_buf) {
-        groove_encoder_destroy(encoder);
-        av_log(NULL, AV_LOG_ERROR, "unable to allocate avio buffer\n");
-        return NULL;
-    }
-
-    e->avio = avio_alloc_context(e->avio_buf, buffer_size, 1, encoder, NULL,
-            encoder_write_packet, NULL);
-    if (!e->avio) {
-        groove_encoder_destroy(encoder);
-        av_log(NULL, AV_LOG_ERROR, "unable to allocate avio context\n");
-        return NULL;
-    }
-
     if (pthread_mutex_init(&e->encode_head_mutex, NULL) != 0) {
         groove_encoder_destroy(encoder);
         av_log(NULL, AV_LOG_ERROR, "unable to create mutex\n");
@@ -435,13 +573,6 @@ struct GrooveEncoder *groove_encoder_create(struct Groove *groove) {
     }
     e->encode_head_mutex_inited = 1;
 
-    if (pthread_cond_init(&e->drain_cond, NULL) != 0) {
-        groove_encoder_destroy(encoder);
-        av_log(NULL, AV_LOG_ERROR, "unable to create mutex condition\n");
-        return NULL;
-    }
-    e->drain_cond_inited = 1;
-
     e->audioq = groove_queue_create();
     if (!e->audioq) {
         groove_encoder_destroy(encoder);
@@ -464,6 +595,7 @@ struct GrooveEncoder *groove_encoder_create(struct Groove *groove) {
     e->sink->userdata = encoder;
     e->sink->purge = sink_purge;
     e->sink->flush = sink_flush;
+    e->sink->filled = sink_filled;
 
     // set some defaults
     encoder->bit_rate = 256 * 1000;
@@ -473,6 +605,7 @@ struct GrooveEncoder *groove_encoder_create(struct Groove *groove) {
     encoder->target_audio_format.layout = *soundio_channel_layout_get_builtin(SoundIoChannelLayoutIdStereo);
     encoder->sink_buffer_size_bytes = e->sink->buffer_size_bytes;
     encoder->encoded_buffer_size = 16 * 1024;
+    encoder->avio_buffer_size = 4 * 1024;
     encoder->gain = e->sink->gain;
 
     return encoder;
@@ -492,14 +625,7 @@ void groove_encoder_destroy(struct GrooveEncoder *encoder) {
     if (e->encode_head_mutex_inited)
         pthread_mutex_destroy(&e->encode_head_mutex);
 
-    if (e->drain_cond_inited)
-        pthread_cond_destroy(&e->drain_cond);
-
-    if (e->avio)
-        av_free(e->avio);
-
-    if (e->avio_buf)
-        DEALLOCATE(e->avio_buf);
+    cleanup_avio(e);
 
     if (e->metadata)
         av_dict_free(&e->metadata);
@@ -709,25 +835,34 @@ int groove_encoder_attach(struct GrooveEncoder *encoder, struct GroovePlaylist *
 
     log_audio_fmt(&encoder->actual_audio_format);
 
+    if ((err = init_avio(encoder)) < 0) {
+        groove_encoder_detach(encoder);
+        return err;
+    }
+
     if ((err = init_avcontext(encoder)) < 0) {
         groove_encoder_detach(encoder);
         return err;
     }
 
     groove_sink_set_only_format(e->sink, &encoder->actual_audio_format);
+    // convert on the worker pool rather than the decode thread
+    e->sink->flags |= GrooveSinkFlagConvertOnGet;
     e->sink->buffer_size_bytes = encoder->sink_buffer_size_bytes;
     e->sink->buffer_sample_count = (codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE) ?
         0 : e->codec_ctx->frame_size;
     e->sink->gain = encoder->gain;
 
+    groove_worker_task_init(&e->task, encode_task, encoder);
+
     if ((err = groove_sink_attach(e->sink, playlist))) {
         groove_encoder_detach(encoder);
         return err;
     }
 
-    if (pthread_create(&e->thread_id, NULL, encode_thread, encoder)) {
+    if ((err = groove_worker_pool_schedule(&e->groove->worker_pool, &e->task))) {
         groove_encoder_detach(encoder);
-        return GrooveErrorSystemResources;
+        return err;
     }
 
     return 0;
@@ -738,12 +873,11 @@ int groove_encoder_detach(struct GrooveEncoder *encoder) {
     struct GrooveEncoderPrivate *e = (struct GrooveEncoderPrivate *) encoder;
 
     GROOVE_ATOMIC_STORE(e->abort_request, true);
+    groove_worker_task_cancel(&e->groove->worker_pool, &e->task);
     if ((err = groove_sink_detach(e->sink)))
         return err;
     groove_queue_flush(e->audioq);
     groove_queue_abort(e->audioq);
-    pthread_cond_signal(&e->drain_cond);
-    pthread_join(e->thread_id, NULL);
     GROOVE_ATOMIC_STORE(e->abort_request, false);
 
     cleanup_avcontext(e);
@@ -792,6 +926,45 @@ int groove_encoder_buffer_peek(struct GrooveEncoder *encoder, int block) {
     return groove_queue_peek(e->audioq, block);
 }
 
+int groove_encoder_buffer_get_fd(struct GrooveEncoder *encoder) {
+    struct GrooveEncoderPrivate *e = (struct GrooveEncoderPrivate *) encoder;
+    return groove_queue_get_fd(e->audioq);
+}
+
+int groove_encoder_set_output(struct GrooveEncoder *encoder, struct GrooveCustomIo *custom_io) {
+    struct GrooveEncoderPrivate *e = (struct GrooveEncoderPrivate *) encoder;
+
+    if (encoder->playlist || (custom_io && !custom_io->write_packet))
+        return GrooveErrorInvalid;
+
+    e->output = custom_io;
+    e->output_fd = -1;
+    e->output_changed = true;
+    return 0;
+}
+
+int groove_encoder_set_output_fd(struct GrooveEncoder *encoder, int fd) {
+    struct GrooveEncoderPrivate *e = (struct GrooveEncoderPrivate *) encoder;
+
+    if (encoder->playlist)
+        return GrooveErrorInvalid;
+
+    if (fd < 0)
+        return groove_encoder_set_output(encoder, NULL);
+
+    memset(&e->fd_io, 0, sizeof(struct GrooveCustomIo));
+    e->fd_io.userdata = e;
+    e->fd_io.write_packet = fd_write_packet;
+    // pipes and sockets cannot seek
+    if (lseek(fd, 0, SEEK_CUR) >= 0)
+        e->fd_io.seek = fd_seek;
+
+    e->output = &e->fd_io;
+    e->output_fd = fd;
+    e->output_changed = true;
+    return 0;
+}
+
 void groove_encoder_position(struct GrooveEncoder *encoder,
         struct GroovePlaylistItem **item, double *seconds)
 {
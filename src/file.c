@@ -12,6 +12,7 @@
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -72,20 +73,34 @@ static int64_t file_seek(struct GrooveCustomIo *custom_io, int64_t offset, int w
     return -1;
 }
 
+// Resets everything but the mutexes.
 static void init_file_state(struct GrooveFilePrivate *f) {
-    struct Groove *groove = f->groove;
-    memset(f, 0, sizeof(struct GrooveFilePrivate));
-    f->groove = groove;
+    memset(&f->externals, 0, sizeof(f->externals));
+    memset(&f->audio_stream_index, 0,
+            sizeof(struct GrooveFilePrivate) - offsetof(struct GrooveFilePrivate, audio_stream_index));
     f->audio_stream_index = -1;
     f->seek_pos = -1;
+    f->seek_byte_pos = -1;
+    f->clock_byte_pos = -1;
     GROOVE_ATOMIC_STORE(f->abort_request, false);
 }
 
 struct GrooveFile *groove_file_create(struct Groove *groove) {
-    struct GrooveFilePrivate *f = ALLOCATE_NONZERO(struct GrooveFilePrivate, 1);
+    struct GrooveFilePrivate *f = ALLOCATE(struct GrooveFilePrivate, 1);
     if (!f)
         return NULL;
 
+    f->groove = groove;
+    if (pthread_mutex_init(&f->state_mutex, NULL)) {
+        DEALLOCATE(f);
+        return NULL;
+    }
+    if (pthread_mutex_init(&f->seek_mutex, NULL)) {
+        pthread_mutex_destroy(&f->state_mutex);
+        DEALLOCATE(f);
+        return NULL;
+    }
+
     init_file_state(f);
 
     return &f->externals;
@@ -98,11 +113,6 @@ int groove_file_open_custom(struct GrooveFile *file, struct GrooveCustomIo *cust
 
     f->custom_io = custom_io;
 
-    if (pthread_mutex_init(&f->seek_mutex, NULL)) {
-        groove_file_close(file);
-        return GrooveErrorSystemResources;
-    }
-
     f->audio_pkt = av_packet_alloc();
     if (!f->audio_pkt) {
         groove_file_close(file);
@@ -184,28 +194,25 @@ int groove_file_open_custom(struct GrooveFile *file, struct GrooveCustomIo *cust
     f->audio_st = f->ic->streams[f->audio_stream_index];
     f->audio_st->discard = AVDISCARD_DEFAULT;
 
-    const AVCodec *codec = avcodec_find_decoder(f->audio_st->codecpar->codec_id);
-
-    f->decode_ctx = avcodec_alloc_context3(codec);
-    if (!f->decode_ctx) {
+    // the decoder is opened here to check that it works and to learn the
+    // format it produces. it goes back to the pool until decoding starts.
+    if ((err = groove_file_decoder_get(file))) {
         groove_file_close(file);
-        return GrooveErrorNoMem;
+        return err;
     }
 
-    if ((err = avcodec_parameters_to_context(f->decode_ctx, f->audio_st->codecpar))) {
+    AVCodecContext *decode_ctx = f->decode_ctx;
+    if (decode_ctx->ch_layout.nb_channels == 0) {
         groove_file_close(file);
-        return GrooveErrorDecoding;
+        return GrooveErrorInvalidChannelLayout;
     }
 
-    if (avcodec_open2(f->decode_ctx, f->decoder, NULL) < 0) {
-        groove_file_close(file);
-        return GrooveErrorDecoding;
-    }
+    f->audio_format.sample_rate = decode_ctx->sample_rate;
+    from_ffmpeg_layout(decode_ctx->ch_layout, &f->audio_format.layout);
+    f->audio_format.format = from_ffmpeg_format(decode_ctx->sample_fmt);
+    f->audio_format.is_planar = from_ffmpeg_format_planar(decode_ctx->sample_fmt);
 
-    if (f->decode_ctx->ch_layout.nb_channels == 0) {
-        groove_file_close(file);
-        return GrooveErrorInvalidChannelLayout;
-    }
+    groove_file_decoder_put(file);
 
     // copy the audio stream metadata to the context metadata
     av_dict_copy(&f->ic->metadata, f->audio_st->metadata, 0);
@@ -213,11 +220,32 @@ int groove_file_open_custom(struct GrooveFile *file, struct GrooveCustomIo *cust
     return 0;
 }
 
+int groove_file_decoder_get(struct GrooveFile *file) {
+    struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
+    if (f->decode_ctx)
+        return 0;
+    return groove_decoder_pool_get(&f->groove->decoder_pool, f->decoder,
+            f->audio_st->codecpar, &f->decode_ctx);
+}
+
+void groove_file_decoder_put(struct GrooveFile *file) {
+    struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
+    if (!f->decode_ctx)
+        return;
+    groove_decoder_pool_put(&f->groove->decoder_pool, f->audio_st->codecpar, &f->decode_ctx);
+}
+
 int groove_file_open(struct GrooveFile *file,
         const char *filename, const char *filename_hint)
 {
     struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
 
+    f->path = av_strdup(filename);
+    if (!f->path) {
+        groove_file_close(file);
+        return GrooveErrorNoMem;
+    }
+
     f->stdfile = fopen(filename, "rb");
     if (!f->stdfile) {
         int err = errno;
@@ -252,6 +280,7 @@ void groove_file_close(struct GrooveFile *file) {
     GROOVE_ATOMIC_STORE(f->abort_request, true);
 
     if (f->audio_stream_index >= 0) {
+        groove_file_decoder_put(file);
         av_packet_unref(f->audio_pkt);
 
         f->ic->streams[f->audio_stream_index]->discard = AVDISCARD_ALL;
@@ -265,8 +294,6 @@ void groove_file_close(struct GrooveFile *file) {
     if (f->ic)
         avformat_close_input(&f->ic);
 
-    pthread_mutex_destroy(&f->seek_mutex);
-
     av_free(f->avio);
 
     if (f->stdfile)
@@ -275,9 +302,147 @@ void groove_file_close(struct GrooveFile *file) {
     avcodec_free_context(&f->decode_ctx);
     av_packet_free(&f->audio_pkt);
 
+    av_freep(&f->path);
+    av_freep(&f->lazy_hint);
+    av_freep(&f->lazy_short_names);
+    av_dict_free(&f->lazy_metadata);
+
     init_file_state(f);
 }
 
+int groove_file_init_lazy(struct GrooveFile *file, const char *path,
+        const char *filename_hint, const char *short_names, double duration,
+        const struct GrooveAudioFormat *audio_format, AVDictionary *metadata)
+{
+    struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
+
+    f->lazy = true;
+    f->lazy_metadata = metadata;
+    f->lazy_duration = duration;
+    f->lazy_audio_format = *audio_format;
+
+    f->path = av_strdup(path);
+    f->lazy_hint = av_strdup(filename_hint);
+    f->lazy_short_names = av_strdup(short_names);
+    if (!f->path || !f->lazy_hint || !f->lazy_short_names) {
+        groove_file_close(file);
+        return GrooveErrorNoMem;
+    }
+    file->filename = f->lazy_hint;
+
+    return 0;
+}
+
+int groove_file_lazy_begin(struct GrooveFile *file, char **out_path, char **out_hint) {
+    struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
+
+    *out_path = NULL;
+    *out_hint = NULL;
+
+    pthread_mutex_lock(&f->state_mutex);
+    if (!f->lazy) {
+        pthread_mutex_unlock(&f->state_mutex);
+        return f->ic ? 0 : GrooveErrorInvalid;
+    }
+    *out_path = av_strdup(f->path);
+    *out_hint = av_strdup(f->lazy_hint);
+    pthread_mutex_unlock(&f->state_mutex);
+
+    if (!*out_path || !*out_hint) {
+        av_freep(out_path);
+        av_freep(out_hint);
+        return GrooveErrorNoMem;
+    }
+    return 0;
+}
+
+int groove_file_lazy_probe(struct Groove *groove, char *path, char *hint,
+        struct GrooveFile **out_opened)
+{
+    *out_opened = NULL;
+
+    struct GrooveFile *opened = groove_file_create(groove);
+    int err = opened ? groove_file_open(opened, path, hint) : GrooveErrorNoMem;
+    if (err) {
+        av_log(NULL, AV_LOG_ERROR, "%s: unable to open restored file: %s\n",
+                hint, groove_strerror(err));
+        groove_file_destroy(opened);
+    } else {
+        *out_opened = opened;
+    }
+
+    av_free(path);
+    av_free(hint);
+    return err;
+}
+
+void groove_file_lazy_finish(struct GrooveFile *file, struct GrooveFile *opened) {
+    struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
+    struct GrooveFilePrivate *o = (struct GrooveFilePrivate *) opened;
+
+    if (!opened)
+        return;
+
+    pthread_mutex_lock(&f->state_mutex);
+    if (!f->lazy) {
+        pthread_mutex_unlock(&f->state_mutex);
+        groove_file_destroy(opened);
+        return;
+    }
+
+    // take over what groove_file_open made. the path, the seek request and
+    // the public fields stay as they are.
+    f->audio_stream_index = o->audio_stream_index;
+    f->ic = o->ic;
+    f->decoder = o->decoder;
+    f->audio_format = o->audio_format;
+    f->audio_st = o->audio_st;
+    f->avio_buf = o->avio_buf;
+    f->avio = o->avio;
+    f->audio_pkt = o->audio_pkt;
+    f->stdfile = o->stdfile;
+    f->prealloc_custom_io = o->prealloc_custom_io;
+    f->custom_io = &f->prealloc_custom_io;
+
+    // the callbacks were given the other file
+    f->ic->interrupt_callback.opaque = f;
+    f->avio->opaque = f;
+    f->prealloc_custom_io.userdata = f;
+
+    // keep the restored tags, which may have been edited and which callers
+    // may be iterating
+    av_dict_free(&f->ic->metadata);
+    f->ic->metadata = f->lazy_metadata;
+    f->lazy_metadata = NULL;
+    f->lazy = false;
+    pthread_mutex_unlock(&f->state_mutex);
+
+    o->audio_stream_index = -1;
+    o->ic = NULL;
+    o->audio_st = NULL;
+    o->avio = NULL;
+    o->audio_pkt = NULL;
+    o->stdfile = NULL;
+    groove_file_destroy(opened);
+}
+
+int groove_file_open_lazy(struct GrooveFile *file) {
+    struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
+
+    char *path;
+    char *hint;
+    int err = groove_file_lazy_begin(file, &path, &hint);
+    if (err || !path)
+        return err;
+
+    struct GrooveFile *opened;
+    if ((err = groove_file_lazy_probe(f->groove, path, hint, &opened)))
+        return err;
+
+    groove_file_lazy_finish(file, opened);
+    return 0;
+}
+
 void groove_file_destroy(struct GrooveFile *file) {
     struct GrooveFilePrivate *f = (struct GrooveFilePrivate *)file;
 
@@ -286,29 +451,39 @@ void groove_file_destroy(struct GrooveFile *file) {
 
     groove_file_close(file);
 
+    pthread_mutex_destroy(&f->seek_mutex);
+    pthread_mutex_destroy(&f->state_mutex);
     DEALLOCATE(f);
 }
 
 
 const char *groove_file_short_names(struct GrooveFile *file) {
     struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
-    return f->ic->iformat->name;
+    pthread_mutex_lock(&f->state_mutex);
+    const char *short_names = f->lazy ? f->lazy_short_names : f->ic->iformat->name;
+    pthread_mutex_unlock(&f->state_mutex);
+    return short_names;
 }
 
 double groove_file_duration(struct GrooveFile *file) {
     struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
-    double time_base = av_q2d(f->audio_st->time_base);
-    return time_base * f->audio_st->duration;
+    double duration;
+    pthread_mutex_lock(&f->state_mutex);
+    if (f->lazy) {
+        duration = f->lazy_duration;
+    } else {
+        double time_base = av_q2d(f->audio_st->time_base);
+        duration = time_base * f->audio_st->duration;
+    }
+    pthread_mutex_unlock(&f->state_mutex);
+    return duration;
 }
 
 void groove_file_audio_format(struct GrooveFile *file, struct GrooveAudioFormat *audio_format) {
     struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
-
-    AVCodecContext *decode_ctx = f->decode_ctx;
-    audio_format->sample_rate = decode_ctx->sample_rate;
-    from_ffmpeg_layout(decode_ctx->ch_layout, &audio_format->layout);
-    audio_format->format = from_ffmpeg_format(decode_ctx->sample_fmt);
-    audio_format->is_planar = from_ffmpeg_format_planar(decode_ctx->sample_fmt);
+    pthread_mutex_lock(&f->state_mutex);
+    *audio_format = f->lazy ? f->lazy_audio_format : f->audio_format;
+    pthread_mutex_unlock(&f->state_mutex);
 }
 
 struct GrooveTag *groove_file_metadata_get(struct GrooveFile *file, const char *key,
@@ -318,15 +493,23 @@ struct GrooveTag *groove_file_metadata_get(struct GrooveFile *file, const char *
     const AVDictionaryEntry *e = (const AVDictionaryEntry *) prev;
     if (key && key[0] == 0)
         flags |= AV_DICT_IGNORE_SUFFIX;
-    return (struct GrooveTag *) av_dict_get(f->ic->metadata, key, e, flags);
+    pthread_mutex_lock(&f->state_mutex);
+    AVDictionary *metadata = f->lazy ? f->lazy_metadata : f->ic->metadata;
+    AVDictionaryEntry *tag = av_dict_get(metadata, key, e, flags);
+    pthread_mutex_unlock(&f->state_mutex);
+    return (struct GrooveTag *) tag;
 }
 
 int groove_file_metadata_set(struct GrooveFile *file, const char *key,
         const char *value, int flags)
 {
-    file->dirty = 1;
     struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
-    return av_dict_set(&f->ic->metadata, key, value, flags);
+    pthread_mutex_lock(&f->state_mutex);
+    file->dirty = 1;
+    AVDictionary **metadata = f->lazy ? &f->lazy_metadata : &f->ic->metadata;
+    int err = av_dict_set(metadata, key, value, flags);
+    pthread_mutex_unlock(&f->state_mutex);
+    return err;
 }
 
 const char *groove_tag_key(struct GrooveTag *tag) {
@@ -352,6 +535,7 @@ static void cleanup_save(struct GrooveFile *file) {
         avformat_free_context(f->oc);
         f->oc = NULL;
     }
+    avcodec_free_context(&f->save_decode_ctx);
     if (f->encode_ctx) {
         avcodec_free_context(&f->encode_ctx);
     }
@@ -360,6 +544,10 @@ static void cleanup_save(struct GrooveFile *file) {
 int groove_file_save_as(struct GrooveFile *file, const char *filename) {
     struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
 
+    int err;
+    if ((err = groove_file_open_lazy(file)))
+        return err;
+
     // detect output format
     const AVOutputFormat *ofmt = av_guess_format(f->ic->iformat->name, f->ic->url, NULL);
     if (!ofmt) {
@@ -373,8 +561,8 @@ int groove_file_save_as(struct GrooveFile *file, const char *filename) {
         return GrooveErrorNoMem;
     }
 
-    f->decode_ctx = avcodec_alloc_context3(f->decoder);
-    if (!f->decode_ctx) {
+    f->save_decode_ctx = avcodec_alloc_context3(f->decoder);
+    if (!f->save_decode_ctx) {
         cleanup_save(file);
         return GrooveErrorNoMem;
     }
@@ -420,7 +608,7 @@ int groove_file_save_as(struct GrooveFile *file, const char *filename) {
         out_stream->disposition = in_stream->disposition;
         out_stream->time_base = in_stream->time_base;
 
-        AVCodecContext *icodec = f->decode_ctx;
+        AVCodecContext *icodec = f->save_decode_ctx;
         AVCodecContext *ocodec = f->encode_ctx;
         ocodec->bits_per_raw_sample    = icodec->bits_per_raw_sample;
         ocodec->chroma_sample_location = icodec->chroma_sample_location;
@@ -527,6 +715,10 @@ int groove_file_save(struct GrooveFile *file) {
 
     struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
 
+    int err;
+    if ((err = groove_file_open_lazy(file)))
+        return err;
+
     int temp_filename_len;
     char *temp_filename = groove_create_rand_name(f->groove,
             &temp_filename_len, f->ic->url, strlen(f->ic->url));
@@ -536,7 +728,6 @@ int groove_file_save(struct GrooveFile *file) {
         return GrooveErrorNoMem;
     }
 
-    int err;
     if ((err = groove_file_save_as(file, temp_filename))) {
         cleanup_save(file);
         return err;
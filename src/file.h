@@ -16,6 +16,7 @@
 
 struct AVCodec;
 struct AVCodecContext;
+struct AVDictionary;
 struct AVFormatContext;
 struct AVIOContext;
 struct AVPacket;
@@ -24,19 +25,30 @@ struct AVStream;
 struct GrooveFilePrivate {
     struct GrooveFile externals;
     struct Groove *groove;
+    // The mutexes live as long as the file. Everything after them is reset
+    // when the file is closed.
+    // protects lazy, the lazy fields and ic->metadata, and the move from
+    // the lazy state to the open one
+    pthread_mutex_t state_mutex;
+    // protects the seek request fields below
+    pthread_mutex_t seek_mutex;
     int audio_stream_index;
     struct GrooveAtomicBool abort_request; // true when we're closing the file
     struct AVFormatContext *ic;
+    // borrowed from the Groove decoder pool while the file is being decoded.
+    // NULL otherwise.
     struct AVCodecContext *decode_ctx;
     const struct AVCodec *decoder;
+    // what the decoder produces, found out when the file is opened
+    struct GrooveAudioFormat audio_format;
     struct AVStream *audio_st;
     unsigned char *avio_buf;
     struct AVIOContext *avio;
     struct GrooveCustomIo *custom_io;
 
-    // this mutex protects the fields in this block
-    pthread_mutex_t seek_mutex;
+    // seek request, see seek_mutex
     int64_t seek_pos; // -1 if no seek request
+    int64_t seek_byte_pos; // if >= 0, try seeking to this byte offset first
     int seek_flush; // whether the seek request wants us to flush the buffer
     bool ever_seeked;
 
@@ -46,12 +58,56 @@ struct GrooveFilePrivate {
 
     // state while saving
     struct AVFormatContext *oc;
+    struct AVCodecContext *save_decode_ctx;
     struct AVCodecContext *encode_ctx;
     int tempfile_exists;
 
     int paused;
     struct GrooveCustomIo prealloc_custom_io;
     FILE *stdfile;
+    // the path given to groove_file_open. NULL for custom IO.
+    char *path;
+    // byte offset of the packet that produced audio_clock, or -1 if unknown
+    int64_t clock_byte_pos;
+
+    // A lazy file was restored from a playlist snapshot and has not been
+    // opened yet. These fields answer queries until groove_file_open_lazy
+    // opens it for real. The strings stay allocated until the file is
+    // closed, because callers may still hold them: filename points to
+    // lazy_hint for the whole time, and lazy_metadata becomes ic->metadata.
+    bool lazy;
+    char *lazy_hint;
+    char *lazy_short_names;
+    double lazy_duration;
+    struct GrooveAudioFormat lazy_audio_format;
+    struct AVDictionary *lazy_metadata;
 };
 
+// Puts a closed file into the lazy state. Takes ownership of `metadata`.
+int groove_file_init_lazy(struct GrooveFile *file, const char *path,
+        const char *filename_hint, const char *short_names, double duration,
+        const struct GrooveAudioFormat *audio_format, struct AVDictionary *metadata);
+
+// Opens a lazy file. Returns 0 if the file is already open. Safe to call
+// from any thread while the file is alive.
+int groove_file_open_lazy(struct GrooveFile *file);
+
+// groove_file_open_lazy in steps, for callers that must not hold their own
+// locks while the file is read. groove_file_lazy_begin copies the path and
+// hint, or sets them to NULL if the file is not lazy. groove_file_lazy_probe
+// takes them and opens a separate file from them without touching `file`.
+// groove_file_lazy_finish moves that into `file`, or destroys it if `file`
+// was opened in the meantime. The first and last steps need `file` to be
+// alive; the probe does not.
+int groove_file_lazy_begin(struct GrooveFile *file, char **out_path, char **out_hint);
+int groove_file_lazy_probe(struct Groove *groove, char *path, char *hint,
+        struct GrooveFile **out_opened);
+void groove_file_lazy_finish(struct GrooveFile *file, struct GrooveFile *opened);
+
+// Borrows a decoder from the pool into GrooveFilePrivate::decode_ctx, unless
+// the file already has one. Returns 0 or a GrooveError.
+int groove_file_decoder_get(struct GrooveFile *file);
+// Gives the file's decoder back to the pool, flushed.
+void groove_file_decoder_put(struct GrooveFile *file);
+
 #endif
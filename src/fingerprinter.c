@@ -5,11 +5,12 @@
  * See http://opensource.org/licenses/MIT
  */
 
-#include "groove_internal.h"
+#include "groove_private.h"
 #include "groove/fingerprinter.h"
 #include "queue.h"
 #include "util.h"
 #include "atomics.h"
+#include "worker_pool.h"
 
 #include <chromaprint.h>
 
@@ -27,7 +28,9 @@ struct GrooveFingerprinterPrivate {
     // index into all_track_states
     struct GrooveSink *sink;
     struct GrooveQueue *info_queue;
-    pthread_t thread_id;
+    // runs on the worker pool while the sink has buffers and the info
+    // queue has room
+    struct GrooveWorkerTask task;
 
     // info_head_mutex applies to variables inside this block.
     pthread_mutex_t info_head_mutex;
@@ -35,9 +38,6 @@ struct GrooveFingerprinterPrivate {
     // current playlist item pointer
     struct GroovePlaylistItem *info_head;
     double info_pos;
-    // analyze_thread waits on this when the info queue is full
-    pthread_cond_t drain_cond;
-    char drain_cond_inited;
     // how many items are in the queue
     int info_queue_count;
     double track_duration;
@@ -75,8 +75,71 @@ static int emit_track_info(struct GrooveFingerprinterPrivate *p) {
     return 0;
 }
 
-static void *print_thread(void *arg) {
-    struct GrooveFingerprinterPrivate *p = (struct GrooveFingerprinterPrivate *)arg;
+// call with info_head_mutex held
+static void process_end(struct GrooveFingerprinterPrivate *p) {
+    // last file info
+    emit_track_info(p);
+
+    // send album info
+    struct GrooveFingerprinterInfo *info = ALLOCATE(struct GrooveFingerprinterInfo, 1);
+    if (info) {
+        info->duration = p->album_duration;
+        groove_queue_put(p->info_queue, info);
+    } else {
+        av_log(NULL, AV_LOG_ERROR, "unable to allocate album fingerprint info\n");
+    }
+
+    p->album_duration = 0.0;
+
+    p->info_head = NULL;
+    p->info_pos = -1.0;
+}
+
+// call with info_head_mutex held
+static void process_buffer(struct GrooveFingerprinterPrivate *p, struct GrooveBuffer *buffer) {
+    if (buffer->item != p->info_head) {
+        if (p->info_head) {
+            emit_track_info(p);
+        }
+        if (!chromaprint_start(p->chroma_ctx, 44100, 2)) {
+            av_log(NULL, AV_LOG_ERROR, "unable to start fingerprint\n");
+        }
+        p->track_duration = 0.0;
+        p->info_head = buffer->item;
+        p->info_pos = buffer->pos;
+    }
+
+    double buffer_duration = buffer->frame_count / (double)buffer->format.sample_rate;
+    p->track_duration += buffer_duration;
+    p->album_duration += buffer_duration;
+    if (!chromaprint_feed(p->chroma_ctx, (const int16_t *)buffer->data[0], buffer->frame_count * 2)) {
+        av_log(NULL, AV_LOG_ERROR, "unable to feed fingerprint\n");
+    }
+}
+
+// called on the decode thread when process_inline is set
+static void sink_process(struct GrooveSink *sink, struct GrooveBuffer *buffer) {
+    struct GrooveFingerprinterPrivate *p = (struct GrooveFingerprinterPrivate *)sink->userdata;
+
+    pthread_mutex_lock(&p->info_head_mutex);
+    if (buffer)
+        process_buffer(p, buffer);
+    else
+        process_end(p);
+    pthread_mutex_unlock(&p->info_head_mutex);
+}
+
+static void schedule_task(struct GrooveFingerprinterPrivate *p) {
+    int err;
+    if ((err = groove_worker_pool_schedule(&p->groove->worker_pool, &p->task)))
+        av_log(NULL, AV_LOG_ERROR, "fingerprinter: unable to schedule: %s\n", groove_strerror(err));
+}
+
+// Fingerprints what the sink has until it runs dry or the info queue is
+// full. Putting a buffer in the sink or taking info out of the queue
+// schedules this again.
+static void print_task(struct GrooveWorkerTask *task) {
+    struct GrooveFingerprinterPrivate *p = (struct GrooveFingerprinterPrivate *)task->context;
     struct GrooveFingerprinter *printer = &p->externals;
 
     struct GrooveBuffer *buffer;
@@ -84,38 +147,20 @@ static void *print_thread(void *arg) {
         pthread_mutex_lock(&p->info_head_mutex);
 
         if (p->info_queue_count >= printer->info_queue_size) {
-            pthread_cond_wait(&p->drain_cond, &p->info_head_mutex);
             pthread_mutex_unlock(&p->info_head_mutex);
-            continue;
+            break;
         }
 
-        // we definitely want to unlock the mutex while we wait for the
-        // next buffer. Otherwise there will be a deadlock when sink_flush or
-        // sink_purge is called.
+        // the mutex must not be held while getting the buffer. Otherwise
+        // there will be a deadlock when sink_flush or sink_purge is called.
         pthread_mutex_unlock(&p->info_head_mutex);
 
-        int result = groove_sink_buffer_get(p->sink, &buffer, 1);
+        int result = groove_sink_buffer_get(p->sink, &buffer, 0);
 
         pthread_mutex_lock(&p->info_head_mutex);
 
         if (result == GROOVE_BUFFER_END) {
-            // last file info
-            emit_track_info(p);
-
-            // send album info
-            struct GrooveFingerprinterInfo *info = ALLOCATE(struct GrooveFingerprinterInfo, 1);
-            if (info) {
-                info->duration = p->album_duration;
-                groove_queue_put(p->info_queue, info);
-            } else {
-                av_log(NULL, AV_LOG_ERROR, "unable to allocate album fingerprint info\n");
-            }
-
-            p->album_duration = 0.0;
-
-            p->info_head = NULL;
-            p->info_pos = -1.0;
-
+            process_end(p);
             pthread_mutex_unlock(&p->info_head_mutex);
             continue;
         }
@@ -125,30 +170,11 @@ static void *print_thread(void *arg) {
             break;
         }
 
-        if (buffer->item != p->info_head) {
-            if (p->info_head) {
-                emit_track_info(p);
-            }
-            if (!chromaprint_start(p->chroma_ctx, 44100, 2)) {
-                av_log(NULL, AV_LOG_ERROR, "unable to start fingerprint\n");
-            }
-            p->track_duration = 0.0;
-            p->info_head = buffer->item;
-            p->info_pos = buffer->pos;
-        }
-
-        double buffer_duration = buffer->frame_count / (double)buffer->format.sample_rate;
-        p->track_duration += buffer_duration;
-        p->album_duration += buffer_duration;
-        if (!chromaprint_feed(p->chroma_ctx, (const int16_t *)buffer->data[0], buffer->frame_count * 2)) {
-            av_log(NULL, AV_LOG_ERROR, "unable to feed fingerprint\n");
-        }
+        process_buffer(p, buffer);
 
         pthread_mutex_unlock(&p->info_head_mutex);
         groove_buffer_unref(buffer);
     }
-
-    return NULL;
 }
 
 static void info_queue_cleanup(struct GrooveQueue* queue, void *obj) {
@@ -169,8 +195,8 @@ static void info_queue_get(struct GrooveQueue *queue, void *obj) {
 
     p->info_queue_count -= 1;
 
-    if (p->info_queue_count < printer->info_queue_size)
-        pthread_cond_signal(&p->drain_cond);
+    if (p->info_queue_count < printer->info_queue_size && !p->sink->process)
+        schedule_task(p);
 }
 
 static int info_queue_purge(struct GrooveQueue* queue, void *obj) {
@@ -192,8 +218,10 @@ static void sink_purge(struct GrooveSink *sink, struct GroovePlaylistItem *item)
         p->info_head = NULL;
         p->info_pos = -1.0;
     }
-    pthread_cond_signal(&p->drain_cond);
     pthread_mutex_unlock(&p->info_head_mutex);
+
+    if (!sink->process)
+        schedule_task(p);
 }
 
 static void sink_flush(struct GrooveSink *sink) {
@@ -204,9 +232,15 @@ static void sink_flush(struct GrooveSink *sink) {
     p->track_duration = 0.0;
     p->info_head = NULL;
     p->info_pos = -1.0;
-
-    pthread_cond_signal(&p->drain_cond);
     pthread_mutex_unlock(&p->info_head_mutex);
+
+    if (!sink->process)
+        schedule_task(p);
+}
+
+static void sink_filled(struct GrooveSink *sink) {
+    struct GrooveFingerprinterPrivate *p = (struct GrooveFingerprinterPrivate *)sink->userdata;
+    schedule_task(p);
 }
 
 struct GrooveFingerprinter *groove_fingerprinter_create(struct Groove *groove) {
@@ -227,13 +261,6 @@ struct GrooveFingerprinter *groove_fingerprinter_create(struct Groove *groove) {
     }
     p->info_head_mutex_inited = 1;
 
-    if (pthread_cond_init(&p->drain_cond, NULL) != 0) {
-        groove_fingerprinter_destroy(printer);
-        av_log(NULL, AV_LOG_ERROR, "unable to create mutex condition\n");
-        return NULL;
-    }
-    p->drain_cond_inited = 1;
-
     p->info_queue = groove_queue_create();
     if (!p->info_queue) {
         groove_fingerprinter_destroy(printer);
@@ -260,9 +287,13 @@ struct GrooveFingerprinter *groove_fingerprinter_create(struct Groove *groove) {
     audio_format.is_planar = false;
 
     groove_sink_set_only_format(p->sink, &audio_format);
+    // convert on the worker pool rather than the decode thread
+    p->sink->flags |= GrooveSinkFlagConvertOnGet;
+    groove_sink_set_resample_preset(p->sink, GrooveResamplePresetFastest);
     p->sink->userdata = printer;
     p->sink->purge = sink_purge;
     p->sink->flush = sink_flush;
+    p->sink->filled = sink_filled;
 
     // set some defaults
     printer->info_queue_size = INT_MAX;
@@ -286,9 +317,6 @@ void groove_fingerprinter_destroy(struct GrooveFingerprinter *printer) {
     if (p->info_head_mutex_inited)
         pthread_mutex_destroy(&p->info_head_mutex);
 
-    if (p->drain_cond_inited)
-        pthread_cond_destroy(&p->drain_cond);
-
     DEALLOCATE(p);
 }
 
@@ -306,15 +334,26 @@ int groove_fingerprinter_attach(struct GrooveFingerprinter *printer,
         return GrooveErrorNoMem;
     }
 
+    if (printer->process_inline) {
+        p->sink->process = sink_process;
+    } else {
+        p->sink->process = NULL;
+        // convert on the worker pool rather than the decode thread
+        p->sink->flags |= GrooveSinkFlagConvertOnGet;
+    }
+    groove_worker_task_init(&p->task, print_task, p);
+
     int err;
     if ((err = groove_sink_attach(p->sink, playlist))) {
         groove_fingerprinter_detach(printer);
         return err;
     }
 
-    if (pthread_create(&p->thread_id, NULL, print_thread, printer)) {
+    if (!p->sink->process &&
+        (err = groove_worker_pool_schedule(&p->groove->worker_pool, &p->task)))
+    {
         groove_fingerprinter_detach(printer);
-        return GrooveErrorSystemResources;
+        return err;
     }
 
     return 0;
@@ -324,11 +363,10 @@ int groove_fingerprinter_detach(struct GrooveFingerprinter *printer) {
     struct GrooveFingerprinterPrivate *p = (struct GrooveFingerprinterPrivate *) printer;
 
     GROOVE_ATOMIC_STORE(p->abort_request, true);
+    groove_worker_task_cancel(&p->groove->worker_pool, &p->task);
     groove_sink_detach(p->sink);
     groove_queue_flush(p->info_queue);
     groove_queue_abort(p->info_queue);
-    pthread_cond_signal(&p->drain_cond);
-    pthread_join(p->thread_id, NULL);
 
     printer->playlist = NULL;
 
@@ -367,6 +405,11 @@ int groove_fingerprinter_info_peek(struct GrooveFingerprinter *printer,
     return groove_queue_peek(p->info_queue, block);
 }
 
+int groove_fingerprinter_info_get_fd(struct GrooveFingerprinter *printer) {
+    struct GrooveFingerprinterPrivate *p = (struct GrooveFingerprinterPrivate *) printer;
+    return groove_queue_get_fd(p->info_queue);
+}
+
 void groove_fingerprinter_position(struct GrooveFingerprinter *printer,
         struct GroovePlaylistItem **item, double *seconds)
 {
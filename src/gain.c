@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of libgroove, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#include "gain.h"
+#include "util.h"
+
+#include <math.h>
+
+#include <libavutil/frame.h>
+
+// how long it takes to move from one gain value to the next
+static const double ramp_seconds = 0.02;
+
+// Samples above this level are compressed smoothly towards 1.0. This is the
+// -2 dB knee of the compand filter this replaces.
+static const float limit_threshold = 0.7943282f;
+static const double limit_threshold_dbl = 0.7943282347242815;
+
+// The kernels below keep branches and library calls out of their loops so
+// that the compiler can vectorize them: the limiter is written without
+// comparisons, the integer conversions round with a truncating cast instead
+// of lrint, which may set errno, and each loop is specialized for whether
+// the limiter is on. Ramps are short, so only the constant gain loops are
+// kept flat across channels. s64 is the exception: before AVX-512 there is
+// no vector conversion between it and double.
+
+// Only the part of a sample above the threshold is compressed.
+static inline float soft_limit(float x) {
+    static const float scale = 1.0f / (1.0f - limit_threshold);
+    float a = fabsf(x);
+    float d = a - limit_threshold;
+    float excess = 0.5f * (d + fabsf(d));
+    float over = excess * scale;
+    return copysignf(a - excess + (1.0f - limit_threshold) * (over / (1.0f + over)), x);
+}
+
+static inline double soft_limit_dbl(double x) {
+    static const double scale = 1.0 / (1.0 - limit_threshold_dbl);
+    double a = fabs(x);
+    double d = a - limit_threshold_dbl;
+    double excess = 0.5 * (d + fabs(d));
+    double over = excess * scale;
+    return copysign(a - excess + (1.0 - limit_threshold_dbl) * (over / (1.0 + over)), x);
+}
+
+static inline float clamp_float(float x, float min, float max) {
+    return (x < min) ? min : ((x > max) ? max : x);
+}
+
+static inline double clamp_double(double x, double min, double max) {
+    return (x < min) ? min : ((x > max) ? max : x);
+}
+
+// These take a sample scaled to [-1.0, 1.0] and round it to nearest. The
+// rounding offset goes on before the clamp, which vectorizes where the
+// other order does not.
+static inline uint8_t to_u8(float x) {
+    x *= 128.0f;
+    x = clamp_float(x + copysignf(0.5f, x), -128.0f, 127.0f);
+    return (uint8_t)((int)x + 128);
+}
+
+static inline int16_t to_s16(float x) {
+    x *= 32768.0f;
+    return (int16_t)clamp_float(x + copysignf(0.5f, x), -32768.0f, 32767.0f);
+}
+
+static inline int32_t to_s32(double x) {
+    x *= 2147483648.0;
+    return (int32_t)clamp_double(x + copysign(0.5, x), -2147483648.0, 2147483647.0);
+}
+
+// the largest double below 2^63 is the top of the range, since 2^63 - 1
+// rounds up out of it
+static inline int64_t to_s64(double x) {
+    x *= 9223372036854775808.0;
+    return (int64_t)clamp_double(x + copysign(0.5, x), -9223372036854775808.0,
+            9223372036854774784.0);
+}
+
+// `channels` is the number of interleaved channels in this plane; 1 for
+// planar audio.
+static void gain_flt(float *restrict samples, int frame_count, int channels,
+        const float *restrict ramp, float value, bool limit)
+{
+    int sample_count = frame_count * channels;
+    if (ramp) {
+        for (int i = 0; i < frame_count; i += 1) {
+            for (int ch = 0; ch < channels; ch += 1)
+                samples[i * channels + ch] *= ramp[i];
+        }
+    } else {
+        for (int i = 0; i < sample_count; i += 1)
+            samples[i] *= value;
+    }
+    if (limit) {
+        for (int i = 0; i < sample_count; i += 1)
+            samples[i] = soft_limit(samples[i]);
+    }
+}
+
+static void gain_dbl(double *restrict samples, int frame_count, int channels,
+        const float *restrict ramp, double value, bool limit)
+{
+    int sample_count = frame_count * channels;
+    if (ramp) {
+        for (int i = 0; i < frame_count; i += 1) {
+            for (int ch = 0; ch < channels; ch += 1)
+                samples[i * channels + ch] *= ramp[i];
+        }
+    } else {
+        for (int i = 0; i < sample_count; i += 1)
+            samples[i] *= value;
+    }
+    if (limit) {
+        for (int i = 0; i < sample_count; i += 1)
+            samples[i] = soft_limit_dbl(samples[i]);
+    }
+}
+
+static void gain_u8(uint8_t *restrict samples, int frame_count, int channels,
+        const float *restrict ramp, float value, bool limit)
+{
+    const float scale = 1.0f / 128.0f;
+    int sample_count = frame_count * channels;
+    if (ramp) {
+        for (int i = 0; i < frame_count; i += 1) {
+            float g = ramp[i] * scale;
+            for (int ch = 0; ch < channels; ch += 1) {
+                int index = i * channels + ch;
+                float x = (samples[index] - 128) * g;
+                samples[index] = to_u8(limit ? soft_limit(x) : x);
+            }
+        }
+    } else if (limit) {
+        float g = value * scale;
+        for (int i = 0; i < sample_count; i += 1)
+            samples[i] = to_u8(soft_limit((samples[i] - 128) * g));
+    } else {
+        float g = value * scale;
+        for (int i = 0; i < sample_count; i += 1)
+            samples[i] = to_u8((samples[i] - 128) * g);
+    }
+}
+
+static void gain_s16(int16_t *restrict samples, int frame_count, int channels,
+        const float *restrict ramp, float value, bool limit)
+{
+    const float scale = 1.0f / 32768.0f;
+    int sample_count = frame_count * channels;
+    if (ramp) {
+        for (int i = 0; i < frame_count; i += 1) {
+            float g = ramp[i] * scale;
+            for (int ch = 0; ch < channels; ch += 1) {
+                int index = i * channels + ch;
+                float x = samples[index] * g;
+                samples[index] = to_s16(limit ? soft_limit(x) : x);
+            }
+        }
+    } else if (limit) {
+        float g = value * scale;
+        for (int i = 0; i < sample_count; i += 1)
+            samples[i] = to_s16(soft_limit(samples[i] * g));
+    } else {
+        float g = value * scale;
+        for (int i = 0; i < sample_count; i += 1)
+            samples[i] = to_s16(samples[i] * g);
+    }
+}
+
+static void gain_s32(int32_t *restrict samples, int frame_count, int channels,
+        const float *restrict ramp, double value, bool limit)
+{
+    const double scale = 1.0 / 2147483648.0;
+    int sample_count = frame_count * channels;
+    if (ramp) {
+        for (int i = 0; i < frame_count; i += 1) {
+            double g = ramp[i] * scale;
+            for (int ch = 0; ch < channels; ch += 1) {
+                int index = i * channels + ch;
+                double x = samples[index] * g;
+                samples[index] = to_s32(limit ? soft_limit_dbl(x) : x);
+            }
+        }
+    } else if (limit) {
+        double g = value * scale;
+        for (int i = 0; i < sample_count; i += 1)
+            samples[i] = to_s32(soft_limit_dbl(samples[i] * g));
+    } else {
+        double g = value * scale;
+        for (int i = 0; i < sample_count; i += 1)
+            samples[i] = to_s32(samples[i] * g);
+    }
+}
+
+static void gain_s64(int64_t *restrict samples, int frame_count, int channels,
+        const float *restrict ramp, double value, bool limit)
+{
+    const double scale = 1.0 / 9223372036854775808.0;
+    int sample_count = frame_count * channels;
+    if (ramp) {
+        for (int i = 0; i < frame_count; i += 1) {
+            double g = ramp[i] * scale;
+            for (int ch = 0; ch < channels; ch += 1) {
+                int index = i * channels + ch;
+                double x = samples[index] * g;
+                samples[index] = to_s64(limit ? soft_limit_dbl(x) : x);
+            }
+        }
+    } else if (limit) {
+        double g = value * scale;
+        for (int i = 0; i < sample_count; i += 1)
+            samples[i] = to_s64(soft_limit_dbl(samples[i] * g));
+    } else {
+        double g = value * scale;
+        for (int i = 0; i < sample_count; i += 1)
+            samples[i] = to_s64(samples[i] * g);
+    }
+}
+
+void groove_gain_init(struct GrooveGain *gain, double value) {
+    memset(gain, 0, sizeof(struct GrooveGain));
+    gain->current = value;
+    gain->target = value;
+}
+
+void groove_gain_deinit(struct GrooveGain *gain) {
+    DEALLOCATE(gain->ramp);
+    gain->ramp = NULL;
+    gain->ramp_capacity = 0;
+}
+
+void groove_gain_set(struct GrooveGain *gain, double value, bool limit, bool immediate) {
+    if (value < 0.0)
+        value = 0.0;
+    gain->limit = limit;
+    if (immediate) {
+        gain->current = value;
+        gain->target = value;
+        gain->step = 0.0;
+    } else if (value != gain->target) {
+        gain->target = value;
+        gain->step = 0.0;
+    }
+}
+
+bool groove_gain_is_identity(const struct GrooveGain *gain) {
+    return gain->current == 1.0 && gain->target == 1.0 && !gain->limit;
+}
+
+// Fills gain->ramp with the gain of each sample and advances current.
+static int compute_ramp(struct GrooveGain *gain, int frame_count, int sample_rate) {
+    if (frame_count > gain->ramp_capacity) {
+        float *new_ramp = REALLOCATE_NONZERO(float, gain->ramp, frame_count);
+        if (!new_ramp)
+            return GrooveErrorNoMem;
+        gain->ramp = new_ramp;
+        gain->ramp_capacity = frame_count;
+    }
+
+    if (gain->step == 0.0) {
+        double ramp_len = groove_max_double(1.0, ramp_seconds * sample_rate);
+        gain->step = (gain->target - gain->current) / ramp_len;
+    }
+
+    double g = gain->current;
+    double target = gain->target;
+    double step = gain->step;
+    for (int i = 0; i < frame_count; i += 1) {
+        g += step;
+        if ((step > 0.0 && g >= target) || (step < 0.0 && g <= target) || step == 0.0)
+            g = target;
+        gain->ramp[i] = (float)g;
+    }
+    gain->current = g;
+    if (g == target)
+        gain->step = 0.0;
+    return 0;
+}
+
+int groove_gain_apply(struct GrooveGain *gain, AVFrame *frame) {
+    if (groove_gain_is_identity(gain))
+        return 0;
+
+    if (av_frame_make_writable(frame) < 0)
+        return GrooveErrorNoMem;
+
+    int err;
+    int frame_count = frame->nb_samples;
+    const float *ramp = NULL;
+    if (gain->current != gain->target) {
+        if ((err = compute_ramp(gain, frame_count, frame->sample_rate)))
+            return err;
+        ramp = gain->ramp;
+    }
+    double value = gain->current;
+    bool limit = gain->limit;
+
+    enum AVSampleFormat sample_fmt = (enum AVSampleFormat)frame->format;
+    int channel_count = frame->ch_layout.nb_channels;
+    bool planar = av_sample_fmt_is_planar(sample_fmt);
+    int plane_count = planar ? channel_count : 1;
+    int plane_channels = planar ? 1 : channel_count;
+
+    for (int plane = 0; plane < plane_count; plane += 1) {
+        uint8_t *data = frame->extended_data[plane];
+        switch (av_get_packed_sample_fmt(sample_fmt)) {
+            case AV_SAMPLE_FMT_U8:
+                gain_u8(data, frame_count, plane_channels, ramp, (float)value, limit);
+                break;
+            case AV_SAMPLE_FMT_S16:
+                gain_s16((int16_t *)data, frame_count, plane_channels, ramp, (float)value, limit);
+                break;
+            case AV_SAMPLE_FMT_S32:
+                gain_s32((int32_t *)data, frame_count, plane_channels, ramp, value, limit);
+                break;
+            case AV_SAMPLE_FMT_S64:
+                gain_s64((int64_t *)data, frame_count, plane_channels, ramp, value, limit);
+                break;
+            case AV_SAMPLE_FMT_FLT:
+                gain_flt((float *)data, frame_count, plane_channels, ramp, (float)value, limit);
+                break;
+            case AV_SAMPLE_FMT_DBL:
+                gain_dbl((double *)data, frame_count, plane_channels, ramp, value, limit);
+                break;
+            default:
+                return GrooveErrorInvalidSampleFormat;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of libgroove, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#ifndef GROOVE_GAIN_H
+#define GROOVE_GAIN_H
+
+#include "groove_internal.h"
+
+#include <stdbool.h>
+
+struct AVFrame;
+
+// Applies a volume adjustment to audio frames in place, with an optional
+// soft limiter for when the adjustment could clip. A change of gain is
+// ramped over a few milliseconds instead of applied as a step, so it is
+// safe to change it at any time.
+struct GrooveGain {
+    double current;
+    double target;
+    // per sample change while ramping towards target. 0 means it has not been
+    // computed yet for the current target.
+    double step;
+    bool limit;
+    // scratch space for the per sample gain of a ramp
+    float *ramp;
+    int ramp_capacity;
+};
+
+void groove_gain_init(struct GrooveGain *gain, double value);
+void groove_gain_deinit(struct GrooveGain *gain);
+
+// If immediate is true the new value applies from the next sample on,
+// otherwise the gain ramps to it.
+void groove_gain_set(struct GrooveGain *gain, double value, bool limit, bool immediate);
+
+// Returns true if groove_gain_apply would not change any samples.
+bool groove_gain_is_identity(const struct GrooveGain *gain);
+
+// The frame is made writable if it is not already.
+// Returns 0 or a GrooveError.
+int groove_gain_apply(struct GrooveGain *gain, struct AVFrame *frame);
+
+#endif
@@ -64,11 +64,31 @@ int groove_create(struct Groove **out_groove) {
         return err;
     }
 
+    if ((err = groove_decoder_pool_init(&groove->decoder_pool))) {
+        groove_destroy(groove);
+        return err;
+    }
+
+    if ((err = groove_buffer_pool_init(&groove->buffer_pool))) {
+        groove_destroy(groove);
+        return err;
+    }
+
+    if ((err = groove_worker_pool_init(&groove->worker_pool))) {
+        groove_destroy(groove);
+        return err;
+    }
+
     *out_groove = groove;
     return 0;
 }
 
 void groove_destroy(struct Groove *groove) {
+    if (!groove)
+        return;
+    groove_worker_pool_deinit(&groove->worker_pool);
+    groove_decoder_pool_deinit(&groove->decoder_pool);
+    groove_buffer_pool_deinit(&groove->buffer_pool);
     DEALLOCATE(groove);
 }
 
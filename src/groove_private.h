@@ -9,9 +9,14 @@
 #define GROOVE_GROOVE_PRIVATE_H
 
 #include "groove_internal.h"
+#include "decoder_pool.h"
+#include "buffer.h"
+#include "worker_pool.h"
 
 struct Groove {
-    int trash; // exists to make the struct non-empty
+    struct GrooveDecoderPool decoder_pool;
+    struct GrooveBufferPool buffer_pool;
+    struct GrooveWorkerPool worker_pool;
 };
 
 #endif
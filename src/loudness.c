@@ -5,11 +5,12 @@
  * See http://opensource.org/licenses/MIT
  */
 
-#include "groove_internal.h"
+#include "groove_private.h"
 #include "groove/loudness.h"
 #include "queue.h"
 #include "util.h"
 #include "atomics.h"
+#include "worker_pool.h"
 
 #include <ebur128.h>
 
@@ -29,7 +30,9 @@ struct GrooveLoudnessDetectorPrivate {
     ebur128_state **all_track_states;
     struct GrooveSink *sink;
     struct GrooveQueue *info_queue;
-    pthread_t thread_id;
+    // runs on the worker pool while the sink has buffers and the info
+    // queue has room
+    struct GrooveWorkerTask task;
 
     // info_head_mutex applies to variables inside this block.
     pthread_mutex_t info_head_mutex;
@@ -37,9 +40,6 @@ struct GrooveLoudnessDetectorPrivate {
     // current playlist item pointer
     struct GroovePlaylistItem *info_head;
     double info_pos;
-    // analyze_thread waits on this when the info queue is full
-    pthread_cond_t drain_cond;
-    bool drain_cond_inited;
     // how many items are in the queue
     int info_queue_count;
     double album_peak;
@@ -93,59 +93,120 @@ static int resize_state_history(struct GrooveLoudnessDetectorPrivate *d) {
     return 0;
 }
 
-static void *detect_thread(void *arg) {
-    struct GrooveLoudnessDetectorPrivate *d = (struct GrooveLoudnessDetectorPrivate *)arg;
+// call with info_head_mutex held
+static void process_end(struct GrooveLoudnessDetectorPrivate *d) {
     struct GrooveLoudnessDetector *detector = &d->externals;
-    struct GrooveBuffer *buffer;
 
-    pthread_mutex_lock(&d->info_head_mutex);
-    while (!GROOVE_ATOMIC_LOAD(d->abort_request)) {
-        if (d->info_queue_count >= detector->info_queue_size) {
-            pthread_cond_wait(&d->drain_cond, &d->info_head_mutex);
-            continue;
+    // last file info
+    emit_track_info(d);
+
+    // send album info
+    struct GrooveLoudnessDetectorInfo *info = ALLOCATE(struct GrooveLoudnessDetectorInfo, 1);
+    if (info) {
+        info->duration = d->album_duration;
+        if (!detector->disable_album) {
+            ebur128_loudness_global_multiple(d->all_track_states, d->cur_track_index + 1,
+                    &info->loudness);
         }
+        info->peak = d->album_peak;
+        groove_queue_put(d->info_queue, info);
+    } else {
+        av_log(NULL, AV_LOG_ERROR, "unable to allocate album loudness info\n");
+    }
 
-        // we definitely want to unlock the mutex while we wait for the
-        // next buffer. Otherwise there will be a deadlock when sink_flush or
-        // sink_purge is called.
-        pthread_mutex_unlock(&d->info_head_mutex);
+    if (!detector->disable_album) {
+        for (int i = 0; i <= d->cur_track_index; i += 1) {
+            if (d->all_track_states[i])
+                ebur128_destroy(&d->all_track_states[i]);
+        }
+        d->cur_track_index = 0;
+    }
 
-        int result = groove_sink_buffer_get(d->sink, &buffer, 1);
+    d->album_peak = 0.0;
+    d->album_duration = 0.0;
 
-        pthread_mutex_lock(&d->info_head_mutex);
+    d->info_head = NULL;
+    d->info_pos = -1.0;
+}
 
-        if (result == GROOVE_BUFFER_END) {
-            // last file info
-            emit_track_info(d);
+// call with info_head_mutex held
+static void process_buffer(struct GrooveLoudnessDetectorPrivate *d, struct GrooveBuffer *buffer) {
+    struct GrooveLoudnessDetector *detector = &d->externals;
 
-            // send album info
-            struct GrooveLoudnessDetectorInfo *info = ALLOCATE(struct GrooveLoudnessDetectorInfo, 1);
-            if (info) {
-                info->duration = d->album_duration;
-                if (!detector->disable_album) {
-                    ebur128_loudness_global_multiple(d->all_track_states, d->cur_track_index + 1,
-                            &info->loudness);
-                }
-                info->peak = d->album_peak;
-                groove_queue_put(d->info_queue, info);
+    if (buffer->item != d->info_head) {
+        if (d->all_track_states[d->cur_track_index]) {
+            emit_track_info(d);
+            if (detector->disable_album) {
+                ebur128_destroy(&d->all_track_states[d->cur_track_index]);
             } else {
-                av_log(NULL, AV_LOG_ERROR, "unable to allocate album loudness info\n");
-            }
-
-            if (!detector->disable_album) {
-                for (int i = 0; i <= d->cur_track_index; i += 1) {
-                    if (d->all_track_states[i])
-                        ebur128_destroy(&d->all_track_states[i]);
+                d->cur_track_index += 1;
+                if (d->cur_track_index >= d->state_history_count) {
+                    av_log(NULL, AV_LOG_WARNING, "loudness scanner: resizing state history."
+                            " Unless you're loudness-scanning very large albums you might"
+                            " consider setting disable_album to 1.\n");
+                    resize_state_history(d);
                 }
-                d->cur_track_index = 0;
             }
+        }
+        d->all_track_states[d->cur_track_index] = ebur128_init(2, 44100,
+                EBUR128_MODE_TRUE_PEAK|EBUR128_MODE_I);
+        if (!d->all_track_states[d->cur_track_index]) {
+            av_log(NULL, AV_LOG_ERROR, "unable to allocate EBU R128 track context\n");
+        }
+        d->track_duration = 0.0;
+        d->info_head = buffer->item;
+        d->info_pos = buffer->pos;
+    }
+
+    double buffer_duration = buffer->frame_count / (double)buffer->format.sample_rate;
+    d->track_duration += buffer_duration;
+    d->album_duration += buffer_duration;
+    ebur128_add_frames_float(d->all_track_states[d->cur_track_index],
+            (float*)buffer->data[0], buffer->frame_count);
+}
+
+// called on the decode thread when process_inline is set
+static void sink_process(struct GrooveSink *sink, struct GrooveBuffer *buffer) {
+    struct GrooveLoudnessDetectorPrivate *d = (struct GrooveLoudnessDetectorPrivate *)sink->userdata;
+
+    pthread_mutex_lock(&d->info_head_mutex);
+    if (buffer)
+        process_buffer(d, buffer);
+    else
+        process_end(d);
+    pthread_mutex_unlock(&d->info_head_mutex);
+}
+
+static void schedule_task(struct GrooveLoudnessDetectorPrivate *d) {
+    int err;
+    if ((err = groove_worker_pool_schedule(&d->groove->worker_pool, &d->task))) {
+        av_log(NULL, AV_LOG_ERROR, "loudness detector: unable to schedule: %s\n",
+                groove_strerror(err));
+    }
+}
+
+// Measures what the sink has until it runs dry or the info queue is full.
+// Putting a buffer in the sink or taking info out of the queue schedules
+// this again.
+static void detect_task(struct GrooveWorkerTask *task) {
+    struct GrooveLoudnessDetectorPrivate *d = (struct GrooveLoudnessDetectorPrivate *)task->context;
+    struct GrooveLoudnessDetector *detector = &d->externals;
+    struct GrooveBuffer *buffer;
+
+    pthread_mutex_lock(&d->info_head_mutex);
+    while (!GROOVE_ATOMIC_LOAD(d->abort_request) &&
+            d->info_queue_count < detector->info_queue_size)
+    {
+        // the mutex must not be held while getting the buffer. Otherwise
+        // there will be a deadlock when sink_flush or sink_purge is called.
+        pthread_mutex_unlock(&d->info_head_mutex);
 
-            d->album_peak = 0.0;
-            d->album_duration = 0.0;
+        int result = groove_sink_buffer_get(d->sink, &buffer, 0);
 
-            d->info_head = NULL;
-            d->info_pos = -1.0;
+        pthread_mutex_lock(&d->info_head_mutex);
 
+        if (result == GROOVE_BUFFER_END) {
+            process_end(d);
             continue;
         }
 
@@ -153,42 +214,10 @@ static void *detect_thread(void *arg) {
             break;
         }
 
-        if (buffer->item != d->info_head) {
-            if (d->all_track_states[d->cur_track_index]) {
-                emit_track_info(d);
-                if (detector->disable_album) {
-                    ebur128_destroy(&d->all_track_states[d->cur_track_index]);
-                } else {
-                    d->cur_track_index += 1;
-                    if (d->cur_track_index >= d->state_history_count) {
-                        av_log(NULL, AV_LOG_WARNING, "loudness scanner: resizing state history."
-                                " Unless you're loudness-scanning very large albums you might"
-                                " consider setting disable_album to 1.\n");
-                        resize_state_history(d);
-                    }
-                }
-            }
-            d->all_track_states[d->cur_track_index] = ebur128_init(2, 44100,
-                    EBUR128_MODE_TRUE_PEAK|EBUR128_MODE_I);
-            if (!d->all_track_states[d->cur_track_index]) {
-                av_log(NULL, AV_LOG_ERROR, "unable to allocate EBU R128 track context\n");
-            }
-            d->track_duration = 0.0;
-            d->info_head = buffer->item;
-            d->info_pos = buffer->pos;
-        }
-
-        double buffer_duration = buffer->frame_count / (double)buffer->format.sample_rate;
-        d->track_duration += buffer_duration;
-        d->album_duration += buffer_duration;
-        ebur128_add_frames_float(d->all_track_states[d->cur_track_index],
-                (float*)buffer->data[0], buffer->frame_count);
-
+        process_buffer(d, buffer);
         groove_buffer_unref(buffer);
     }
     pthread_mutex_unlock(&d->info_head_mutex);
-
-    return NULL;
 }
 
 static void info_queue_cleanup(struct GrooveQueue* queue, void *obj) {
@@ -209,8 +238,8 @@ static void info_queue_get(struct GrooveQueue *queue, void *obj) {
 
     d->info_queue_count -= 1;
 
-    if (d->info_queue_count < detector->info_queue_size)
-        pthread_cond_signal(&d->drain_cond);
+    if (d->info_queue_count < detector->info_queue_size && !d->sink->process)
+        schedule_task(d);
 }
 
 static int info_queue_purge(struct GrooveQueue* queue, void *obj) {
@@ -232,8 +261,10 @@ static void sink_purge(struct GrooveSink *sink, struct GroovePlaylistItem *item)
         d->info_head = NULL;
         d->info_pos = -1.0;
     }
-    pthread_cond_signal(&d->drain_cond);
     pthread_mutex_unlock(&d->info_head_mutex);
+
+    if (!sink->process)
+        schedule_task(d);
 }
 
 static void sink_flush(struct GrooveSink *sink) {
@@ -249,9 +280,15 @@ static void sink_flush(struct GrooveSink *sink) {
     d->track_duration = 0.0;
     d->info_head = NULL;
     d->info_pos = -1.0;
-
-    pthread_cond_signal(&d->drain_cond);
     pthread_mutex_unlock(&d->info_head_mutex);
+
+    if (!sink->process)
+        schedule_task(d);
+}
+
+static void sink_filled(struct GrooveSink *sink) {
+    struct GrooveLoudnessDetectorPrivate *d = (struct GrooveLoudnessDetectorPrivate *)sink->userdata;
+    schedule_task(d);
 }
 
 struct GrooveLoudnessDetector *groove_loudness_detector_create(struct Groove *groove) {
@@ -272,13 +309,6 @@ struct GrooveLoudnessDetector *groove_loudness_detector_create(struct Groove *gr
     }
     d->info_head_mutex_inited = true;
 
-    if (pthread_cond_init(&d->drain_cond, NULL) != 0) {
-        groove_loudness_detector_destroy(detector);
-        av_log(NULL, AV_LOG_ERROR, "unable to create mutex condition\n");
-        return NULL;
-    }
-    d->drain_cond_inited = true;
-
     d->info_queue = groove_queue_create();
     if (!d->info_queue) {
         groove_loudness_detector_destroy(detector);
@@ -305,9 +335,12 @@ struct GrooveLoudnessDetector *groove_loudness_detector_create(struct Groove *gr
     audio_format.is_planar = false;
 
     groove_sink_set_only_format(d->sink, &audio_format);
+    // convert on the worker pool rather than the decode thread
+    d->sink->flags |= GrooveSinkFlagConvertOnGet;
     d->sink->userdata = detector;
     d->sink->purge = sink_purge;
     d->sink->flush = sink_flush;
+    d->sink->filled = sink_filled;
 
     // set some defaults
     detector->info_queue_size = INT_MAX;
@@ -331,9 +364,6 @@ void groove_loudness_detector_destroy(struct GrooveLoudnessDetector *detector) {
     if (d->info_head_mutex_inited)
         pthread_mutex_destroy(&d->info_head_mutex);
 
-    if (d->drain_cond_inited)
-        pthread_cond_destroy(&d->drain_cond);
-
     DEALLOCATE(d);
 }
 
@@ -357,15 +387,26 @@ int groove_loudness_detector_attach(struct GrooveLoudnessDetector *detector,
     }
     memset(d->all_track_states, 0, sizeof(ebur128_state *) * d->state_history_count);
 
+    if (detector->process_inline) {
+        d->sink->process = sink_process;
+    } else {
+        d->sink->process = NULL;
+        // convert on the worker pool rather than the decode thread
+        d->sink->flags |= GrooveSinkFlagConvertOnGet;
+    }
+    groove_worker_task_init(&d->task, detect_task, d);
+
     int err;
     if ((err = groove_sink_attach(d->sink, playlist))) {
         groove_loudness_detector_detach(detector);
         return err;
     }
 
-    if (pthread_create(&d->thread_id, NULL, detect_thread, detector)) {
+    if (!d->sink->process &&
+        (err = groove_worker_pool_schedule(&d->groove->worker_pool, &d->task)))
+    {
         groove_loudness_detector_detach(detector);
-        return GrooveErrorSystemResources;
+        return err;
     }
 
     return 0;
@@ -375,11 +416,10 @@ int groove_loudness_detector_detach(struct GrooveLoudnessDetector *detector) {
     struct GrooveLoudnessDetectorPrivate *d = (struct GrooveLoudnessDetectorPrivate *) detector;
 
     GROOVE_ATOMIC_STORE(d->abort_request, true);
+    groove_worker_task_cancel(&d->groove->worker_pool, &d->task);
     groove_sink_detach(d->sink);
     groove_queue_flush(d->info_queue);
     groove_queue_abort(d->info_queue);
-    pthread_cond_signal(&d->drain_cond);
-    pthread_join(d->thread_id, NULL);
 
     detector->playlist = NULL;
 
@@ -423,6 +463,11 @@ int groove_loudness_detector_info_peek(struct GrooveLoudnessDetector *detector,
     return groove_queue_peek(d->info_queue, block);
 }
 
+int groove_loudness_detector_info_get_fd(struct GrooveLoudnessDetector *detector) {
+    struct GrooveLoudnessDetectorPrivate *d = (struct GrooveLoudnessDetectorPrivate *) detector;
+    return groove_queue_get_fd(d->info_queue);
+}
+
 void groove_loudness_detector_position(struct GrooveLoudnessDetector *detector,
         struct GroovePlaylistItem **item, double *seconds)
 {
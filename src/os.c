@@ -72,6 +72,10 @@
 #include <mach/mach.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
 struct GrooveOsThread {
 #if defined(GROOVE_OS_WINDOWS)
     HANDLE handle;
@@ -116,6 +120,15 @@ struct GrooveOsCond {
 };
 #endif
 
+struct GrooveOsNotify {
+#if !defined(GROOVE_OS_WINDOWS)
+    // the same eventfd on Linux, the two ends of a pipe elsewhere
+    int read_fd;
+    int write_fd;
+    bool is_set;
+#endif
+};
+
 #if defined(GROOVE_OS_WINDOWS)
 static INIT_ONCE win32_init_once = INIT_ONCE_STATIC_INIT;
 static double win32_time_resolution;
@@ -152,6 +165,17 @@ double groove_os_get_time(void) {
 #endif
 }
 
+int groove_os_cpu_count(void) {
+#if defined(GROOVE_OS_WINDOWS)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int count = info.dwNumberOfProcessors;
+#else
+    int count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return (count < 1) ? 1 : count;
+}
+
 #if defined(GROOVE_OS_WINDOWS)
 static DWORD WINAPI run_win32_thread(LPVOID userdata) {
     struct GrooveOsThread *thread = (struct GrooveOsThread *)userdata;
@@ -574,3 +598,81 @@ int groove_os_init(int (*init_once)(void)) {
 
     return 0;
 }
+
+int groove_os_notify_create(struct GrooveOsNotify **out_notify) {
+    *out_notify = NULL;
+#if defined(GROOVE_OS_WINDOWS)
+    return GrooveErrorSystemResources;
+#else
+    struct GrooveOsNotify *notify = ALLOCATE(struct GrooveOsNotify, 1);
+    if (!notify)
+        return GrooveErrorNoMem;
+
+#if defined(__linux__)
+    notify->read_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (notify->read_fd == -1) {
+        DEALLOCATE(notify);
+        return GrooveErrorSystemResources;
+    }
+    notify->write_fd = notify->read_fd;
+#else
+    int fds[2];
+    if (pipe(fds) == -1) {
+        DEALLOCATE(notify);
+        return GrooveErrorSystemResources;
+    }
+    for (int i = 0; i < 2; i += 1) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    notify->read_fd = fds[0];
+    notify->write_fd = fds[1];
+#endif
+
+    *out_notify = notify;
+    return 0;
+#endif
+}
+
+void groove_os_notify_destroy(struct GrooveOsNotify *notify) {
+    if (!notify)
+        return;
+
+#if !defined(GROOVE_OS_WINDOWS)
+    close(notify->read_fd);
+    if (notify->write_fd != notify->read_fd)
+        close(notify->write_fd);
+#endif
+
+    DEALLOCATE(notify);
+}
+
+int groove_os_notify_fd(struct GrooveOsNotify *notify) {
+#if defined(GROOVE_OS_WINDOWS)
+    return -1;
+#else
+    return notify->read_fd;
+#endif
+}
+
+void groove_os_notify_set(struct GrooveOsNotify *notify) {
+#if !defined(GROOVE_OS_WINDOWS)
+    if (notify->is_set)
+        return;
+    uint64_t one = 1;
+    // an eventfd takes 8 bytes, a pipe any amount
+    ssize_t amt = write(notify->write_fd, &one, sizeof(one));
+    (void)amt;
+    notify->is_set = true;
+#endif
+}
+
+void groove_os_notify_clear(struct GrooveOsNotify *notify) {
+#if !defined(GROOVE_OS_WINDOWS)
+    if (!notify->is_set)
+        return;
+    uint64_t value;
+    while (read(notify->read_fd, &value, sizeof(value)) > 0) {}
+    notify->is_set = false;
+#endif
+}
@@ -18,6 +18,9 @@ int groove_os_init(int (*init_once)(void));
 
 double groove_os_get_time(void);
 
+// how many processors are online, at least 1
+int groove_os_cpu_count(void);
+
 struct GrooveOsThread;
 int groove_os_thread_create(
         void (*run)(void *arg), void *arg,
@@ -48,4 +51,14 @@ void groove_os_cond_timed_wait(struct GrooveOsCond *cond,
 void groove_os_cond_wait(struct GrooveOsCond *cond,
         struct GrooveOsMutex *locked_mutex);
 
+// A file descriptor which is readable while the notifier is set, for event
+// loops to wait on. Set and clear do nothing if it already is set or clear;
+// the caller serializes them. Not available on Windows.
+struct GrooveOsNotify;
+int groove_os_notify_create(struct GrooveOsNotify **out_notify);
+void groove_os_notify_destroy(struct GrooveOsNotify *notify);
+int groove_os_notify_fd(struct GrooveOsNotify *notify);
+void groove_os_notify_set(struct GrooveOsNotify *notify);
+void groove_os_notify_clear(struct GrooveOsNotify *notify);
+
 #endif
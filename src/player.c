@@ -653,6 +653,11 @@ int groove_player_event_peek(struct GroovePlayer *player, int block) {
     return groove_queue_peek(p->eventq, block);
 }
 
+int groove_player_event_get_fd(struct GroovePlayer *player) {
+    struct GroovePlayerPrivate *p = (struct GroovePlayerPrivate *) player;
+    return groove_queue_get_fd(p->eventq);
+}
+
 int groove_player_set_gain(struct GroovePlayer *player, double gain) {
     struct GroovePlayerPrivate *p = (struct GroovePlayerPrivate *) player;
     player->gain = gain;
@@ -6,47 +6,174 @@
  */
 
 #include "file.h"
-#include "queue.h"
+#include "sink_log.h"
 #include "buffer.h"
 #include "util.h"
 #include "atomics.h"
+#include "gain.h"
+#include "shm_private.h"
+#include "groove/shm.h"
 
 #define __STDC_FORMAT_MACROS
 #include <pthread.h>
 #include <inttypes.h>
+#include <limits.h>
 
 #include <libavfilter/avfilter.h>
 #include <libavfilter/buffersrc.h>
 #include <libavfilter/buffersink.h>
 #include <libavutil/samplefmt.h>
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
 #include <libavcodec/avcodec.h>
 #include <libavcodec/packet.h>
 #include <libavformat/avformat.h>
 
+struct SinkStack {
+    struct GrooveSink *sink;
+    struct SinkStack *next;
+};
+
+struct SinkMap {
+    struct SinkStack *stack_head;
+    struct SinkMap *next;
+    // the buffers for the sinks in stack_head. shared with the copies of
+    // this entry that sink_map_clone makes.
+    struct GrooveSinkLog *log;
+};
+
 struct GrooveSinkPrivate {
     struct GrooveSink externals;
     struct Groove *groove;
-    struct GrooveQueue *audioq;
-    struct GrooveAtomicInt audioq_size; // in bytes
+    // position in the log of the sink map entry this sink is in
+    struct GrooveSinkLogReader reader;
     int min_audioq_size; // in bytes
-    struct GrooveAtomicBool audioq_contains_end;
     struct SoundIoSampleRateRange prealloc_sample_rate_range;
     // If >= 0, then this is a request to set buffer_size_bytes next
     // time the decoder grabs the decode_head_mutex.
     struct GrooveAtomicInt buffer_size_bytes_request;
+    // applies GrooveSink::gain to buffers as they are handed to this sink.
+    // protected by decode_head_mutex, and also by get_mutex for a shared
+    // reader, which applies it in groove_sink_buffer_get.
+    struct GrooveGain gain_stage;
+
+    // audio waiting to be sent as one buffer, with room for batch_capacity
+    // samples. see GrooveSink::min_buffer_duration and send_buffer_regrouped.
+    // protected by decode_head_mutex.
+    AVFrame *batch_frame;
+    int batch_capacity;
+    // sample data for the frames this sink's hand-off copies into. buffers
+    // are data_pool_size bytes, enough for the largest plane seen so far.
+    // used under get_mutex instead for a shared reader.
+    AVBufferPool *data_pool;
+    int data_pool_size;
+    struct GroovePlaylistItem *batch_item;
+    double batch_pos;
+
+    // serializes the work groove_sink_buffer_get does for this sink
+    pthread_mutex_t get_mutex;
+    bool get_mutex_inited;
+
+    // the rest is for GrooveSinkFlagConvertOnGet. used by
+    // groove_sink_buffer_get under get_mutex, and reset by flush and purge.
+    struct FilterGraph *convert_graph;
+    // a sink map containing only this sink, to build convert_graph from
+    struct SinkMap convert_map;
+    struct SinkStack convert_stack;
+    // the item of the audio in convert_graph
+    struct GroovePlaylistItem *convert_item;
+    // pos of the first buffer fed to convert_graph, and the number of
+    // samples it has put out since. they give the pos of each output.
+    double convert_pos;
+    int64_t convert_out_samples;
+    // input which ended convert_graph, waiting until the graph is drained.
+    // a buffer or end_of_q_sentinel.
+    struct GrooveBuffer *convert_pending;
+
+    // set by groove_sink_set_ring. the decode thread writes converted audio
+    // here instead of putting buffers in the log.
+    uint8_t *ring;
+    int ring_capacity;
+    // points at ring_own_indexes, or into the shared memory of a sink made
+    // by groove_sink_set_shm
+    struct GrooveRingIndexes *ring_indexes;
+    struct GrooveRingIndexes ring_own_indexes;
+    // set by groove_sink_set_shm. owns the memory of the ring.
+    struct GrooveShmWriter *shm;
+    // Audio which did not fit in the ring yet waits in the log, addressed to
+    // this sink, and the buffer being written goes here. Only touched by the
+    // decode thread.
+    struct GrooveBuffer *ring_partial;
+    int ring_partial_offset;
 };
 
-struct SinkStack {
-    struct GrooveSink *sink;
-    struct SinkStack *next;
+// The sink map is copy-on-write. Attach, detach and set_gain change a copy
+// and then swap it in, see sink_map_edit_commit.
+struct SinkMapEdit {
+    struct SinkMap *sink_map;
+    int sink_map_count;
+    // true if the change affects the filter graph
+    bool graph_changed;
 };
 
-struct SinkMap {
-    struct SinkStack *stack_head;
-    AVFilterContext *abuffersink_ctx;
-    struct SinkMap *next;
+// Changes the sample rate for one branch of a filter graph. This drives swr
+// itself rather than putting aresample in the graph, because libavfilter
+// has no way to reset a filter: a cached graph has to start from scratch
+// when it is used again.
+struct Resampler {
+    SwrContext *swr;
+    // the source of the branch in the graph, at the output rate
+    AVFilterContext *abuffer_ctx;
+    int sample_rate;
+    // pts of the next sample out, in 1 / sample_rate
+    int64_t next_pts;
+    // the swr options. resamplers with the same rate and options are
+    // interchangeable.
+    char args[128];
 };
 
+// A configured filter graph for one input format and one version of the
+// sink map. The playlist keeps a few of these around so that alternating
+// between formats does not rebuild the graph at every item boundary.
+struct FilterGraph {
+    AVFilterGraph *graph;
+    // the source for branches at the input rate. NULL if every branch is
+    // resampled.
+    AVFilterContext *abuffer_ctx;
+    struct Resampler *resamplers;
+    int resampler_count;
+    // one per sink map entry, in sink map order. NULL for entries which
+    // take decoded frames as they are.
+    AVFilterContext **abuffersink_ctxs;
+    int abuffersink_count;
+    int direct_count;
+    // true when every entry takes decoded frames as they are; graph is NULL.
+    bool bypass;
+    // set once a NULL frame has been sent. the graph cannot take more
+    // input after that so it is never reused.
+    bool eof;
+    // the item whose audio is inside the graph, or NULL if there is none.
+    // the resamplers and buffersinks with a fixed buffer_sample_count hold
+    // some back; filter_graph_finish lets it out.
+    struct GroovePlaylistItem *item;
+
+    // the input format and sink map this graph was built for
+    int sample_rate;
+    AVChannelLayout ch_layout;
+    enum AVSampleFormat sample_fmt;
+    AVRational time_base;
+    unsigned sink_map_generation;
+
+    // compared against other entries to find the least recently used one
+    uint64_t last_used;
+
+    // graphs can be built outside the decode thread, so they cannot share
+    // the playlist's scratch buffer
+    char strbuf[512];
+};
+
+#define FILTER_GRAPH_CACHE_SIZE 4
+
 struct GroovePlaylistPrivate {
     struct GroovePlaylist externals;
     struct Groove *groove;
@@ -57,25 +184,28 @@ struct GroovePlaylistPrivate {
     AVFrame *in_frame;
     struct GrooveAtomicBool paused;
 
-    int in_sample_rate;
-    AVChannelLayout in_channel_layout;
-    enum AVSampleFormat in_sample_fmt;
-    AVRational in_time_base;
-
     char strbuf[512];
-    AVFilterGraph *filter_graph;
-    AVFilterContext *abuffer_ctx;
+    // protected by decode_head_mutex
+    struct FilterGraph *filter_graph_cache[FILTER_GRAPH_CACHE_SIZE];
+    // the cache entry for the current input format, or NULL
+    struct FilterGraph *filter_graph;
+    uint64_t filter_graph_clock;
 
-    const AVFilter *volume_filter;
-    const AVFilter *compand_filter;
     const AVFilter *abuffer_filter;
     const AVFilter *asplit_filter;
     const AVFilter *aformat_filter;
     const AVFilter *abuffersink_filter;
+    // whether swr can use GrooveResamplerSoxr
+    bool soxr_available;
 
     pthread_mutex_t drain_cond_mutex;
     int drain_cond_mutex_inited;
 
+    // serializes changes to sink_map. held while a new filter graph is built
+    // so that decode_head_mutex is only needed for the swap itself.
+    pthread_mutex_t sink_map_mutex;
+    int sink_map_mutex_inited;
+
     // this mutex applies to the variables in this block
     pthread_mutex_t decode_head_mutex;
     int decode_head_mutex_inited;
@@ -88,22 +218,26 @@ struct GroovePlaylistPrivate {
     int sink_drain_cond_inited;
     // pointer to current playlist item being decoded
     struct GroovePlaylistItem *decode_head;
-    // desired volume for the volume filter
+    // the last GroovePlaylistItem::id given out
+    uint64_t last_item_id;
+    // desired volume for the gain stage
     double volume;
     // known true peak value
     double peak;
-    // set to 1 to trigger a rebuild
-    int rebuild_filter_graph_flag;
+    // applies volume to decoded frames before they reach the filter graph
+    struct GrooveGain volume_gain;
+    // the item volume_gain was last set for. compared, never dereferenced.
+    struct GroovePlaylistItem *volume_gain_item;
+    // incremented whenever the sink map changes in a way that affects the
+    // filter graph. cached graphs built for an older generation are stale.
+    unsigned sink_map_generation;
     // map audio format to list of sinks
     // for each map entry, use the first sink in the stack as the example
-    // of the audio format in that stack
+    // of the audio format in that stack. never modified in place; replaced
+    // under decode_head_mutex with sink_map_mutex held.
     struct SinkMap *sink_map;
     int sink_map_count;
 
-    // the value that was used to construct the filter graph
-    double filter_volume;
-    double filter_peak;
-
     // only touched by decode_thread, tells whether we have sent the end_of_q_sentinel
     int sent_end_of_q;
 
@@ -121,28 +255,18 @@ static int frame_size(const AVFrame *frame) {
         av_get_bytes_per_sample((enum AVSampleFormat)frame->format) * frame->nb_samples;
 }
 
-static struct GrooveBuffer *frame_to_groove_buffer(struct GroovePlaylist *playlist,
-        struct GrooveSink *sink, AVFrame *frame)
+static struct GrooveBuffer *create_frame_buffer(struct Groove *groove, AVFrame *frame,
+        struct GroovePlaylistItem *item, double pos)
 {
-    struct GrooveBufferPrivate *b = ALLOCATE(struct GrooveBufferPrivate, 1);
+    struct GrooveBufferPrivate *b = groove_buffer_create(groove);
 
     if (!b)
         return NULL;
 
     struct GrooveBuffer *buffer = &b->externals;
 
-    if (pthread_mutex_init(&b->mutex, NULL) != 0) {
-        DEALLOCATE(b);
-        return NULL;
-    }
-
-    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
-    struct GrooveFile *file = p->decode_head->file;
-
-    struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
-
-    buffer->item = p->decode_head;
-    buffer->pos = f->audio_clock;
+    buffer->item = item;
+    buffer->pos = pos;
 
     buffer->data = frame->extended_data;
     buffer->frame_count = frame->nb_samples;
@@ -158,383 +282,1431 @@ static struct GrooveBuffer *frame_to_groove_buffer(struct GroovePlaylist *playli
     return buffer;
 }
 
-static int send_frame_to_filter_graph(struct GroovePlaylist *playlist, AVFrame *frame) {
+static struct GrooveBuffer *frame_to_groove_buffer(struct GroovePlaylist *playlist,
+        struct GroovePlaylistItem *item, AVFrame *frame)
+{
     struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
-    int err;
+    struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) item->file;
+    return create_frame_buffer(p->groove, frame, item, f->audio_clock);
+}
 
-    if ((err = av_buffersrc_add_frame_flags(p->abuffer_ctx, frame, 0)) < 0) {
-        av_strerror(err, p->strbuf, sizeof(p->strbuf));
-        av_log(NULL, AV_LOG_ERROR, "error feeding the filtergraph: %s\n", p->strbuf);
-        if (err == AVERROR(ENOMEM)) {
+// Allocates sample data for `frame`, whose format, layout and nb_samples must
+// be set, from the sink's pool.
+static int sink_frame_get_buffer(struct GrooveSinkPrivate *s, AVFrame *frame) {
+    enum AVSampleFormat sample_fmt = (enum AVSampleFormat)frame->format;
+    int channels = frame->ch_layout.nb_channels;
+    int plane_count = av_sample_fmt_is_planar(sample_fmt) ? channels : 1;
+    if (plane_count > AV_NUM_DATA_POINTERS)
+        return av_frame_get_buffer(frame, 0);
+
+    int linesize;
+    int err = av_samples_get_buffer_size(&linesize, channels, frame->nb_samples, sample_fmt, 0);
+    if (err < 0)
+        return err;
+    if (!s->data_pool || linesize > s->data_pool_size) {
+        // buffers still out keep the old pool alive until they come back
+        av_buffer_pool_uninit(&s->data_pool);
+        s->data_pool = av_buffer_pool_init(linesize, NULL);
+        if (!s->data_pool)
+            return AVERROR(ENOMEM);
+        s->data_pool_size = linesize;
+    }
+
+    for (int i = 0; i < plane_count; i += 1) {
+        frame->buf[i] = av_buffer_pool_get(s->data_pool);
+        if (!frame->buf[i]) {
+            av_frame_unref(frame);
+            return AVERROR(ENOMEM);
+        }
+        frame->data[i] = frame->buf[i]->data;
+    }
+    frame->extended_data = frame->data;
+    frame->linesize[0] = linesize;
+    return 0;
+}
+
+// Returns a writable copy of `src` with its sample data from the sink's pool,
+// or NULL if out of memory.
+static AVFrame *sink_frame_copy(struct GrooveSinkPrivate *s, const AVFrame *src) {
+    AVFrame *frame = groove_frame_alloc(s->groove);
+    if (!frame)
+        return NULL;
+    frame->format = src->format;
+    frame->sample_rate = src->sample_rate;
+    frame->nb_samples = src->nb_samples;
+    if (av_channel_layout_copy(&frame->ch_layout, &src->ch_layout) < 0 ||
+        sink_frame_get_buffer(s, frame) < 0 ||
+        av_frame_copy(frame, src) < 0 ||
+        av_frame_copy_props(frame, src) < 0)
+    {
+        groove_frame_free(s->groove, &frame);
+        return NULL;
+    }
+    return frame;
+}
+
+// Sinks share buffers, so a sink with its own gain gets a copy with the gain
+// applied. Returns a new reference, or NULL if out of memory.
+static struct GrooveBuffer *apply_sink_gain(struct GroovePlaylist *playlist,
+        struct GrooveSink *sink, struct GrooveBuffer *buffer)
+{
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    struct GrooveBufferPrivate *b = (struct GrooveBufferPrivate *) buffer;
+
+    // a copy from the sink's pool is already writable, so the gain does not
+    // allocate another one
+    AVFrame *frame = sink_frame_copy(s, b->frame);
+    if (!frame)
+        return NULL;
+    if (groove_gain_apply(&s->gain_stage, frame) < 0) {
+        groove_frame_free(s->groove, &frame);
+        return NULL;
+    }
+    struct GrooveBuffer *gain_buffer = create_frame_buffer(s->groove, frame, buffer->item,
+            buffer->pos);
+    if (!gain_buffer) {
+        groove_frame_free(s->groove, &frame);
+        return NULL;
+    }
+    groove_buffer_ref(gain_buffer);
+    return gain_buffer;
+}
+
+static int ring_free_bytes(struct GrooveSinkPrivate *s) {
+    struct GrooveRingIndexes *indexes = s->ring_indexes;
+    int64_t fill = GROOVE_ATOMIC_LOAD(indexes->write_index) - GROOVE_ATOMIC_LOAD(indexes->read_index);
+    return s->ring_capacity - (int)fill;
+}
+
+// Copies as much of `data` into the ring as fits and returns how much that is.
+static int ring_write(struct GrooveSinkPrivate *s, const uint8_t *data, int size) {
+    int amount = groove_min_int(size, ring_free_bytes(s));
+    int64_t write_index = GROOVE_ATOMIC_LOAD(s->ring_indexes->write_index);
+    int offset = (int)(write_index % s->ring_capacity);
+    int first = groove_min_int(amount, s->ring_capacity - offset);
+    memcpy(s->ring + offset, data, first);
+    memcpy(s->ring, data + first, amount - first);
+    // the reader may look at the new audio once the index moves
+    GROOVE_ATOMIC_STORE(s->ring_indexes->write_index, write_index + amount);
+    if (s->shm)
+        groove_shm_writer_notify(s->shm);
+    return amount;
+}
+
+static void ring_set_end(struct GrooveSinkPrivate *s) {
+    struct GrooveRingIndexes *indexes = s->ring_indexes;
+    GROOVE_ATOMIC_STORE(indexes->end_index, GROOVE_ATOMIC_LOAD(indexes->write_index));
+    if (s->shm)
+        groove_shm_writer_notify(s->shm);
+}
+
+// Makes `buffer` the next one to write. Nothing else may be partly written.
+static void ring_begin(struct GrooveSinkPrivate *s, struct GrooveBuffer *buffer) {
+    s->ring_partial = buffer;
+    s->ring_partial_offset = 0;
+    if (s->shm)
+        groove_shm_writer_mark(s->shm, buffer->item, buffer->pos);
+}
+
+static void ring_drop_partial(struct GrooveSinkPrivate *s) {
+    if (s->ring_partial) {
+        groove_buffer_unref(s->ring_partial);
+        s->ring_partial = NULL;
+    }
+}
+
+// Writes the audio which did not fit before, in order. Returns false if some
+// still does not fit.
+static bool ring_write_pending(struct GrooveSinkPrivate *s) {
+    for (;;) {
+        struct GrooveBuffer *buffer = s->ring_partial;
+        if (buffer) {
+            s->ring_partial_offset += ring_write(s, buffer->data[0] + s->ring_partial_offset,
+                    buffer->size - s->ring_partial_offset);
+            if (s->ring_partial_offset < buffer->size)
+                return false;
+            ring_drop_partial(s);
+        }
+        if (groove_sink_log_get(&s->reader, &buffer, 0) != 1)
+            return true;
+        if (buffer == end_of_q_sentinel) {
+            ring_set_end(s);
+            continue;
+        }
+        ring_begin(s, buffer);
+    }
+}
+
+// Takes over the reference the caller holds. `buffer` may be the end of the
+// playlist.
+static void ring_put(struct GrooveSink *sink, struct GrooveBuffer *buffer) {
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    if (!ring_write_pending(s)) {
+        if (groove_sink_log_put(s->reader.log, &s->reader, buffer) < 0)
+            av_log(NULL, AV_LOG_ERROR, "unable to put buffer in queue\n");
+    } else if (buffer == end_of_q_sentinel) {
+        ring_set_end(s);
+    } else {
+        ring_begin(s, buffer);
+        ring_write_pending(s);
+    }
+    if (sink->filled) sink->filled(sink);
+}
+
+// Puts a buffer in the log for this sink alone. `buffer` must already be
+// ref'd for the log.
+static void queue_buffer(struct GrooveSink *sink, struct GrooveBuffer *buffer) {
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    if (s->ring) {
+        ring_put(sink, buffer);
+        return;
+    }
+    if (sink->process) {
+        sink->process(sink, buffer);
+        groove_buffer_unref(buffer);
+        return;
+    }
+    if (groove_sink_log_put(s->reader.log, &s->reader, buffer) < 0)
+        av_log(NULL, AV_LOG_ERROR, "unable to put buffer in queue\n");
+    if (sink->filled) sink->filled(sink);
+}
+
+static void send_buffer_unbatched(struct GroovePlaylist *playlist, struct GrooveSink *sink,
+        struct GrooveBuffer *buffer)
+{
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    if (groove_gain_is_identity(&s->gain_stage)) {
+        groove_buffer_ref(buffer);
+    } else if (!(buffer = apply_sink_gain(playlist, sink, buffer))) {
+        av_log(NULL, AV_LOG_ERROR, "unable to apply sink gain: out of memory\n");
+        return;
+    }
+    queue_buffer(sink, buffer);
+}
+
+static void batch_drop(struct GrooveSinkPrivate *s) {
+    groove_frame_free(s->groove, &s->batch_frame);
+    s->batch_item = NULL;
+}
+
+// Sends the audio batched so far as one buffer. The batch belongs to this
+// sink alone, so the gain is applied in place.
+static void batch_send(struct GrooveSink *sink) {
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    AVFrame *frame = s->batch_frame;
+    if (!frame)
+        return;
+    s->batch_frame = NULL;
+
+    if (!groove_gain_is_identity(&s->gain_stage) &&
+            groove_gain_apply(&s->gain_stage, frame) < 0)
+    {
+        av_log(NULL, AV_LOG_ERROR, "unable to apply sink gain: out of memory\n");
+        groove_frame_free(s->groove, &frame);
+        return;
+    }
+    struct GrooveBuffer *buffer = create_frame_buffer(s->groove, frame, s->batch_item,
+            s->batch_pos);
+    if (!buffer) {
+        av_log(NULL, AV_LOG_ERROR, "unable to create buffer: out of memory\n");
+        groove_frame_free(s->groove, &frame);
+        return;
+    }
+    groove_buffer_ref(buffer);
+    queue_buffer(sink, buffer);
+}
+
+static bool frame_formats_equal(const AVFrame *a, const AVFrame *b) {
+    return a->format == b->format &&
+        a->sample_rate == b->sample_rate &&
+        av_channel_layout_compare(&a->ch_layout, &b->ch_layout) == 0;
+}
+
+static bool batch_accepts(const struct GrooveSinkPrivate *s, const struct GrooveBuffer *buffer,
+        const AVFrame *frame)
+{
+    const AVFrame *batch = s->batch_frame;
+    return s->batch_item == buffer->item &&
+        frame_formats_equal(batch, frame) &&
+        batch->nb_samples + frame->nb_samples <= s->batch_capacity;
+}
+
+// Starts a batch in the format of `frame`, beginning at `pos` in `item`.
+static int batch_start(struct GrooveSinkPrivate *s, struct GroovePlaylistItem *item,
+        double pos, const AVFrame *frame, int capacity)
+{
+    AVFrame *batch = groove_frame_alloc(s->groove);
+    if (!batch)
+        return GrooveErrorNoMem;
+    batch->format = frame->format;
+    batch->sample_rate = frame->sample_rate;
+    batch->nb_samples = capacity;
+    batch->pts = frame->pts;
+    if (av_channel_layout_copy(&batch->ch_layout, &frame->ch_layout) < 0 ||
+        sink_frame_get_buffer(s, batch) < 0)
+    {
+        groove_frame_free(s->groove, &batch);
+        return GrooveErrorNoMem;
+    }
+    batch->nb_samples = 0;
+    s->batch_frame = batch;
+    s->batch_capacity = capacity;
+    s->batch_item = item;
+    s->batch_pos = pos;
+    return 0;
+}
+
+// Copies `count` samples of `frame` from `offset` onto the end of the batch.
+static void batch_append(struct GrooveSinkPrivate *s, const AVFrame *frame,
+        int offset, int count)
+{
+    AVFrame *batch = s->batch_frame;
+    av_samples_copy(batch->extended_data, frame->extended_data, batch->nb_samples, offset,
+            count, frame->ch_layout.nb_channels, (enum AVSampleFormat)frame->format);
+    batch->nb_samples += count;
+}
+
+// Copies decoded frames into one buffer until it holds at least
+// GrooveSink::min_buffer_duration. A copy per frame is much cheaper than the
+// allocations, locking and wakeup that come with each buffer.
+static void send_buffer_batched(struct GroovePlaylist *playlist, struct GrooveSink *sink,
+        struct GrooveBuffer *buffer)
+{
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    struct GrooveBufferPrivate *b = (struct GrooveBufferPrivate *) buffer;
+    AVFrame *frame = b->frame;
+    int min_samples = (int)(sink->min_buffer_duration * frame->sample_rate + 0.5);
+
+    if (s->batch_frame && !batch_accepts(s, buffer, frame))
+        batch_send(sink);
+
+    if (!s->batch_frame) {
+        if (frame->nb_samples >= min_samples) {
+            send_buffer_unbatched(playlist, sink, buffer);
+            return;
+        }
+        // frames from one decoder are usually the same size, so this is
+        // enough to reach min_samples without sending early
+        if (batch_start(s, buffer->item, buffer->pos, frame,
+                    min_samples + frame->nb_samples) < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR, "unable to batch buffers: out of memory\n");
+            send_buffer_unbatched(playlist, sink, buffer);
+            return;
+        }
+    }
+
+    batch_append(s, frame, 0, frame->nb_samples);
+    if (s->batch_frame->nb_samples >= min_samples)
+        batch_send(sink);
+}
+
+// Makes `frame` refer to `count` samples starting at `offset` of the audio it
+// referred to. The data is not copied or reallocated. The timestamps move
+// along with it if the frame's time base is known.
+static void frame_narrow(AVFrame *frame, int offset, int count) {
+    enum AVSampleFormat sample_fmt = (enum AVSampleFormat)frame->format;
+    int channels = frame->ch_layout.nb_channels;
+    bool planar = av_sample_fmt_is_planar(sample_fmt);
+    int plane_count = planar ? channels : 1;
+    int stride = av_get_bytes_per_sample(sample_fmt) * (planar ? 1 : channels);
+
+    for (int i = 0; i < plane_count; i += 1)
+        frame->extended_data[i] += offset * stride;
+    // with many channels, data holds copies of the first extended_data pointers
+    if (frame->extended_data != frame->data) {
+        for (int i = 0; i < plane_count && i < AV_NUM_DATA_POINTERS; i += 1)
+            frame->data[i] += offset * stride;
+    }
+    frame->nb_samples = count;
+
+    if (frame->time_base.num > 0 && frame->sample_rate > 0) {
+        AVRational sample_time_base = {1, frame->sample_rate};
+        if (frame->pts != AV_NOPTS_VALUE)
+            frame->pts += av_rescale_q(offset, sample_time_base, frame->time_base);
+        frame->duration = av_rescale_q(count, sample_time_base, frame->time_base);
+    }
+}
+
+// Sends `count` samples of `buffer` from `offset` as a buffer of their own
+// that shares the audio data with `buffer`.
+static void send_buffer_view(struct GroovePlaylist *playlist, struct GrooveSink *sink,
+        struct GrooveBuffer *buffer, int offset, int count)
+{
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    struct GrooveBufferPrivate *b = (struct GrooveBufferPrivate *) buffer;
+    AVFrame *frame = groove_frame_clone(s->groove, b->frame);
+    if (!frame) {
+        av_log(NULL, AV_LOG_ERROR, "unable to create buffer: out of memory\n");
+        return;
+    }
+    frame_narrow(frame, offset, count);
+    struct GrooveBuffer *view = create_frame_buffer(s->groove, frame, buffer->item,
+            buffer->pos + offset / (double)frame->sample_rate);
+    if (!view) {
+        av_log(NULL, AV_LOG_ERROR, "unable to create buffer: out of memory\n");
+        groove_frame_free(s->groove, &frame);
+        return;
+    }
+    groove_buffer_ref(view);
+    send_buffer_unbatched(playlist, sink, view);
+    groove_buffer_unref(view);
+}
+
+// Cuts decoded frames into GrooveSink::buffer_sample_count sized buffers.
+// Whole blocks are views into the decoded frame; only a block which
+// straddles two frames is copied together.
+static void send_buffer_regrouped(struct GroovePlaylist *playlist, struct GrooveSink *sink,
+        struct GrooveBuffer *buffer)
+{
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    struct GrooveBufferPrivate *b = (struct GrooveBufferPrivate *) buffer;
+    AVFrame *frame = b->frame;
+    int block_size = sink->buffer_sample_count;
+    int offset = 0;
+
+    // a short block goes out when the format changes, as with the filter graph
+    if (s->batch_frame && !frame_formats_equal(s->batch_frame, frame))
+        batch_send(sink);
+
+    if (s->batch_frame) {
+        int missing = block_size - s->batch_frame->nb_samples;
+        offset = (missing < frame->nb_samples) ? missing : frame->nb_samples;
+        batch_append(s, frame, 0, offset);
+        if (s->batch_frame->nb_samples == block_size)
+            batch_send(sink);
+    } else if (frame->nb_samples == block_size) {
+        send_buffer_unbatched(playlist, sink, buffer);
+        return;
+    }
+
+    for (; frame->nb_samples - offset >= block_size; offset += block_size)
+        send_buffer_view(playlist, sink, buffer, offset, block_size);
+
+    if (offset < frame->nb_samples) {
+        double pos = buffer->pos + offset / (double)frame->sample_rate;
+        if (batch_start(s, buffer->item, pos, frame, block_size) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "unable to regroup buffers: out of memory\n");
+            return;
+        }
+        batch_append(s, frame, offset, frame->nb_samples - offset);
+    }
+}
+
+// Whether the sink takes buffers as the decode thread makes them. Those
+// sinks share entries in the log, and get their gain applied when they get
+// a buffer. The others go through send_buffer_to_sink.
+static bool sink_takes_shared(const struct GrooveSink *sink) {
+    const struct GrooveSinkPrivate *s = (const struct GrooveSinkPrivate *) sink;
+    bool convert_on_get = (sink->flags & GrooveSinkFlagConvertOnGet);
+    return !sink->process && !s->ring && sink->min_buffer_duration <= 0.0 &&
+        (sink->buffer_sample_count == 0 || convert_on_get);
+}
+
+static void send_buffer_to_sink(struct GroovePlaylist *playlist, struct GrooveSink *sink,
+        struct GrooveBuffer *buffer)
+{
+    // a ring is a stream of bytes, so there is nothing to regroup or batch
+    if (((struct GrooveSinkPrivate *) sink)->ring) {
+        send_buffer_unbatched(playlist, sink, buffer);
+        return;
+    }
+
+    // groove_sink_buffer_get applies buffer_sample_count for sinks which
+    // convert on get
+    bool convert_on_get = (sink->flags & GrooveSinkFlagConvertOnGet);
+    if (sink->buffer_sample_count > 0 && !convert_on_get)
+        send_buffer_regrouped(playlist, sink, buffer);
+    else if (sink->min_buffer_duration > 0.0)
+        send_buffer_batched(playlist, sink, buffer);
+    else
+        send_buffer_unbatched(playlist, sink, buffer);
+}
+
+// Sinks which take buffers as they are share one entry in the log, however
+// many of them there are. The others get buffers of their own.
+static void send_buffer_to_sinks(struct GroovePlaylist *playlist, struct SinkMap *map_item,
+        struct GrooveBuffer *buffer)
+{
+    groove_buffer_ref(buffer);
+    if (groove_sink_log_put(map_item->log, NULL, buffer) < 0)
+        av_log(NULL, AV_LOG_ERROR, "unable to put buffer in queue\n");
+
+    struct SinkStack *stack_item = map_item->stack_head;
+    while (stack_item) {
+        struct GrooveSink *sink = stack_item->sink;
+        struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+        if (!s->reader.shared)
+            send_buffer_to_sink(playlist, sink, buffer);
+        else if (sink->filled)
+            sink->filled(sink);
+        stack_item = stack_item->next;
+    }
+}
+
+// Sink map entries without a buffersink take the decoded frame as it is,
+// all sharing one buffer. If no entry needs the graph, the frame is moved
+// rather than referenced.
+static int send_frame_direct(struct GroovePlaylist *playlist, struct FilterGraph *fg,
+        AVFrame *frame)
+{
+    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
+
+    // nothing is buffered on this path, so there is nothing to flush
+    if (!frame || fg->direct_count == 0)
+        return 0;
+
+    AVFrame *oframe;
+    if (fg->bypass) {
+        oframe = groove_frame_alloc(p->groove);
+        if (!oframe)
             return GrooveErrorNoMem;
-        } else {
-            return GrooveErrorDecoding;
+        av_frame_move_ref(oframe, frame);
+    } else {
+        oframe = groove_frame_clone(p->groove, frame);
+        if (!oframe)
+            return GrooveErrorNoMem;
+    }
+
+    struct GrooveBuffer *buffer = frame_to_groove_buffer(playlist, p->decode_head, oframe);
+    if (!buffer) {
+        groove_frame_free(p->groove, &oframe);
+        return GrooveErrorNoMem;
+    }
+
+    // we hold this reference so that the buffer outlives the loop
+    groove_buffer_ref(buffer);
+    int sink_index = 0;
+    for (struct SinkMap *map_item = p->sink_map; map_item; map_item = map_item->next) {
+        if (!fg->abuffersink_ctxs[sink_index])
+            send_buffer_to_sinks(playlist, map_item, buffer);
+        sink_index += 1;
+    }
+    int data_size = buffer->size;
+    groove_buffer_unref(buffer);
+
+    return data_size;
+}
+
+// When every sink of the entry has a ring with room for all of `frame`, and
+// nothing is waiting to go in first, writes it there without making a
+// GrooveBuffer. Returns false if it did not.
+static bool write_frame_to_rings(struct SinkMap *map_item, struct GroovePlaylistItem *item,
+        AVFrame *frame)
+{
+    int size = frame_size(frame);
+    struct SinkStack *stack_item;
+    for (stack_item = map_item->stack_head; stack_item; stack_item = stack_item->next) {
+        struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) stack_item->sink;
+        if (!s->ring || s->ring_partial || GROOVE_ATOMIC_LOAD(s->reader.private_bytes) > 0 ||
+            !groove_gain_is_identity(&s->gain_stage) || ring_free_bytes(s) < size)
+        {
+            return false;
+        }
+    }
+    for (stack_item = map_item->stack_head; stack_item; stack_item = stack_item->next) {
+        struct GrooveSink *sink = stack_item->sink;
+        struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+        if (s->shm) {
+            // the same item and position frame_to_groove_buffer would give
+            struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) item->file;
+            groove_shm_writer_mark(s->shm, item, f->audio_clock);
         }
+        ring_write(s, frame->data[0], size);
+        if (sink->filled) sink->filled(sink);
     }
+    return true;
+}
 
-    // for each data format in the sink map, pull filtered audio from its
-    // buffersink, turn it into a GrooveBuffer and then increment the ref
-    // count for each sink in that stack.
-    struct SinkMap *map_item = p->sink_map;
+// Resamples `frame` into the branch of `r`. A NULL frame lets out what the
+// resampler holds back; the branch stays open.
+static int resampler_send(struct Groove *groove, struct FilterGraph *fg, struct Resampler *r,
+        const AVFrame *frame)
+{
+    AVFrame *out = groove_frame_alloc(groove);
+    if (!out)
+        return AVERROR(ENOMEM);
+    out->format = fg->sample_fmt;
+    out->sample_rate = r->sample_rate;
+    int err = av_channel_layout_copy(&out->ch_layout, &fg->ch_layout);
+
+    // the first sample out is behind this frame by what the resampler holds
+    if (frame && frame->pts != AV_NOPTS_VALUE) {
+        AVRational time_base = {1, r->sample_rate};
+        r->next_pts = av_rescale_q(frame->pts, fg->time_base, time_base) -
+            swr_get_delay(r->swr, r->sample_rate);
+    }
+    if (err >= 0)
+        err = swr_convert_frame(r->swr, out, frame);
+    if (err >= 0 && out->nb_samples > 0) {
+        out->pts = r->next_pts;
+        if (r->next_pts != AV_NOPTS_VALUE)
+            r->next_pts += out->nb_samples;
+        err = av_buffersrc_add_frame_flags(r->abuffer_ctx, out, 0);
+    }
+    groove_frame_free(groove, &out);
+    return err;
+}
+
+// Throws away what the resampler holds back, as if it was new.
+static int resampler_reset(struct Resampler *r) {
+    r->next_pts = AV_NOPTS_VALUE;
+    return swr_init(r->swr);
+}
+
+// Sends `frame` into every source of the graph: through a resampler for
+// the branches which change the rate, and as it is to the others. Takes the
+// data of `frame`. A NULL frame lets out what the resamplers hold back and
+// ends the graph.
+static int filter_graph_feed(struct Groove *groove, struct FilterGraph *fg, AVFrame *frame) {
+    int err;
+    for (int i = 0; i < fg->resampler_count; i += 1) {
+        struct Resampler *r = &fg->resamplers[i];
+        if ((err = resampler_send(groove, fg, r, frame)) < 0)
+            return err;
+        if (!frame && (err = av_buffersrc_add_frame_flags(r->abuffer_ctx, NULL, 0)) < 0)
+            return err;
+    }
+    if (fg->abuffer_ctx && (err = av_buffersrc_add_frame_flags(fg->abuffer_ctx, frame, 0)) < 0)
+        return err;
+    if (!frame)
+        fg->eof = true;
+    return 0;
+}
+
+// Takes the next frame out of a buffersink. A sink with a fixed
+// buffer_sample_count gets whole blocks, and the short rest only if
+// `remainder` is true. Returns 1 if there was a frame, 0 if there is nothing
+// ready, or an AVERROR.
+static int buffersink_take(AVFilterContext *abuffersink_ctx, const struct GrooveSink *example_sink,
+        AVFrame *frame, bool remainder)
+{
+    int err = example_sink->buffer_sample_count == 0 ?
+        av_buffersink_get_frame(abuffersink_ctx, frame) :
+        av_buffersink_get_samples(abuffersink_ctx, frame, example_sink->buffer_sample_count);
+    if (err == AVERROR(EAGAIN) && remainder && example_sink->buffer_sample_count != 0)
+        err = av_buffersink_get_frame(abuffersink_ctx, frame);
+    if (err == AVERROR_EOF || err == AVERROR(EAGAIN))
+        return 0;
+    return (err < 0) ? err : 1;
+}
+
+// For each data format in the sink map, pulls filtered audio from its
+// buffersink, turns it into a GrooveBuffer of fg->item and then increments
+// the ref count for each sink in that stack. Returns the most bytes any
+// entry got, or a GrooveError.
+static int filter_graph_pull(struct GroovePlaylist *playlist, struct FilterGraph *fg,
+        bool remainder)
+{
+    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
     int max_data_size = 0;
+    int err;
+
+    struct SinkMap *map_item = p->sink_map;
+    int sink_index = 0;
     while (map_item) {
         struct GrooveSink *example_sink = map_item->stack_head->sink;
+        AVFilterContext *abuffersink_ctx = fg->abuffersink_ctxs[sink_index];
         int data_size = 0;
-        for (;;) {
-            AVFrame *oframe = av_frame_alloc();
+        while (abuffersink_ctx) {
+            AVFrame *oframe = groove_frame_alloc(p->groove);
             if (!oframe) {
                 return GrooveErrorNoMem;
             }
-            err = example_sink->buffer_sample_count == 0 ?
-                av_buffersink_get_frame(map_item->abuffersink_ctx, oframe) :
-                av_buffersink_get_samples(map_item->abuffersink_ctx, oframe, example_sink->buffer_sample_count);
-            if (err == AVERROR_EOF || err == AVERROR(EAGAIN)) {
-                av_frame_free(&oframe);
+            err = buffersink_take(abuffersink_ctx, example_sink, oframe, remainder);
+            if (err == 0) {
+                groove_frame_free(p->groove, &oframe);
                 break;
             }
             if (err < 0) {
-                av_frame_free(&oframe);
+                groove_frame_free(p->groove, &oframe);
                 av_log(NULL, AV_LOG_ERROR, "error reading buffer from buffersink\n");
                 return GrooveErrorDecoding;
             }
-            struct GrooveBuffer *buffer = frame_to_groove_buffer(playlist, example_sink, oframe);
+            if (write_frame_to_rings(map_item, fg->item, oframe)) {
+                data_size += frame_size(oframe);
+                groove_frame_free(p->groove, &oframe);
+                continue;
+            }
+            struct GrooveBuffer *buffer = frame_to_groove_buffer(playlist, fg->item, oframe);
             if (!buffer) {
-                av_frame_free(&oframe);
+                groove_frame_free(p->groove, &oframe);
                 return GrooveErrorNoMem;
             }
             data_size += buffer->size;
-            struct SinkStack *stack_item = map_item->stack_head;
             // we hold this reference to avoid cleanups until at least this loop
             // is done and we call unref after it.
             groove_buffer_ref(buffer);
-            while (stack_item) {
-                struct GrooveSink *sink = stack_item->sink;
-                struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
-                // as soon as we call groove_queue_put, this buffer could be unref'd.
-                // so we ref before putting it in the queue, and unref if it failed.
-                groove_buffer_ref(buffer);
-                if (groove_queue_put(s->audioq, buffer) < 0) {
-                    av_log(NULL, AV_LOG_ERROR, "unable to put buffer in queue\n");
-                    groove_buffer_unref(buffer);
-                }
-                if (sink->filled) sink->filled(sink);
-                stack_item = stack_item->next;
-            }
+            send_buffer_to_sinks(playlist, map_item, buffer);
             groove_buffer_unref(buffer);
         }
         max_data_size = groove_max_int(max_data_size, data_size);
+        sink_index += 1;
         map_item = map_item->next;
     }
 
     return max_data_size;
 }
 
-static const double dB_scale = 0.1151292546497023; // log(10) * 0.05
+static int send_frame_to_filter_graph(struct GroovePlaylist *playlist, AVFrame *frame) {
+    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
+    struct FilterGraph *fg = p->filter_graph;
+    int err;
 
-static double gain_to_dB(double gain) {
-    return log(gain) / dB_scale;
+    int max_data_size = send_frame_direct(playlist, fg, frame);
+    if (max_data_size < 0 || fg->bypass)
+        return max_data_size;
+
+    fg->item = p->decode_head;
+    if ((err = filter_graph_feed(p->groove, fg, frame)) < 0) {
+        av_strerror(err, p->strbuf, sizeof(p->strbuf));
+        av_log(NULL, AV_LOG_ERROR, "error feeding the filtergraph: %s\n", p->strbuf);
+        if (err == AVERROR(ENOMEM)) {
+            return GrooveErrorNoMem;
+        } else {
+            return GrooveErrorDecoding;
+        }
+    }
+
+    int data_size = filter_graph_pull(playlist, fg, false);
+    if (data_size < 0)
+        return data_size;
+    return groove_max_int(max_data_size, data_size);
 }
 
-static int create_volume_filter(struct GroovePlaylistPrivate *p, AVFilterContext **audio_src_ctx,
-        double vol, double amp_vol)
+// Lets out what the graph holds back and hands it to the sinks as the end of
+// fg->item, because the graph stops being used: the input format changed
+// or the playlist ran out. A fixed buffer_sample_count gets a short last
+// block, as it does when the format changes. Before the graph is used again
+// it needs filter_graph_reset.
+static void filter_graph_finish(struct GroovePlaylist *playlist, struct FilterGraph *fg) {
+    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
+    if (!fg || fg->bypass || !fg->item)
+        return;
+
+    int err = 0;
+    for (int i = 0; i < fg->resampler_count && err >= 0; i += 1)
+        err = resampler_send(p->groove, fg, &fg->resamplers[i], NULL);
+    if (err >= 0)
+        err = filter_graph_pull(playlist, fg, true);
+    if (err < 0)
+        av_log(NULL, AV_LOG_WARNING, "unable to finish the filter graph; dropping its last samples\n");
+    fg->item = NULL;
+}
+
+// Creates a filter and links output pad `src_pad` of `src_ctx` to it.
+static int add_filter(struct FilterGraph *fg, const AVFilter *filter, const char *name,
+        const char *args, AVFilterContext *src_ctx, int src_pad, AVFilterContext **out_ctx)
 {
     int err;
 
-    if (vol < 0.0) vol = 0.0;
-    if (amp_vol < 1.0) {
-        snprintf(p->strbuf, sizeof(p->strbuf), "volume=%f", vol);
-        av_log(NULL, AV_LOG_INFO, "volume: %s\n", p->strbuf);
-        AVFilterContext *volume_ctx;
-        err = avfilter_graph_create_filter(&volume_ctx, p->volume_filter, NULL,
-                p->strbuf, NULL, p->filter_graph);
-        if (err < 0) {
-            av_log(NULL, AV_LOG_ERROR, "error initializing volume filter\n");
-            return err;
+    if (args)
+        av_log(NULL, AV_LOG_INFO, "%s: %s\n", name, args);
+    err = avfilter_graph_create_filter(out_ctx, filter, NULL, args, NULL, fg->graph);
+    if (err < 0) {
+        av_strerror(err, fg->strbuf, sizeof(fg->strbuf));
+        av_log(NULL, AV_LOG_ERROR, "unable to create %s filter: %s\n", name, fg->strbuf);
+        return err;
+    }
+    err = avfilter_link(src_ctx, src_pad, *out_ctx, 0);
+    if (err < 0) {
+        av_strerror(err, fg->strbuf, sizeof(fg->strbuf));
+        av_log(NULL, AV_LOG_ERROR, "unable to link %s filter: %s\n", name, fg->strbuf);
+        return err;
+    }
+    return 0;
+}
+
+static bool sink_supports_sample_rate_range(const struct GrooveSink *test_sink,
+        const struct SoundIoSampleRateRange *test_range)
+{
+    if (!test_sink->sample_rates)
+        return true;
+
+    for (int i = 0; i < test_sink->sample_rate_count; i += 1) {
+        const struct SoundIoSampleRateRange *range = &test_sink->sample_rates[i];
+
+        if (test_range->min >= range->min && test_range->max <= range->max) {
+            return true;
         }
-        err = avfilter_link(*audio_src_ctx, 0, volume_ctx, 0);
-        if (err < 0) {
-            av_strerror(err, p->strbuf, sizeof(p->strbuf));
-            av_log(NULL, AV_LOG_ERROR, "unable to link volume filter: %s\n", p->strbuf);
-            return err;
+    }
+    return false;
+}
+
+static bool sink_supports_sample_format(const struct GrooveSink *test_sink, enum SoundIoFormat test_format) {
+    if (!test_sink->sample_formats)
+        return true;
+
+    for (int i = 0; i < test_sink->sample_format_count; i += 1) {
+        enum SoundIoFormat format = test_sink->sample_formats[i];
+        if (format == test_format)
+            return true;
+    }
+    return false;
+}
+
+static bool sink_supports_channel_layout(const struct GrooveSink *test_sink,
+        const struct SoundIoChannelLayout *test_layout)
+{
+    if (!test_sink->channel_layouts)
+        return true;
+
+    for (int i = 0; i < test_sink->channel_layout_count; i += 1) {
+        const struct SoundIoChannelLayout *layout = &test_sink->channel_layouts[i];
+        if (soundio_channel_layout_equal(layout, test_layout))
+            return true;
+    }
+    return false;
+}
+
+static bool sink_supports_sample_rate(const struct GrooveSink *test_sink, int sample_rate) {
+    struct SoundIoSampleRateRange range = {sample_rate, sample_rate};
+    return sink_supports_sample_rate_range(test_sink, &range);
+}
+
+static bool sink_supports_planar(const struct GrooveSink *test_sink, bool is_planar) {
+    bool planar_ok = (test_sink->flags & GrooveSinkFlagPlanarOk);
+    bool interleaved_ok = (test_sink->flags & GrooveSinkFlagInterleavedOk);
+    if (!planar_ok && !interleaved_ok)
+        return true;
+    return is_planar ? planar_ok : interleaved_ok;
+}
+
+// Decides which format buffers for `sink` will have when the decoded audio
+// is in the given format. Returns true if a conversion is needed.
+static bool resolve_sink_format(const struct GrooveSink *sink, int in_sample_rate,
+        const AVChannelLayout *in_ch_layout, enum AVSampleFormat in_sample_fmt,
+        struct GrooveAudioFormat *out_format)
+{
+    bool need_conversion = false;
+
+    // Check for planar vs interleaved.
+    bool is_planar = from_ffmpeg_format_planar(in_sample_fmt);
+    out_format->is_planar = is_planar;
+    bool planar_ok = (sink->flags & GrooveSinkFlagPlanarOk);
+    bool interleaved_ok = (sink->flags & GrooveSinkFlagInterleavedOk);
+    if (!planar_ok && !interleaved_ok) {
+        planar_ok = true;
+        interleaved_ok = true;
+    }
+    if (is_planar && !planar_ok) {
+        out_format->is_planar = false;
+        need_conversion = true;
+    } else if (!is_planar && !interleaved_ok) {
+        out_format->is_planar = true;
+        need_conversion = true;
+    }
+
+    // Check for sample rate.
+    out_format->sample_rate = in_sample_rate;
+    bool sample_rate_ok = false;
+    if (sink->sample_rates) {
+        for (int i = 0; i < sink->sample_rate_count; i += 1) {
+            struct SoundIoSampleRateRange *range = &sink->sample_rates[i];
+            if (range->min <= in_sample_rate && in_sample_rate <= range->max) {
+                sample_rate_ok = true;
+                break;
+            }
         }
-        *audio_src_ctx = volume_ctx;
-    } else if (amp_vol > 1.0) {
-        double attack = 0.1;
-        double decay = 0.2;
-        const char *points = "-2/-2";
-        double soft_knee = 0.02;
-        double gain = gain_to_dB(vol);
-        double volume_param = 0.0;
-        double delay = 0.2;
-        snprintf(p->strbuf, sizeof(p->strbuf), "%f:%f:%s:%f:%f:%f:%f",
-                attack, decay, points, soft_knee, gain, volume_param, delay);
-        av_log(NULL, AV_LOG_INFO, "compand: %s\n", p->strbuf);
-        AVFilterContext *compand_ctx;
-        err = avfilter_graph_create_filter(&compand_ctx, p->compand_filter, NULL,
-                p->strbuf, NULL, p->filter_graph);
-        if (err < 0) {
-            av_log(NULL, AV_LOG_ERROR, "error initializing compand filter\n");
-            return err;
+    } else {
+        sample_rate_ok = true;
+    }
+    if (!sample_rate_ok) {
+        out_format->sample_rate = sink->sample_rate_default;
+        need_conversion = true;
+    }
+
+    // Check for channel layout.
+    from_ffmpeg_layout(*in_ch_layout, &out_format->layout);
+    bool channel_layout_ok = false;
+    if (sink->channel_layouts) {
+        for (int i = 0; i < sink->channel_layout_count; i += 1) {
+            struct SoundIoChannelLayout *layout = &sink->channel_layouts[i];
+            if (soundio_channel_layout_equal(layout, &out_format->layout)) {
+                channel_layout_ok = true;
+                break;
+            }
         }
-        err = avfilter_link(*audio_src_ctx, 0, compand_ctx, 0);
-        if (err < 0) {
-            av_strerror(err, p->strbuf, sizeof(p->strbuf));
-            av_log(NULL, AV_LOG_ERROR, "unable to link compand filter: %s\n", p->strbuf);
-            return err;
+    } else {
+        channel_layout_ok = true;
+    }
+    if (!channel_layout_ok) {
+        out_format->layout = sink->channel_layout_default;
+        need_conversion = true;
+    }
+
+    // Check for sample format.
+    out_format->format = from_ffmpeg_format(in_sample_fmt);
+    bool format_ok = false;
+    if (sink->sample_formats) {
+        for (int i = 0; i < sink->sample_format_count; i += 1) {
+            enum SoundIoFormat format = sink->sample_formats[i];
+            if (format == out_format->format) {
+                format_ok = true;
+                break;
+            }
         }
-        *audio_src_ctx = compand_ctx;
+    } else {
+        format_ok = true;
+    }
+    if (!format_ok) {
+        out_format->format = sink->sample_format_default;
+        need_conversion = true;
+    }
+
+    return need_conversion;
+}
+
+// Records the input format a graph is for. It is also the cache key.
+static int filter_graph_set_input(struct FilterGraph *fg, int sample_rate,
+        const AVChannelLayout *ch_layout, enum AVSampleFormat sample_fmt, AVRational time_base)
+{
+    fg->sample_rate = sample_rate;
+    if (av_channel_layout_copy(&fg->ch_layout, ch_layout) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "unable to create filter graph: out of memory\n");
+        return GrooveErrorNoMem;
     }
+    fg->sample_fmt = sample_fmt;
+    fg->time_base = time_base;
     return 0;
 }
 
-// abuffer -> volume -> asplit for each audio format
-//                     -> volume -> aformat -> abuffersink
-// if the volume gain is > 1.0, we use a compand filter instead
-// for soft limiting.
-static int init_filter_graph(struct GroovePlaylist *playlist, struct GrooveFile *file) {
-    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
-    struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
+// What the filter graph delivers to one sink map entry.
+struct SinkPlan {
+    struct GrooveSink *example_sink;
+    struct GrooveAudioFormat format;
+    bool need_conversion;
+    // takes decoded frames as they are, bypassing the graph
+    bool direct;
+    // scratch space for plan_share_conversions
+    bool planned;
+};
 
-    // destruct old graph
-    avfilter_graph_free(&p->filter_graph);
+enum PlanField {
+    PlanFieldSampleRate,
+    PlanFieldSampleFormat,
+    PlanFieldChannelLayout,
+};
 
-    // create new graph
-    p->filter_graph = avfilter_graph_alloc();
-    if (!p->filter_graph) {
-        av_log(NULL, AV_LOG_ERROR, "unable to create filter graph: out of memory\n");
-        return -1;
+// True if `plan` converts `field` away from the input format.
+static bool plan_converts(const struct FilterGraph *fg, const struct SinkPlan *plan,
+        enum PlanField field)
+{
+    switch (field) {
+        case PlanFieldSampleRate:
+            return plan->format.sample_rate != fg->sample_rate;
+        case PlanFieldSampleFormat:
+            return to_ffmpeg_fmt(&plan->format) != fg->sample_fmt;
+        case PlanFieldChannelLayout:
+            {
+                struct SoundIoChannelLayout in_layout;
+                from_ffmpeg_layout(fg->ch_layout, &in_layout);
+                return !soundio_channel_layout_equal(&plan->format.layout, &in_layout);
+            }
     }
+    return false;
+}
 
-    int err;
-    // create abuffer filter
-    struct AVCodecContext *avctx = f->decode_ctx;
-    AVRational time_base = f->audio_st->time_base;
+static bool sink_resample_equal(const struct GrooveSink *a, const struct GrooveSink *b) {
+    return a->resampler == b->resampler &&
+        a->resample_filter_size == b->resample_filter_size &&
+        a->resample_cutoff == b->resample_cutoff &&
+        a->resample_linear_interp == b->resample_linear_interp &&
+        a->resample_precision == b->resample_precision;
+}
+
+// True if `a` and `b` can share one resampler, and so one branch of the graph.
+static bool plan_same_branch(const struct FilterGraph *fg, const struct SinkPlan *a,
+        const struct SinkPlan *b)
+{
+    if (a->format.sample_rate != b->format.sample_rate)
+        return false;
+    return a->format.sample_rate == fg->sample_rate ||
+        sink_resample_equal(a->example_sink, b->example_sink);
+}
+
+// True if the sink behind `plan` could take `field` as `other` has it.
+static bool plan_accepts(const struct FilterGraph *fg, const struct SinkPlan *plan,
+        const struct SinkPlan *other, enum PlanField field)
+{
+    // only entries which share a resampler can share the format and layout
+    // conversions after it
+    if (field != PlanFieldSampleRate && !plan_same_branch(fg, plan, other))
+        return false;
+    if (plan == other)
+        return true;
+
+    const struct GrooveSink *sink = plan->example_sink;
+    switch (field) {
+        case PlanFieldSampleRate:
+            return sink_supports_sample_rate(sink, other->format.sample_rate);
+        case PlanFieldSampleFormat:
+            return sink_supports_sample_format(sink, other->format.format) &&
+                sink_supports_planar(sink, other->format.is_planar);
+        case PlanFieldChannelLayout:
+            return sink_supports_channel_layout(sink, &other->format.layout);
+    }
+    return false;
+}
+
+static void plan_adopt(struct SinkPlan *plan, const struct SinkPlan *other, enum PlanField field) {
+    switch (field) {
+        case PlanFieldSampleRate:
+            plan->format.sample_rate = other->format.sample_rate;
+            break;
+        case PlanFieldSampleFormat:
+            plan->format.format = other->format.format;
+            plan->format.is_planar = other->format.is_planar;
+            break;
+        case PlanFieldChannelLayout:
+            plan->format.layout = other->format.layout;
+            break;
+    }
+}
+
+// Entries which cannot take the input as it is fall back to their sink's
+// default. Instead, pick the targets so that as few distinct conversions as
+// possible are needed: repeatedly take the target which the most remaining
+// entries accept and move them all to it.
+static void plan_share_conversions(const struct FilterGraph *fg, struct SinkPlan *plans,
+        int plan_count, enum PlanField field)
+{
+    for (int i = 0; i < plan_count; i += 1)
+        plans[i].planned = plans[i].direct || !plan_converts(fg, &plans[i], field);
+
+    for (;;) {
+        struct SinkPlan *best = NULL;
+        int best_count = 0;
+        for (int i = 0; i < plan_count; i += 1) {
+            if (plans[i].planned)
+                continue;
+            int count = 0;
+            for (int j = 0; j < plan_count; j += 1) {
+                if (!plans[j].planned && plan_accepts(fg, &plans[j], &plans[i], field))
+                    count += 1;
+            }
+            if (count > best_count) {
+                best = &plans[i];
+                best_count = count;
+            }
+        }
+        if (!best)
+            break;
+        struct SinkPlan target = *best;
+        for (int j = 0; j < plan_count; j += 1) {
+            if (!plans[j].planned && plan_accepts(fg, &plans[j], &target, field)) {
+                plan_adopt(&plans[j], &target, field);
+                plans[j].planned = true;
+            }
+        }
+    }
+}
+
+// If `defer_conversion` is true, entries whose sinks convert in
+// ::groove_sink_buffer_get are given the decoded audio as it is.
+static void plan_sink_formats(const struct FilterGraph *fg, struct SinkMap *sink_map,
+        struct SinkPlan *plans, int plan_count, bool defer_conversion)
+{
+    int i = 0;
+    for (struct SinkMap *map_item = sink_map; map_item; map_item = map_item->next) {
+        struct SinkPlan *plan = &plans[i];
+        struct GrooveSink *sink = map_item->stack_head->sink;
+        plan->example_sink = sink;
+        plan->need_conversion = resolve_sink_format(sink, fg->sample_rate,
+                &fg->ch_layout, fg->sample_fmt, &plan->format);
+        // fixed size buffers are cut from decoded frames at hand-off, except
+        // for sinks which convert on get. those regroup in their own graph.
+        bool convert_on_get = (sink->flags & GrooveSinkFlagConvertOnGet);
+        plan->direct = (defer_conversion && convert_on_get) ||
+            (!plan->need_conversion && (sink->buffer_sample_count == 0 || !convert_on_get));
+        i += 1;
+    }
+
+    // the sample rate decides the branches, so settle it first
+    plan_share_conversions(fg, plans, plan_count, PlanFieldSampleRate);
+    plan_share_conversions(fg, plans, plan_count, PlanFieldSampleFormat);
+    plan_share_conversions(fg, plans, plan_count, PlanFieldChannelLayout);
+}
+
+static bool plan_formats_equal(const struct SinkPlan *a, const struct SinkPlan *b) {
+    return a->format.sample_rate == b->format.sample_rate &&
+        a->format.format == b->format.format &&
+        a->format.is_planar == b->format.is_planar &&
+        soundio_channel_layout_equal(&a->format.layout, &b->format.layout);
+}
+
+// Writes swr options into `buf`, resampling as configured by `sink`.
+static void format_resampler_args(struct GroovePlaylistPrivate *p,
+        const struct GrooveSink *sink, char *buf, int size)
+{
+    bool soxr = (sink->resampler == GrooveResamplerSoxr && p->soxr_available);
+    int len = snprintf(buf, size, "resampler=%s", soxr ? "soxr" : "swr");
+    if (sink->resample_cutoff > 0.0)
+        len += snprintf(buf + len, size - len, ":cutoff=%g", sink->resample_cutoff);
+    if (soxr) {
+        if (sink->resample_precision > 0)
+            len += snprintf(buf + len, size - len, ":precision=%d",
+                    sink->resample_precision);
+    } else {
+        if (sink->resample_filter_size > 0)
+            len += snprintf(buf + len, size - len, ":filter_size=%d",
+                    sink->resample_filter_size);
+        if (sink->resample_linear_interp >= 0)
+            len += snprintf(buf + len, size - len, ":linear_interp=%d",
+                    sink->resample_linear_interp ? 1 : 0);
+    }
+}
+
+// Writes aformat filter arguments for `format` into fg->strbuf.
+static int format_aformat_args(struct FilterGraph *fg, const struct GrooveAudioFormat *format) {
+    char channel_layout_buf[300];
+    AVChannelLayout ch_layout = to_ffmpeg_channel_layout(&format->layout);
+    if (av_channel_layout_describe(&ch_layout, channel_layout_buf,
+            sizeof(channel_layout_buf)) >= sizeof(channel_layout_buf))
+    {
+        av_log(NULL, AV_LOG_ERROR, "unable to serialize channel layout for the filter graph: buffer size exceeded\n");
+        return -1;
+    }
+    if (snprintf(fg->strbuf, sizeof(fg->strbuf),
+            "sample_fmts=%s:sample_rates=%d:channel_layouts=%s",
+            av_get_sample_fmt_name(to_ffmpeg_fmt(format)),
+            format->sample_rate, channel_layout_buf) >= sizeof(fg->strbuf))
+    {
+        av_log(NULL, AV_LOG_ERROR, "unable to serialize filter graph string: buffer size exceeded\n");
+        return -1;
+    }
+    return 0;
+}
 
+// Adds an abuffer to the graph which takes audio in the input format of
+// `fg`, but at `sample_rate` and in `time_base`.
+static int add_source(struct GroovePlaylistPrivate *p, struct FilterGraph *fg,
+        int sample_rate, AVRational time_base, AVFilterContext **out_ctx)
+{
     char channel_layout_buf[300];
-    if (av_channel_layout_describe(&avctx->ch_layout, channel_layout_buf,
+    if (av_channel_layout_describe(&fg->ch_layout, channel_layout_buf,
             sizeof(channel_layout_buf)) >= sizeof(channel_layout_buf))
     {
         av_log(NULL, AV_LOG_ERROR, "unable to serialize channel layout for the filter graph: buffer size exceeded\n");
         return -1;
     }
 
-    if (snprintf(p->strbuf, sizeof(p->strbuf),
+    if (snprintf(fg->strbuf, sizeof(fg->strbuf),
             "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=%s", 
-            time_base.num, time_base.den, avctx->sample_rate,
-            av_get_sample_fmt_name(avctx->sample_fmt),
-            channel_layout_buf) >= sizeof(p->strbuf))
+            time_base.num, time_base.den, sample_rate,
+            av_get_sample_fmt_name(fg->sample_fmt),
+            channel_layout_buf) >= sizeof(fg->strbuf))
     {
         av_log(NULL, AV_LOG_ERROR, "unable to serialize filter graph string: buffer size exceeded\n");
         return -1;
     }
-    av_log(NULL, AV_LOG_INFO, "abuffer: %s\n", p->strbuf);
-    // save these values so we can compare later and check
-    // whether we have to reconstruct the graph
-    p->in_sample_rate = avctx->sample_rate;
-    p->in_channel_layout = avctx->ch_layout;
-    p->in_sample_fmt = avctx->sample_fmt;
-    p->in_time_base = time_base;
-    err = avfilter_graph_create_filter(&p->abuffer_ctx, p->abuffer_filter,
-            NULL, p->strbuf, NULL, p->filter_graph);
+    av_log(NULL, AV_LOG_INFO, "abuffer: %s\n", fg->strbuf);
+    int err = avfilter_graph_create_filter(out_ctx, p->abuffer_filter,
+            NULL, fg->strbuf, NULL, fg->graph);
     if (err < 0) {
         av_log(NULL, AV_LOG_ERROR, "error initializing abuffer filter\n");
         return err;
     }
-    // as we create filters, this points the next source to link to
-    AVFilterContext *audio_src_ctx = p->abuffer_ctx;
-
-    // save the volume value so we can compare later and check
-    // whether we have to reconstruct the graph
-    p->filter_volume = p->volume;
-    p->filter_peak = p->peak;
-    // if volume is < 1.0, create volume filter
-    //             == 1.0, do not create a filter
-    //              > 1.0, create a compand filter (for soft limiting)
-    double vol = p->volume;
-    // adjust for the known true peak of the playlist item. In other words, if
-    // we know that the song peaks at 0.8, and we want to amplify by 1.2, that
-    // comes out to 0.96 so we know that we can safely amplify by 1.2 even
-    // though it's greater than 1.0.
-    double amp_vol = vol * (p->peak > 1.0 ? 1.0 : p->peak);
-    err = create_volume_filter(p, &audio_src_ctx, vol, amp_vol);
+    return 0;
+}
+
+// Sets up `r` to resample the input of `fg` to `sample_rate` as configured
+// by `sink`, and adds the source of its branch to the graph.
+static int resampler_init(struct GroovePlaylistPrivate *p, struct FilterGraph *fg,
+        struct Resampler *r, const struct GrooveSink *sink, int sample_rate)
+{
+    r->sample_rate = sample_rate;
+    r->next_pts = AV_NOPTS_VALUE;
+    format_resampler_args(p, sink, r->args, sizeof(r->args));
+    av_log(NULL, AV_LOG_INFO, "resampler: osr=%d:%s\n", sample_rate, r->args);
+
+    int err = swr_alloc_set_opts2(&r->swr, &fg->ch_layout, fg->sample_fmt, sample_rate,
+            &fg->ch_layout, fg->sample_fmt, fg->sample_rate, 0, NULL);
+    if (err >= 0)
+        err = av_set_options_string(r->swr, r->args, "=", ":");
+    if (err >= 0)
+        err = swr_init(r->swr);
+    if (err < 0) {
+        av_strerror(err, fg->strbuf, sizeof(fg->strbuf));
+        av_log(NULL, AV_LOG_ERROR, "unable to create resampler: %s\n", fg->strbuf);
+        return err;
+    }
+
+    AVRational time_base = {1, sample_rate};
+    return add_source(p, fg, sample_rate, time_base, &r->abuffer_ctx);
+}
+
+// Splits the output pad `*src_pad` of `*src_ctx` into `count` outputs. On
+// return, output i is pad `*src_pad + i` of `*src_ctx`.
+static int split_output(struct GroovePlaylistPrivate *p, struct FilterGraph *fg,
+        AVFilterContext **src_ctx, int *src_pad, int count)
+{
+    if (count < 2)
+        return 0;
+
+    AVFilterContext *asplit_ctx;
+    snprintf(fg->strbuf, sizeof(fg->strbuf), "%d", count);
+    int err = add_filter(fg, p->asplit_filter, "asplit", fg->strbuf, *src_ctx, *src_pad,
+            &asplit_ctx);
     if (err < 0)
         return err;
+    *src_ctx = asplit_ctx;
+    *src_pad = 0;
+    return 0;
+}
 
-    // if only one sink, no need for asplit
-    if (p->sink_map_count >= 2) {
-        AVFilterContext *asplit_ctx;
-        snprintf(p->strbuf, sizeof(p->strbuf), "%d", p->sink_map_count);
-        av_log(NULL, AV_LOG_INFO, "asplit: %s\n", p->strbuf);
-        err = avfilter_graph_create_filter(&asplit_ctx, p->asplit_filter,
-                NULL, p->strbuf, NULL, p->filter_graph);
-        if (err < 0) {
-            av_log(NULL, AV_LOG_ERROR, "unable to create asplit filter\n");
-            return err;
-        }
-        err = avfilter_link(audio_src_ctx, 0, asplit_ctx, 0);
-        if (err < 0) {
-            av_log(NULL, AV_LOG_ERROR, "unable to link to asplit\n");
-            return err;
-        }
-        audio_src_ctx = asplit_ctx;
+// The graph is planned so that each target sample rate is resampled to once
+// and shared by every entry that wants it:
+//
+// resampler per sample rate and swr options -> abuffer
+//     -> aformat (if every leaf wants the same format)
+//        -> asplit per sink map entry
+//           -> aformat (format and layout) -> abuffersink
+//
+// Branches at the input rate share one abuffer, split between them. The
+// resamplers are outside of the graph; see struct Resampler.
+// Filters which would do nothing are left out. The format and layout
+// conversions after the resampler are cheap. Gain is not part of the graph:
+// the playlist volume is applied to decoded frames before they get here, and
+// each sink's gain is applied when a buffer is handed to it.
+//
+// The input format and generation of `fg` must already be set. This does not
+// touch decode thread state, so it can run on any thread.
+static int init_filter_graph(struct GroovePlaylistPrivate *p, struct FilterGraph *fg,
+        struct SinkMap *sink_map, int sink_map_count, bool defer_conversion)
+{
+    fg->abuffersink_ctxs = ALLOCATE(AVFilterContext *, sink_map_count);
+    fg->resamplers = ALLOCATE(struct Resampler, sink_map_count);
+    struct SinkPlan *plans = ALLOCATE(struct SinkPlan, sink_map_count);
+    // plan index of the first entry of each branch, and its size
+    int *branch_heads = ALLOCATE(int, sink_map_count);
+    int *branch_sizes = ALLOCATE(int, sink_map_count);
+    int err = 0;
+    if (!fg->abuffersink_ctxs || !fg->resamplers || !plans || !branch_heads || !branch_sizes) {
+        av_log(NULL, AV_LOG_ERROR, "unable to create filter graph: out of memory\n");
+        err = GrooveErrorNoMem;
+        goto out;
     }
+    fg->abuffersink_count = sink_map_count;
 
-    // for each audio format, create aformat and abuffersink filters
-    struct SinkMap *map_item = p->sink_map;
-    int pad_index = 0;
-    while (map_item) {
-        struct GrooveSink *example_sink = map_item->stack_head->sink;
+    plan_sink_formats(fg, sink_map, plans, sink_map_count, defer_conversion);
 
-        AVFilterContext *inner_audio_src_ctx = audio_src_ctx;
+    for (int i = 0; i < sink_map_count; i += 1) {
+        if (plans[i].direct)
+            fg->direct_count += 1;
+    }
+    // if every sink can take the decoded frames exactly as they are, we skip
+    // libavfilter entirely.
+    fg->bypass = (fg->direct_count == sink_map_count);
+    if (fg->bypass) {
+        av_log(NULL, AV_LOG_INFO, "filter graph: bypassed\n");
+        goto out;
+    }
 
-        // create volume filter
-        err = create_volume_filter(p, &inner_audio_src_ctx, example_sink->gain, example_sink->gain);
-        if (err < 0)
-            return err;
+    // create new graph
+    fg->graph = avfilter_graph_alloc();
+    if (!fg->graph) {
+        av_log(NULL, AV_LOG_ERROR, "unable to create filter graph: out of memory\n");
+        err = GrooveErrorNoMem;
+        goto out;
+    }
 
-        // Create aformat filter if and only if the sink is compatible with
-        // the input format.
-        bool need_aformat = false;
-
-        // Check for planar vs interleaved.
-        bool is_planar = from_ffmpeg_format_planar(avctx->sample_fmt);
-        bool aformat_planar = is_planar;
-        bool planar_ok = (example_sink->flags & GrooveSinkFlagPlanarOk);
-        bool interleaved_ok = (example_sink->flags & GrooveSinkFlagInterleavedOk);
-        if (!planar_ok && !interleaved_ok) {
-            planar_ok = true;
-            interleaved_ok = true;
-        }
-        if (is_planar && !planar_ok) {
-            aformat_planar = false;
-            need_aformat = true;
-        } else if (!is_planar && !interleaved_ok) {
-            aformat_planar = true;
-            need_aformat = true;
-        }
-
-        // Check for sample rate.
-        int aformat_sample_rate = avctx->sample_rate;
-        bool sample_rate_ok = false;
-        if (example_sink->sample_rates) {
-            for (int i = 0; i < example_sink->sample_rate_count; i += 1) {
-                struct SoundIoSampleRateRange *range = &example_sink->sample_rates[i];
-                if (range->min <= avctx->sample_rate && avctx->sample_rate <= range->max) {
-                    sample_rate_ok = true;
-                    break;
-                }
-            }
-        } else {
-            sample_rate_ok = true;
-        }
-        if (!sample_rate_ok) {
-            aformat_sample_rate = example_sink->sample_rate_default;
-            need_aformat = true;
-        }
-
-        // Check for channel layout.
-        struct SoundIoChannelLayout aformat_layout;
-        from_ffmpeg_layout(avctx->ch_layout, &aformat_layout);
-        bool channel_layout_ok = false;
-        if (example_sink->channel_layouts) {
-            for (int i = 0; i < example_sink->channel_layout_count; i += 1) {
-                struct SoundIoChannelLayout *layout = &example_sink->channel_layouts[i];
-                if (soundio_channel_layout_equal(layout, &aformat_layout)) {
-                    channel_layout_ok = true;
-                    break;
-                }
-            }
-        } else {
-            channel_layout_ok = true;
-        }
-        if (!channel_layout_ok) {
-            aformat_layout = example_sink->channel_layout_default;
-            need_aformat = true;
-        }
-
-        // Check for sample format.
-        enum SoundIoFormat aformat_format = from_ffmpeg_format(avctx->sample_fmt);
-        bool format_ok = false;
-        if (example_sink->sample_formats) {
-            for (int i = 0; i < example_sink->sample_format_count; i += 1) {
-                enum SoundIoFormat format = example_sink->sample_formats[i];
-                if (format == aformat_format) {
-                    format_ok = true;
-                    break;
-                }
-            }
-        } else {
-            format_ok = true;
+    int branch_count = 0;
+    for (int i = 0; i < sink_map_count; i += 1) {
+        if (plans[i].direct)
+            continue;
+        int b = 0;
+        while (b < branch_count && !plan_same_branch(fg, &plans[branch_heads[b]], &plans[i]))
+            b += 1;
+        if (b == branch_count) {
+            branch_heads[b] = i;
+            branch_count += 1;
         }
-        if (!format_ok) {
-            aformat_format = example_sink->sample_format_default;
-            need_aformat = true;
+        branch_sizes[b] += 1;
+    }
+    av_log(NULL, AV_LOG_INFO, "filter graph: %d resamplers for %d sink formats\n",
+            branch_count, sink_map_count - fg->direct_count);
+
+    int unresampled_count = 0;
+    for (int b = 0; b < branch_count; b += 1) {
+        if (!plan_converts(fg, &plans[branch_heads[b]], PlanFieldSampleRate))
+            unresampled_count += 1;
+    }
+
+    // as we create filters, these point to the next source to link to
+    AVFilterContext *audio_src_ctx = NULL;
+    int audio_src_pad = 0;
+    if (unresampled_count > 0) {
+        if ((err = add_source(p, fg, fg->sample_rate, fg->time_base, &fg->abuffer_ctx)) < 0)
+            goto out;
+        audio_src_ctx = fg->abuffer_ctx;
+        if ((err = split_output(p, fg, &audio_src_ctx, &audio_src_pad, unresampled_count)) < 0)
+            goto out;
+    }
+
+    for (int b = 0; b < branch_count; b += 1) {
+        struct SinkPlan *head = &plans[branch_heads[b]];
+        AVFilterContext *branch_src_ctx;
+        int branch_src_pad;
+        if (plan_converts(fg, head, PlanFieldSampleRate)) {
+            struct Resampler *r = &fg->resamplers[fg->resampler_count];
+            fg->resampler_count += 1;
+            err = resampler_init(p, fg, r, head->example_sink, head->format.sample_rate);
+            if (err < 0)
+                goto out;
+            branch_src_ctx = r->abuffer_ctx;
+            branch_src_pad = 0;
+        } else {
+            branch_src_ctx = audio_src_ctx;
+            branch_src_pad = audio_src_pad;
+            audio_src_pad += 1;
         }
 
-        if (need_aformat) {
-            AVFilterContext *aformat_ctx;
-            // create aformat filter
-            AVChannelLayout aformat_ch_layout = to_ffmpeg_channel_layout(&aformat_layout);
-            if (av_channel_layout_describe(&aformat_ch_layout, channel_layout_buf,
-                    sizeof(channel_layout_buf)) >= sizeof(channel_layout_buf))
-            {
-                av_log(NULL, AV_LOG_ERROR, "unable to serialize channel layout for the filter graph: buffer size exceeded\n");
-                return -1;
-            }
-            if (snprintf(p->strbuf, sizeof(p->strbuf),
-                    "sample_fmts=%s:sample_rates=%d:channel_layouts=%s",
-                    av_get_sample_fmt_name(to_ffmpeg_fmt_params(aformat_format, aformat_planar)),
-                    aformat_sample_rate, channel_layout_buf) >= sizeof(p->strbuf))
+        // if every leaf wants the same format, convert once for all of them
+        bool pinned = true;
+        for (int i = 0; i < sink_map_count; i += 1) {
+            if (!plans[i].direct && plan_same_branch(fg, &plans[i], head) &&
+                    !plan_formats_equal(&plans[i], head))
             {
-                av_log(NULL, AV_LOG_ERROR, "unable to serialize filter graph string: buffer size exceeded\n");
-                return -1;
-            }
-            av_log(NULL, AV_LOG_INFO, "aformat: %s\n", p->strbuf);
-            err = avfilter_graph_create_filter(&aformat_ctx, p->aformat_filter,
-                    NULL, p->strbuf, NULL, p->filter_graph);
-            if (err < 0) {
-                av_strerror(err, p->strbuf, sizeof(p->strbuf));
-                av_log(NULL, AV_LOG_ERROR, "unable to create aformat filter: %s\n",
-                        p->strbuf);
-                return err;
-            }
-            err = avfilter_link(inner_audio_src_ctx, pad_index, aformat_ctx, 0);
-            if (err < 0) {
-                av_strerror(err, p->strbuf, sizeof(p->strbuf));
-                av_log(NULL, AV_LOG_ERROR, "unable to link aformat filter: %s\n", p->strbuf);
-                return err;
+                pinned = false;
+                break;
             }
-            inner_audio_src_ctx = aformat_ctx;
         }
+        bool pin_format = pinned && (plan_converts(fg, head, PlanFieldSampleFormat) ||
+                plan_converts(fg, head, PlanFieldChannelLayout));
 
-        // create abuffersink filter
-        err = avfilter_graph_create_filter(&map_item->abuffersink_ctx, p->abuffersink_filter,
-                NULL, NULL, NULL, p->filter_graph);
-        if (err < 0) {
-            av_log(NULL, AV_LOG_ERROR, "unable to create abuffersink filter\n");
-            return err;
-        }
-        err = avfilter_link(inner_audio_src_ctx, 0, map_item->abuffersink_ctx, 0);
-        if (err < 0) {
-            av_strerror(err, p->strbuf, sizeof(p->strbuf));
-            av_log(NULL, AV_LOG_ERROR, "unable to link abuffersink filter: %s\n", p->strbuf);
-            return err;
+        if (pin_format) {
+            AVFilterContext *aformat_ctx;
+            if ((err = format_aformat_args(fg, &head->format)) < 0)
+                goto out;
+            err = add_filter(fg, p->aformat_filter, "aformat", fg->strbuf,
+                    branch_src_ctx, branch_src_pad, &aformat_ctx);
+            if (err < 0)
+                goto out;
+            branch_src_ctx = aformat_ctx;
+            branch_src_pad = 0;
         }
 
-        pad_index += 1;
-        map_item = map_item->next;
+        if ((err = split_output(p, fg, &branch_src_ctx, &branch_src_pad, branch_sizes[b])) < 0)
+            goto out;
+
+        int leaf_index = 0;
+        for (int i = 0; i < sink_map_count; i += 1) {
+            struct SinkPlan *plan = &plans[i];
+            if (plan->direct || !plan_same_branch(fg, plan, head))
+                continue;
+
+            AVFilterContext *leaf_src_ctx = branch_src_ctx;
+            int leaf_src_pad = branch_src_pad + leaf_index;
+            leaf_index += 1;
+
+            if (!pinned && plan->need_conversion) {
+                AVFilterContext *aformat_ctx;
+                if ((err = format_aformat_args(fg, &plan->format)) < 0)
+                    goto out;
+                err = add_filter(fg, p->aformat_filter, "aformat", fg->strbuf,
+                        leaf_src_ctx, leaf_src_pad, &aformat_ctx);
+                if (err < 0)
+                    goto out;
+                leaf_src_ctx = aformat_ctx;
+                leaf_src_pad = 0;
+            }
+
+            err = add_filter(fg, p->abuffersink_filter, "abuffersink", NULL,
+                    leaf_src_ctx, leaf_src_pad, &fg->abuffersink_ctxs[i]);
+            if (err < 0)
+                goto out;
+        }
     }
 
-    err = avfilter_graph_config(p->filter_graph, NULL);
+    err = avfilter_graph_config(fg->graph, NULL);
     if (err < 0) {
-        av_strerror(err, p->strbuf, sizeof(p->strbuf));
+        av_strerror(err, fg->strbuf, sizeof(fg->strbuf));
         av_log(NULL, AV_LOG_ERROR, "error configuring the filter graph: %s\n",
-                p->strbuf);
-        return err;
+                fg->strbuf);
+        goto out;
     }
 
-    p->rebuild_filter_graph_flag = 0;
+out:
+    DEALLOCATE(plans);
+    DEALLOCATE(branch_heads);
+    DEALLOCATE(branch_sizes);
+    return err;
+}
+
+// swr only finds out that soxr is missing when it is initialized, so find
+// out once with a small resampler instead of failing to build the real ones.
+static bool probe_soxr(void) {
+    AVChannelLayout mono = AV_CHANNEL_LAYOUT_MONO;
+    SwrContext *swr = NULL;
+    bool ok = swr_alloc_set_opts2(&swr, &mono, AV_SAMPLE_FMT_FLT, 48000,
+            &mono, AV_SAMPLE_FMT_FLT, 44100, 0, NULL) >= 0 &&
+        av_opt_set(swr, "resampler", "soxr", 0) >= 0 &&
+        swr_init(swr) >= 0;
+    swr_free(&swr);
+    if (!ok)
+        av_log(NULL, AV_LOG_INFO, "soxr not available, using swr instead\n");
+    return ok;
+}
+
+static void filter_graph_destroy(struct FilterGraph *fg) {
+    if (!fg)
+        return;
+    avfilter_graph_free(&fg->graph);
+    for (int i = 0; i < fg->resampler_count; i += 1)
+        swr_free(&fg->resamplers[i].swr);
+    DEALLOCATE(fg->resamplers);
+    DEALLOCATE(fg->abuffersink_ctxs);
+    av_channel_layout_uninit(&fg->ch_layout);
+    DEALLOCATE(fg);
+}
+
+static bool filter_graph_matches(const struct FilterGraph *fg, struct AVCodecContext *avctx,
+        AVRational time_base, unsigned sink_map_generation)
+{
+    return !fg->eof &&
+        fg->sink_map_generation == sink_map_generation &&
+        fg->sample_rate == avctx->sample_rate &&
+        av_channel_layout_compare(&fg->ch_layout, &avctx->ch_layout) == 0 &&
+        fg->sample_fmt == avctx->sample_fmt &&
+        fg->time_base.num == time_base.num &&
+        fg->time_base.den == time_base.den;
+}
+
+static bool filter_graph_same_input(const struct FilterGraph *a, const struct FilterGraph *b) {
+    return a->sample_rate == b->sample_rate &&
+        av_channel_layout_compare(&a->ch_layout, &b->ch_layout) == 0 &&
+        a->sample_fmt == b->sample_fmt &&
+        a->time_base.num == b->time_base.num &&
+        a->time_base.den == b->time_base.den;
+}
+
+// Throws away the audio inside the graph, so that it starts over as if it
+// was new: a cached graph which is used again, or the graph in use when the
+// sinks are flushed or its item is removed. filter_graph_finish has emptied
+// the resamplers of a cached graph already, but only a reset makes them take
+// input again.
+static int filter_graph_reset(struct FilterGraph *fg) {
+    if (!fg || fg->bypass)
+        return 0;
+
+    fg->item = NULL;
+    for (int i = 0; i < fg->resampler_count; i += 1) {
+        int err = resampler_reset(&fg->resamplers[i]);
+        if (err < 0)
+            return (err == AVERROR(ENOMEM)) ? GrooveErrorNoMem : GrooveErrorDecoding;
+    }
 
+    AVFrame *frame = av_frame_alloc();
+    if (!frame)
+        return GrooveErrorNoMem;
+    for (int i = 0; i < fg->abuffersink_count; i += 1) {
+        if (!fg->abuffersink_ctxs[i])
+            continue;
+        while (av_buffersink_get_frame(fg->abuffersink_ctxs[i], frame) >= 0)
+            av_frame_unref(frame);
+    }
+    av_frame_free(&frame);
     return 0;
 }
 
@@ -543,19 +1715,73 @@ static int maybe_init_filter_graph(struct GroovePlaylist *playlist, struct Groov
     struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
     struct AVCodecContext *avctx = f->decode_ctx;
     AVRational time_base = f->audio_st->time_base;
+    int err;
+
+    if (p->filter_graph && filter_graph_matches(p->filter_graph, avctx, time_base,
+                p->sink_map_generation))
+    {
+        return 0;
+    }
+
+    // the input format changed. what the graph holds back is the end of the
+    // audio before the change, so it goes out first.
+    filter_graph_finish(playlist, p->filter_graph);
+
+    // look for a graph we built earlier, dropping the ones that can never be
+    // used again.
+    p->filter_graph = NULL;
+    struct FilterGraph **free_slot = NULL;
+    for (int i = 0; i < FILTER_GRAPH_CACHE_SIZE; i += 1) {
+        struct FilterGraph *fg = p->filter_graph_cache[i];
+        if (fg && (fg->eof || fg->sink_map_generation != p->sink_map_generation)) {
+            filter_graph_destroy(fg);
+            p->filter_graph_cache[i] = NULL;
+            fg = NULL;
+        }
+        if (!fg) {
+            if (!free_slot)
+                free_slot = &p->filter_graph_cache[i];
+        } else if (filter_graph_matches(fg, avctx, time_base, p->sink_map_generation)) {
+            p->filter_graph = fg;
+        }
+    }
 
-    // if the input format stuff has changed, then we need to re-build the graph
-    if (!p->filter_graph || p->rebuild_filter_graph_flag ||
-        p->in_sample_rate != avctx->sample_rate ||
-        (av_channel_layout_compare(&p->in_channel_layout, &avctx->ch_layout) != 0) ||
-        p->in_sample_fmt != avctx->sample_fmt ||
-        p->in_time_base.num != time_base.num ||
-        p->in_time_base.den != time_base.den ||
-        p->volume != p->filter_volume ||
-        p->peak != p->filter_peak)
+    if (p->filter_graph) {
+        if ((err = filter_graph_reset(p->filter_graph)) < 0) {
+            p->filter_graph = NULL;
+            return err;
+        }
+        p->filter_graph->last_used = ++p->filter_graph_clock;
+        return 0;
+    }
+
+    // evict the least recently used graph to make room
+    if (!free_slot) {
+        free_slot = &p->filter_graph_cache[0];
+        for (int i = 1; i < FILTER_GRAPH_CACHE_SIZE; i += 1) {
+            if (p->filter_graph_cache[i]->last_used < (*free_slot)->last_used)
+                free_slot = &p->filter_graph_cache[i];
+        }
+        filter_graph_destroy(*free_slot);
+        *free_slot = NULL;
+    }
+
+    struct FilterGraph *fg = ALLOCATE(struct FilterGraph, 1);
+    if (!fg) {
+        av_log(NULL, AV_LOG_ERROR, "unable to create filter graph: out of memory\n");
+        return GrooveErrorNoMem;
+    }
+    fg->sink_map_generation = p->sink_map_generation;
+    if ((err = filter_graph_set_input(fg, avctx->sample_rate, &avctx->ch_layout,
+                    avctx->sample_fmt, time_base)) < 0 ||
+        (err = init_filter_graph(p, fg, p->sink_map, p->sink_map_count, true)) < 0)
     {
-        return init_filter_graph(playlist, file);
+        filter_graph_destroy(fg);
+        return err;
     }
+    fg->last_used = ++p->filter_graph_clock;
+    *free_slot = fg;
+    p->filter_graph = fg;
 
     return 0;
 }
@@ -577,13 +1803,35 @@ static int every_sink(struct GroovePlaylist *playlist, int (*func)(struct Groove
     return default_value;
 }
 
+// inline sinks take buffers as they come, so they are never full
 static int sink_is_full(struct GrooveSink *sink) {
     struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
-    return GROOVE_ATOMIC_LOAD(s->audioq_size) >= s->min_audioq_size;
+    if (sink->process)
+        return 0;
+    // this is where audio waiting for room in the ring gets written
+    if (s->ring)
+        return !ring_write_pending(s) || ring_free_bytes(s) == 0;
+    return groove_sink_log_fill_level(&s->reader) >= s->min_audioq_size;
 }
 
+// Inline sinks do not count here, unless there are only inline sinks; then
+// nothing is ever full.
 static int every_sink_full(struct GroovePlaylist *playlist) {
-    return every_sink(playlist, sink_is_full, 1);
+    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
+    bool any_queued = false;
+    for (struct SinkMap *map_item = p->sink_map; map_item; map_item = map_item->next) {
+        for (struct SinkStack *stack_item = map_item->stack_head; stack_item;
+                stack_item = stack_item->next)
+        {
+            struct GrooveSink *sink = stack_item->sink;
+            if (sink->process)
+                continue;
+            if (!sink_is_full(sink))
+                return 0;
+            any_queued = true;
+        }
+    }
+    return any_queued;
 }
 
 static int any_sink_full(struct GroovePlaylist *playlist) {
@@ -596,7 +1844,16 @@ static int any_sink_full(struct GroovePlaylist *playlist) {
 
 static int sink_signal_end(struct GrooveSink *sink) {
     struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
-    groove_queue_put(s->audioq, end_of_q_sentinel);
+    batch_send(sink);
+    if (s->ring) {
+        ring_put(sink, end_of_q_sentinel);
+        return 0;
+    }
+    if (sink->process) {
+        sink->process(sink, end_of_q_sentinel);
+        return 0;
+    }
+    groove_sink_log_put(s->reader.log, &s->reader, end_of_q_sentinel);
     if (sink->filled) sink->filled(sink);
     return 0;
 }
@@ -608,7 +1865,7 @@ static void sink_set_buffer_size_bytes(struct GrooveSink *sink, int buffer_size_
 
     sink->buffer_size_bytes = buffer_size_bytes;
     s->min_audioq_size = sink->buffer_size_bytes;
-    if (GROOVE_ATOMIC_LOAD(s->audioq_size) < s->min_audioq_size) {
+    if (groove_sink_log_fill_level(&s->reader) < s->min_audioq_size) {
         pthread_mutex_lock(&p->drain_cond_mutex);
         pthread_cond_signal(&p->sink_drain_cond);
         pthread_mutex_unlock(&p->drain_cond_mutex);
@@ -628,10 +1885,41 @@ static void every_sink_signal_end(struct GroovePlaylist *playlist) {
     every_sink(playlist, sink_signal_end, 0);
 }
 
+static void sink_convert_drop_pending(struct GrooveSinkPrivate *s) {
+    if (s->convert_pending && s->convert_pending != end_of_q_sentinel)
+        groove_buffer_unref(s->convert_pending);
+    s->convert_pending = NULL;
+}
+
+// Throws away audio that a sink which converts on get has buffered, if it
+// belongs to `item`, or always if `item` is NULL.
+static void sink_convert_reset(struct GrooveSinkPrivate *s, struct GroovePlaylistItem *item) {
+    if (!(s->externals.flags & GrooveSinkFlagConvertOnGet))
+        return;
+    pthread_mutex_lock(&s->get_mutex);
+    if (!item || s->convert_item == item) {
+        filter_graph_destroy(s->convert_graph);
+        s->convert_graph = NULL;
+        s->convert_item = NULL;
+    }
+    if (!item || (s->convert_pending && s->convert_pending != end_of_q_sentinel &&
+                s->convert_pending->item == item))
+    {
+        sink_convert_drop_pending(s);
+    }
+    pthread_mutex_unlock(&s->get_mutex);
+}
+
 static int sink_flush(struct GrooveSink *sink) {
     struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
 
-    groove_queue_flush(s->audioq);
+    batch_drop(s);
+    sink_convert_reset(s, NULL);
+    // the log was flushed already. what is in the ring is the reader's.
+    ring_drop_partial(s);
+    GROOVE_ATOMIC_STORE(s->ring_indexes->end_index, -1);
+    if (s->shm)
+        groove_shm_writer_flush(s->shm);
     if (sink->flush)
         sink->flush(sink);
 
@@ -639,20 +1927,66 @@ static int sink_flush(struct GrooveSink *sink) {
 }
 
 static void every_sink_flush(struct GroovePlaylist *playlist) {
+    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
+    for (struct SinkMap *map_item = p->sink_map; map_item; map_item = map_item->next)
+        groove_sink_log_flush(map_item->log);
     every_sink(playlist, sink_flush, 0);
 }
 
+// Sends every frame the decoder has ready through the gain stage and the
+// filter graph.
+static int receive_frames(struct GroovePlaylist *playlist, struct GrooveFile *file) {
+    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
+    struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
+    AVCodecContext *decode_ctx = f->decode_ctx;
+    int err;
+
+    AVFrame *frame = p->in_frame;
+
+    for (;;) {
+        err = avcodec_receive_frame(decode_ctx, frame);
+        if (err == AVERROR_EOF || err == AVERROR(EAGAIN)) {
+            return 0;
+        } else if (err < 0) {
+            return GrooveErrorDecoding;
+        }
+
+        frame->pts = frame->best_effort_timestamp;
+        // the filter graph and audio_clock take pts in this time base too.
+        // views of the frame need it to move their pts.
+        frame->time_base = f->audio_st->time_base;
+        // sending the frame moves its data out, so read the clock first
+        if (frame->pts != AV_NOPTS_VALUE) {
+            f->audio_clock = av_q2d(f->audio_st->time_base) * frame->pts;
+#ifdef AV_CODEC_FLAG_COPY_OPAQUE
+            f->clock_byte_pos = (intptr_t)frame->opaque;
+#endif
+        }
+
+        if ((err = groove_gain_apply(&p->volume_gain, frame)) < 0)
+            return err;
+
+        if ((err = send_frame_to_filter_graph(playlist, frame)) < 0)
+            return err;
+    }
+}
+
 static int decode_one_frame(struct GroovePlaylist *playlist, struct GrooveFile *file) {
     struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
     struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
     AVPacket *pkt = f->audio_pkt;
-    AVCodecContext *decode_ctx = f->decode_ctx;
     int err;
 
     // abort_request is set if we are destroying the file
     if (GROOVE_ATOMIC_LOAD(f->abort_request))
         return -1;
 
+    if ((err = groove_file_decoder_get(file)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "%s: unable to open decoder\n", f->ic->url);
+        return -1;
+    }
+    AVCodecContext *decode_ctx = f->decode_ctx;
+
     // might need to rebuild the filter graph if certain things changed
     if (maybe_init_filter_graph(playlist, file) < 0)
         return -1;
@@ -664,25 +1998,34 @@ static int decode_one_frame(struct GroovePlaylist *playlist, struct GrooveFile *
             int64_t seek_pos = f->seek_pos;
             if (seek_pos == 0 && f->audio_st->start_time != AV_NOPTS_VALUE)
                 seek_pos = f->audio_st->start_time;
-            if (av_seek_frame(f->ic, f->audio_stream_index, seek_pos, 0) < 0) {
+            // a byte offset from a playlist snapshot lands exactly where we
+            // left off without the format having to search for a timestamp.
+            err = -1;
+            if (f->seek_byte_pos >= 0 && !(f->ic->iformat->flags & AVFMT_NO_BYTE_SEEK))
+                err = av_seek_frame(f->ic, -1, f->seek_byte_pos, AVSEEK_FLAG_BYTE);
+            if (err < 0)
+                err = av_seek_frame(f->ic, f->audio_stream_index, seek_pos, 0);
+            if (err < 0) {
                 av_log(NULL, AV_LOG_ERROR, "%s: error while seeking\n", f->ic->url);
             } else if (f->seek_flush) {
                 every_sink_flush(playlist);
+                filter_graph_reset(p->filter_graph);
             }
             avcodec_flush_buffers(decode_ctx);
         }
         f->ever_seeked = true;
         f->seek_pos = -1;
+        f->seek_byte_pos = -1;
         f->eof = 0;
     }
     pthread_mutex_unlock(&f->seek_mutex);
 
     if (f->eof) {
+        // let out the frames the decoder holds back. the filter graph is not
+        // ended: the next file may go on through it without a gap.
         if (decode_ctx->codec->capabilities & AV_CODEC_CAP_DELAY) {
-            if ((err = send_frame_to_filter_graph(playlist, NULL)) > 0) {
-                // keep flushing
-                return 0;
-            }
+            avcodec_send_packet(decode_ctx, NULL);
+            receive_frames(playlist, file);
         }
         // this file is complete. move on
         return -1;
@@ -700,6 +2043,12 @@ static int decode_one_frame(struct GroovePlaylist *playlist, struct GrooveFile *
         av_packet_unref(pkt);
         return 0;
     }
+#ifdef AV_CODEC_FLAG_COPY_OPAQUE
+    // the decoder copies this to the frames of the packet. decoders with
+    // delay hand frames out after later packets have been read, so the
+    // position of the last packet read is not the one of the clock.
+    pkt->opaque = (void *)(intptr_t)(pkt->pos <= INTPTR_MAX ? pkt->pos : -1);
+#endif
     av_packet_rescale_ts(pkt,
         f->ic->streams[pkt->stream_index]->time_base,
         decode_ctx->time_base);
@@ -710,82 +2059,47 @@ static int decode_one_frame(struct GroovePlaylist *playlist, struct GrooveFile *
         return 0;
     }
 
-    AVFrame *frame = p->in_frame;
-
-    for (;;) {
-        err = avcodec_receive_frame(decode_ctx, frame);
-        if (err == AVERROR_EOF || err == AVERROR(EAGAIN)) {
-            f->audio_clock = av_q2d(f->audio_st->time_base) * frame->pts;
-            av_packet_unref(pkt);
-            return 0;
-        } else if (err < 0) {
-            return GrooveErrorDecoding;
-        }
-
-        frame->pts = frame->best_effort_timestamp;
-
-        if ((err = send_frame_to_filter_graph(playlist, frame)) < 0)
-            return err;
-    }
-}
-
-static void audioq_put(struct GrooveQueue *queue, void *obj) {
-    struct GrooveBuffer *buffer = (struct GrooveBuffer *)obj;
-    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *)queue->context;
-    if (buffer == end_of_q_sentinel) {
-        GROOVE_ATOMIC_STORE(s->audioq_contains_end, true);
-    } else {
-        GROOVE_ATOMIC_FETCH_ADD(s->audioq_size, buffer->size);
-    }
+    err = receive_frames(playlist, file);
+    av_packet_unref(pkt);
+    return err;
 }
 
-static void audioq_get(struct GrooveQueue *queue, void *obj) {
-    struct GrooveBuffer *buffer = (struct GrooveBuffer *)obj;
-    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *)queue->context;
-    if (buffer == end_of_q_sentinel) {
-        GROOVE_ATOMIC_STORE(s->audioq_contains_end, false);
-        return;
-    }
-    struct GrooveSink *sink = &s->externals;
-    GROOVE_ATOMIC_FETCH_ADD(s->audioq_size, -buffer->size);
-
-    struct GroovePlaylist *playlist = sink->playlist;
+static void update_playlist_volume(struct GroovePlaylist *playlist) {
     struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
-    if (GROOVE_ATOMIC_LOAD(s->audioq_size) < s->min_audioq_size) {
-        pthread_mutex_lock(&p->drain_cond_mutex);
-        pthread_cond_signal(&p->sink_drain_cond);
-        pthread_mutex_unlock(&p->drain_cond_mutex);
-    }
-}
-
-static void audioq_cleanup(struct GrooveQueue *queue, void *obj) {
-    struct GrooveBuffer *buffer = (struct GrooveBuffer *)obj;
-    struct GrooveSink *sink = (struct GrooveSink *)queue->context;
-    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
-    if (buffer == end_of_q_sentinel) {
-        GROOVE_ATOMIC_STORE(s->audioq_contains_end, false);
-        return;
-    }
-    GROOVE_ATOMIC_FETCH_ADD(s->audioq_size, -buffer->size);
-    groove_buffer_unref(buffer);
+    struct GroovePlaylistItem *item = p->decode_head;
+    p->volume = playlist->gain * item->gain;
+    p->peak = item->peak;
+    // adjust for the known true peak of the playlist item. In other words, if
+    // we know that the song peaks at 0.8, and we want to amplify by 1.2, that
+    // comes out to 0.96 so we know that we can safely amplify by 1.2 even
+    // though it's greater than 1.0.
+    double amp_vol = p->volume * (p->peak > 1.0 ? 1.0 : p->peak);
+    // a new item starts at its own gain; changes within an item are ramped
+    groove_gain_set(&p->volume_gain, p->volume, amp_vol > 1.0, item != p->volume_gain_item);
+    p->volume_gain_item = item;
 }
 
-static int audioq_purge(struct GrooveQueue *queue, void *obj) {
-    struct GrooveBuffer *buffer = (struct GrooveBuffer *)obj;
-    if (buffer == end_of_q_sentinel)
-        return 0;
-    struct GrooveSink *sink = (struct GrooveSink *)queue->context;
-    struct GroovePlaylist *playlist = sink->playlist;
-    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
-    struct GroovePlaylistItem *item = p->purge_item;
-    return buffer->item == item;
+// Every change of the decode head goes through here. The file it leaves is
+// done decoding, so another file can use its decoder.
+static void set_decode_head(struct GroovePlaylistPrivate *p, struct GroovePlaylistItem *item) {
+    if (p->decode_head && p->decode_head != item)
+        groove_file_decoder_put(p->decode_head->file);
+    p->decode_head = item;
 }
 
-static void update_playlist_volume(struct GroovePlaylist *playlist) {
+static void advance_decode_head(struct GroovePlaylist *playlist) {
     struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
-    struct GroovePlaylistItem *item = p->decode_head;
-    p->volume = playlist->gain * item->gain;
-    p->peak = item->peak;
+    set_decode_head(p, p->decode_head->next);
+    // seek to beginning of next song
+    if (p->decode_head) {
+        struct GrooveFile *next_file = p->decode_head->file;
+        struct GrooveFilePrivate *next_f = (struct GrooveFilePrivate *) next_file;
+        pthread_mutex_lock(&next_f->seek_mutex);
+        next_f->seek_pos = 0;
+        next_f->seek_byte_pos = -1;
+        next_f->seek_flush = 0;
+        pthread_mutex_unlock(&next_f->seek_mutex);
+    }
 }
 
 // this thread is responsible for decoding and inserting buffers of decoded
@@ -799,6 +2113,9 @@ static void *decode_thread(void *arg) {
         // if we don't have anything to decode, wait until we do
         if (!p->decode_head) {
             if (!p->sent_end_of_q) {
+                // the end of the last item is still in the graph
+                filter_graph_finish(playlist, p->filter_graph);
+                p->filter_graph = NULL;
                 every_sink_signal_end(playlist);
                 p->sent_end_of_q = 1;
             }
@@ -808,88 +2125,65 @@ static void *decode_thread(void *arg) {
         }
         p->sent_end_of_q = 0;
 
-        // if all sinks are filled up, no need to read more
         struct GrooveFile *file = p->decode_head->file;
         struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
 
-        pthread_mutex_lock(&p->drain_cond_mutex);
-        if (p->detect_full_sinks(playlist) && (f->seek_pos < 0 || !f->seek_flush)) {
-            if (!f->paused) {
-                av_read_pause(f->ic);
-                f->paused = 1;
-            }
-            pthread_mutex_unlock(&p->decode_head_mutex);
-            pthread_cond_wait(&p->sink_drain_cond, &p->drain_cond_mutex);
-            pthread_mutex_unlock(&p->drain_cond_mutex);
+        // files restored from a snapshot are opened when we get to them.
+        // that reads the file, so decode_head_mutex is let go meanwhile and
+        // the item is checked again afterwards; it may have been removed.
+        char *lazy_path;
+        char *lazy_hint;
+        if (groove_file_lazy_begin(file, &lazy_path, &lazy_hint) < 0) {
+            advance_decode_head(playlist);
             continue;
         }
-        pthread_mutex_unlock(&p->drain_cond_mutex);
-        if (f->paused) {
-            av_read_play(f->ic);
-            f->paused = 0;
-        }
-
-        update_playlist_volume(playlist);
-
-        if (decode_one_frame(playlist, file) < 0) {
-            p->decode_head = p->decode_head->next;
-            // seek to beginning of next song
-            if (p->decode_head) {
-                struct GrooveFile *next_file = p->decode_head->file;
-                struct GrooveFilePrivate *next_f = (struct GrooveFilePrivate *) next_file;
-                pthread_mutex_lock(&next_f->seek_mutex);
-                next_f->seek_pos = 0;
-                next_f->seek_flush = 0;
-                pthread_mutex_unlock(&next_f->seek_mutex);
+        if (lazy_path) {
+            struct GroovePlaylistItem *lazy_item = p->decode_head;
+            struct GrooveFile *opened;
+            pthread_mutex_unlock(&p->decode_head_mutex);
+            int err = groove_file_lazy_probe(p->groove, lazy_path, lazy_hint, &opened);
+            pthread_mutex_lock(&p->decode_head_mutex);
+            if (p->decode_head != lazy_item) {
+                groove_file_destroy(opened);
+            } else if (err) {
+                advance_decode_head(playlist);
+            } else {
+                groove_file_lazy_finish(file, opened);
             }
+            continue;
         }
 
-    }
-    pthread_mutex_unlock(&p->decode_head_mutex);
-
-    return NULL;
-}
-
-static bool sink_supports_sample_rate_range(const struct GrooveSink *test_sink,
-        const struct SoundIoSampleRateRange *test_range)
-{
-    if (!test_sink->sample_rates)
-        return true;
-
-    for (int i = 0; i < test_sink->sample_rate_count; i += 1) {
-        const struct SoundIoSampleRateRange *range = &test_sink->sample_rates[i];
-
-        if (test_range->min >= range->min && test_range->max <= range->max) {
-            return true;
-        }
-    }
-    return false;
-}
-
-static bool sink_supports_sample_format(const struct GrooveSink *test_sink, enum SoundIoFormat test_format) {
-    if (!test_sink->sample_formats)
-        return true;
+        // if all sinks are filled up, no need to read more
 
-    for (int i = 0; i < test_sink->sample_format_count; i += 1) {
-        enum SoundIoFormat format = test_sink->sample_formats[i];
-        if (format == test_format)
-            return true;
-    }
-    return false;
-}
+        pthread_mutex_lock(&p->drain_cond_mutex);
+        if (p->detect_full_sinks(playlist) && (f->seek_pos < 0 || !f->seek_flush)) {
+            if (!f->paused) {
+                av_read_pause(f->ic);
+                f->paused = 1;
+            }
+            pthread_mutex_unlock(&p->decode_head_mutex);
+            pthread_cond_wait(&p->sink_drain_cond, &p->drain_cond_mutex);
+            pthread_mutex_unlock(&p->drain_cond_mutex);
+            // the rest of the loop, and sink_map_edit_commit, count on
+            // holding decode_head_mutex for a whole frame
+            pthread_mutex_lock(&p->decode_head_mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&p->drain_cond_mutex);
+        if (f->paused) {
+            av_read_play(f->ic);
+            f->paused = 0;
+        }
 
-static bool sink_supports_channel_layout(const struct GrooveSink *test_sink,
-        const struct SoundIoChannelLayout *test_layout)
-{
-    if (!test_sink->channel_layouts)
-        return true;
+        update_playlist_volume(playlist);
+
+        if (decode_one_frame(playlist, file) < 0)
+            advance_decode_head(playlist);
 
-    for (int i = 0; i < test_sink->channel_layout_count; i += 1) {
-        const struct SoundIoChannelLayout *layout = &test_sink->channel_layouts[i];
-        if (soundio_channel_layout_equal(layout, test_layout))
-            return true;
     }
-    return false;
+    pthread_mutex_unlock(&p->decode_head_mutex);
+
+    return NULL;
 }
 
 static bool sink_formats_compatible(const struct GrooveSink *example_sink,
@@ -901,19 +2195,28 @@ static bool sink_formats_compatible(const struct GrooveSink *example_sink,
     {
         return false;
     }
-    if (example_sink->gain != test_sink->gain)
+
+    // a buffer can only have been resampled one way
+    if (!sink_resample_equal(example_sink, test_sink))
+        return false;
+
+    // these are converted on a different thread, so they are kept apart
+    if ((example_sink->flags & GrooveSinkFlagConvertOnGet) !=
+            (test_sink->flags & GrooveSinkFlagConvertOnGet))
+    {
         return false;
+    }
 
     // test_sink must support everything example_sink supports
     // planar vs interleaved
     bool test_sink_planar_ok = (test_sink->flags & GrooveSinkFlagPlanarOk);
-    bool test_sink_interleaved_ok = (test_sink->flags & GrooveSinkFlagPlanarOk);
+    bool test_sink_interleaved_ok = (test_sink->flags & GrooveSinkFlagInterleavedOk);
     if (!test_sink_planar_ok && !test_sink_interleaved_ok) {
         test_sink_planar_ok = true;
         test_sink_interleaved_ok = true;
     }
     bool example_sink_planar_ok = (example_sink->flags & GrooveSinkFlagPlanarOk);
-    bool example_sink_interleaved_ok = (example_sink->flags & GrooveSinkFlagPlanarOk);
+    bool example_sink_interleaved_ok = (example_sink->flags & GrooveSinkFlagInterleavedOk);
     if (!example_sink_planar_ok && !example_sink_interleaved_ok) {
         example_sink_planar_ok = true;
         example_sink_interleaved_ok = true;
@@ -951,11 +2254,85 @@ static bool sink_formats_compatible(const struct GrooveSink *example_sink,
     return true;
 }
 
-static int remove_sink_from_map(struct GrooveSink *sink) {
-    struct GroovePlaylist *playlist = sink->playlist;
-    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
+static void sink_map_free(struct SinkMap *map_item) {
+    while (map_item) {
+        struct SinkMap *next_map_item = map_item->next;
+        struct SinkStack *stack_item = map_item->stack_head;
+        while (stack_item) {
+            struct SinkStack *next_stack_item = stack_item->next;
+            DEALLOCATE(stack_item);
+            stack_item = next_stack_item;
+        }
+        groove_sink_log_unref(map_item->log);
+        DEALLOCATE(map_item);
+        map_item = next_map_item;
+    }
+}
 
-    struct SinkMap *map_item = p->sink_map;
+static bool sink_map_contains_in_entry(const struct SinkMap *map_item,
+        const struct GrooveSink *sink)
+{
+    for (struct SinkStack *stack_item = map_item->stack_head; stack_item;
+            stack_item = stack_item->next)
+    {
+        if (stack_item->sink == sink)
+            return true;
+    }
+    return false;
+}
+
+static bool sink_map_contains(const struct SinkMap *map_item, const struct GrooveSink *sink) {
+    for (; map_item; map_item = map_item->next) {
+        if (sink_map_contains_in_entry(map_item, sink))
+            return true;
+    }
+    return false;
+}
+
+static int sink_map_clone(const struct SinkMap *map_item, struct SinkMap **out_map) {
+    struct SinkMap *map = NULL;
+    struct SinkMap **map_tail = &map;
+    for (; map_item; map_item = map_item->next) {
+        struct SinkMap *map_entry = ALLOCATE(struct SinkMap, 1);
+        if (!map_entry) {
+            sink_map_free(map);
+            return GrooveErrorNoMem;
+        }
+        *map_tail = map_entry;
+        map_tail = &map_entry->next;
+        groove_sink_log_ref(map_item->log);
+        map_entry->log = map_item->log;
+
+        struct SinkStack **stack_tail = &map_entry->stack_head;
+        for (struct SinkStack *stack_item = map_item->stack_head; stack_item;
+                stack_item = stack_item->next)
+        {
+            struct SinkStack *stack_entry = ALLOCATE(struct SinkStack, 1);
+            if (!stack_entry) {
+                sink_map_free(map);
+                return GrooveErrorNoMem;
+            }
+            stack_entry->sink = stack_item->sink;
+            *stack_tail = stack_entry;
+            stack_tail = &stack_entry->next;
+        }
+    }
+    *out_map = map;
+    return 0;
+}
+
+static struct GrooveSinkLog *sink_map_find_log(const struct SinkMap *map_item,
+        const struct GrooveSink *sink)
+{
+    for (; map_item; map_item = map_item->next) {
+        if (sink_map_contains_in_entry(map_item, sink))
+            return map_item->log;
+    }
+    return NULL;
+}
+
+static int remove_sink_from_map(struct SinkMapEdit *edit, struct GrooveSink *sink) {
+    struct SinkMap *map_item = edit->sink_map;
     struct SinkMap *prev_map_item = NULL;
     while (map_item) {
         struct SinkMap *next_map_item = map_item->next;
@@ -969,15 +2346,19 @@ static int remove_sink_from_map(struct GrooveSink *sink) {
                 if (prev_stack_item) {
                     prev_stack_item->next = next_stack_item;
                 } else if (next_stack_item) {
+                    // the next sink becomes the example for this entry
                     map_item->stack_head = next_stack_item;
+                    edit->graph_changed = true;
                 } else {
                     // the stack is empty; delete the map item
+                    groove_sink_log_unref(map_item->log);
                     DEALLOCATE(map_item);
-                    p->sink_map_count -= 1;
+                    edit->graph_changed = true;
+                    edit->sink_map_count -= 1;
                     if (prev_map_item) {
                         prev_map_item->next = next_map_item;
                     } else {
-                        p->sink_map = next_map_item;
+                        edit->sink_map = next_map_item;
                     }
                 }
                 return 0;
@@ -993,9 +2374,7 @@ static int remove_sink_from_map(struct GrooveSink *sink) {
     return GrooveErrorSinkNotFound;
 }
 
-static int add_sink_to_map(struct GroovePlaylist *playlist, struct GrooveSink *sink) {
-    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
-
+static int add_sink_to_map(struct SinkMapEdit *edit, struct GrooveSink *sink) {
     struct SinkStack *stack_entry = ALLOCATE(struct SinkStack, 1);
 
     if (!stack_entry)
@@ -1003,7 +2382,7 @@ static int add_sink_to_map(struct GroovePlaylist *playlist, struct GrooveSink *s
 
     stack_entry->sink = sink;
 
-    struct SinkMap *map_item = p->sink_map;
+    struct SinkMap *map_item = edit->sink_map;
     while (map_item) {
         // if our sink matches the example sink from this map entry,
         // push our sink onto the stack and we're done
@@ -1018,26 +2397,197 @@ static int add_sink_to_map(struct GroovePlaylist *playlist, struct GrooveSink *s
         if (sink_formats_compatible(sink, example_sink)) {
             stack_entry->next = map_item->stack_head;
             map_item->stack_head = stack_entry;
-            p->rebuild_filter_graph_flag = 1;
+            edit->graph_changed = true;
             return 0;
         }
         map_item = map_item->next;
     }
     // we did not find somewhere to put it, so push it onto the stack.
     struct SinkMap *map_entry = ALLOCATE(struct SinkMap, 1);
-    map_entry->stack_head = stack_entry;
     if (!map_entry) {
         DEALLOCATE(stack_entry);
         return GrooveErrorNoMem;
     }
-    if (p->sink_map) {
-        map_entry->next = p->sink_map;
-        p->sink_map = map_entry;
-    } else {
-        p->sink_map = map_entry;
+    map_entry->log = groove_sink_log_create();
+    if (!map_entry->log) {
+        DEALLOCATE(map_entry);
+        DEALLOCATE(stack_entry);
+        return GrooveErrorNoMem;
+    }
+    map_entry->stack_head = stack_entry;
+    map_entry->next = edit->sink_map;
+    edit->sink_map = map_entry;
+    edit->graph_changed = true;
+    edit->sink_map_count += 1;
+    return 0;
+}
+
+// Starts a change to the sink map. Holds sink_map_mutex until the edit is
+// committed or aborted, so the map being copied cannot change underneath.
+static int sink_map_edit_begin(struct GroovePlaylistPrivate *p, struct SinkMapEdit *edit) {
+    pthread_mutex_lock(&p->sink_map_mutex);
+    edit->sink_map_count = p->sink_map_count;
+    edit->graph_changed = false;
+    int err = sink_map_clone(p->sink_map, &edit->sink_map);
+    if (err < 0)
+        pthread_mutex_unlock(&p->sink_map_mutex);
+    return err;
+}
+
+static void sink_map_edit_abort(struct GroovePlaylistPrivate *p, struct SinkMapEdit *edit) {
+    sink_map_free(edit->sink_map);
+    pthread_mutex_unlock(&p->sink_map_mutex);
+}
+
+// Hands the state of the resamplers of `old_fg` to the ones of `fg` which
+// resample the same way, so that what they hold back comes out of the new
+// graph where it would have come out of the old one. `old_fg` gets the
+// fresh resamplers in exchange.
+static void filter_graph_adopt(struct FilterGraph *fg, struct FilterGraph *old_fg) {
+    fg->item = old_fg->item;
+    for (int i = 0; i < fg->resampler_count; i += 1) {
+        struct Resampler *r = &fg->resamplers[i];
+        for (int j = 0; j < old_fg->resampler_count; j += 1) {
+            struct Resampler *old_r = &old_fg->resamplers[j];
+            if (old_r->sample_rate != r->sample_rate || strcmp(old_r->args, r->args) != 0)
+                continue;
+            SwrContext *swr = r->swr;
+            int64_t next_pts = r->next_pts;
+            r->swr = old_r->swr;
+            r->next_pts = old_r->next_pts;
+            old_r->swr = swr;
+            old_r->next_pts = next_pts;
+            break;
+        }
+    }
+}
+
+// Pushes the audio still inside a filter graph that is being replaced out to
+// the sinks which remain attached, so that they see no gap at the swap. The
+// graph is not ended: a short last block goes to the sinks as it is, and
+// sinks which regroup carry it on into their next block.
+static void filter_graph_drain(struct GroovePlaylist *playlist, struct FilterGraph *fg,
+        struct SinkMap *old_map, const struct SinkMap *new_map)
+{
+    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
+
+    // with nothing decoded into the graph there is nothing to push out
+    if (fg->bypass || !fg->item)
+        return;
+    // resamplers which the new graph did not adopt are done
+    for (int i = 0; i < fg->resampler_count; i += 1) {
+        if (resampler_send(p->groove, fg, &fg->resamplers[i], NULL) < 0)
+            av_log(NULL, AV_LOG_WARNING, "unable to flush resampler; dropping its last samples\n");
+    }
+
+    int sink_index = 0;
+    for (struct SinkMap *map_item = old_map; map_item; map_item = map_item->next) {
+        struct GrooveSink *example_sink = map_item->stack_head->sink;
+        AVFilterContext *abuffersink_ctx = fg->abuffersink_ctxs[sink_index];
+        sink_index += 1;
+        while (abuffersink_ctx) {
+            AVFrame *oframe = groove_frame_alloc(p->groove);
+            if (!oframe)
+                return;
+            if (buffersink_take(abuffersink_ctx, example_sink, oframe, true) <= 0) {
+                groove_frame_free(p->groove, &oframe);
+                break;
+            }
+            struct GrooveBuffer *buffer = frame_to_groove_buffer(playlist, fg->item, oframe);
+            if (!buffer) {
+                groove_frame_free(p->groove, &oframe);
+                return;
+            }
+            groove_buffer_ref(buffer);
+            // sinks on their way out read from the log until they have left
+            // it, so the shared entry is for them too
+            groove_buffer_ref(buffer);
+            groove_sink_log_put(map_item->log, NULL, buffer);
+            for (struct SinkStack *stack_item = map_item->stack_head; stack_item;
+                    stack_item = stack_item->next)
+            {
+                struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) stack_item->sink;
+                if (!s->reader.shared && sink_map_contains(new_map, stack_item->sink))
+                    send_buffer_to_sink(playlist, stack_item->sink, buffer);
+            }
+            groove_buffer_unref(buffer);
+        }
+    }
+}
+
+// Builds the filter graph for the edited map away from the decode thread,
+// then swaps map and graph in between two decoded frames. The decode thread
+// holds decode_head_mutex from before it reads a packet until every frame
+// of it has gone through the graph. It lets go of it only in between, to wait
+// or to open a lazy file, so that lock is the frame boundary.
+static int sink_map_edit_commit(struct GroovePlaylistPrivate *p, struct SinkMapEdit *edit) {
+    struct GroovePlaylist *playlist = &p->externals;
+    struct FilterGraph *fg = NULL;
+
+    if (edit->graph_changed) {
+        // build for the format that is currently being decoded. if nothing
+        // has been decoded yet, the decode thread builds the graph itself.
+        pthread_mutex_lock(&p->decode_head_mutex);
+        if (p->filter_graph) {
+            fg = ALLOCATE(struct FilterGraph, 1);
+            if (fg && filter_graph_set_input(fg, p->filter_graph->sample_rate,
+                        &p->filter_graph->ch_layout, p->filter_graph->sample_fmt,
+                        p->filter_graph->time_base) < 0)
+            {
+                filter_graph_destroy(fg);
+                fg = NULL;
+            }
+        }
+        unsigned sink_map_generation = p->sink_map_generation + 1;
+        pthread_mutex_unlock(&p->decode_head_mutex);
+
+        if (fg) {
+            fg->sink_map_generation = sink_map_generation;
+            if (init_filter_graph(p, fg, edit->sink_map, edit->sink_map_count, true) < 0) {
+                av_log(NULL, AV_LOG_WARNING, "unable to prepare filter graph; "
+                        "the decode thread will build it\n");
+                filter_graph_destroy(fg);
+                fg = NULL;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&p->decode_head_mutex);
+    struct SinkMap *old_map = p->sink_map;
+    struct FilterGraph *old_fg = NULL;
+    if (edit->graph_changed) {
+        old_fg = p->filter_graph;
+        p->filter_graph = NULL;
+        p->sink_map_generation += 1;
+        for (int i = 0; i < FILTER_GRAPH_CACHE_SIZE; i += 1) {
+            if (p->filter_graph_cache[i] != old_fg)
+                continue;
+            p->filter_graph_cache[i] = NULL;
+            if (old_fg) {
+                // the decode thread may have moved on to another format
+                // while we were building; then the new graph is useless.
+                bool adopt = fg && filter_graph_same_input(fg, old_fg);
+                if (adopt)
+                    filter_graph_adopt(fg, old_fg);
+                filter_graph_drain(playlist, old_fg, old_map, edit->sink_map);
+                if (adopt) {
+                    fg->last_used = ++p->filter_graph_clock;
+                    p->filter_graph_cache[i] = fg;
+                    p->filter_graph = fg;
+                    fg = NULL;
+                }
+            }
+            break;
+        }
     }
-    p->rebuild_filter_graph_flag = 1;
-    p->sink_map_count += 1;
+    p->sink_map = edit->sink_map;
+    p->sink_map_count = edit->sink_map_count;
+    pthread_mutex_unlock(&p->decode_head_mutex);
+    pthread_mutex_unlock(&p->sink_map_mutex);
+
+    filter_graph_destroy(old_fg);
+    filter_graph_destroy(fg);
+    sink_map_free(old_map);
     return 0;
 }
 
@@ -1063,25 +2613,55 @@ int groove_sink_detach(struct GrooveSink *sink) {
 
     struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
 
-    if (s->audioq) {
-        groove_queue_abort(s->audioq);
-        groove_queue_flush(s->audioq);
-    }
+    groove_sink_log_abort(&s->reader);
 
     struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
 
-    pthread_mutex_lock(&p->decode_head_mutex);
-    int err = remove_sink_from_map(sink);
-    pthread_mutex_unlock(&p->decode_head_mutex);
+    struct SinkMapEdit edit;
+    int err = sink_map_edit_begin(p, &edit);
+    if (err < 0)
+        return err;
+    if ((err = remove_sink_from_map(&edit, sink)) < 0) {
+        sink_map_edit_abort(p, &edit);
+        return err;
+    }
+    sink_map_edit_commit(p, &edit);
+
+    // the decode thread no longer sees the sink, so nothing more is put in
+    // the log for it
+    groove_sink_log_leave(&s->reader);
+    ring_drop_partial(s);
+    if (s->shm)
+        groove_shm_writer_stop(s->shm);
 
     sink->playlist = NULL;
 
-    return err;
+    return 0;
+}
+
+// Called on the thread of a shared memory sink when the reader in the other
+// process made room.
+static void shm_room(void *arg) {
+    struct GrooveSink *sink = (struct GrooveSink *) arg;
+    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) sink->playlist;
+    pthread_mutex_lock(&p->drain_cond_mutex);
+    pthread_cond_signal(&p->sink_drain_cond);
+    pthread_mutex_unlock(&p->drain_cond_mutex);
 }
 
 int groove_sink_attach(struct GrooveSink *sink, struct GroovePlaylist *playlist) {
     struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
 
+    if (sink->process && s->ring)
+        return GrooveErrorInvalid;
+
+    // inline and ring sinks get their audio on the decode thread, so that
+    // is where it has to be converted
+    if (sink->process || s->ring)
+        sink->flags &= ~GrooveSinkFlagConvertOnGet;
+    // the end of a playlist this sink was attached to before
+    GROOVE_ATOMIC_STORE(s->ring_indexes->end_index, -1);
+
     // cache computed audio format stuff
     s->min_audioq_size = sink->buffer_size_bytes;
     av_log(NULL, AV_LOG_INFO, "audio queue size: %d\n", s->min_audioq_size);
@@ -1092,44 +2672,357 @@ int groove_sink_attach(struct GrooveSink *sink, struct GroovePlaylist *playlist)
     // must do this above add_sink_to_map to avid race condition
     sink->playlist = playlist;
 
-    pthread_mutex_lock(&p->decode_head_mutex);
-    int err = add_sink_to_map(playlist, sink);
-    pthread_mutex_lock(&p->drain_cond_mutex);
-    pthread_cond_signal(&p->sink_drain_cond);
-    pthread_mutex_unlock(&p->drain_cond_mutex);
-    pthread_mutex_unlock(&p->decode_head_mutex);
+    int err;
+    if (s->shm && (err = groove_shm_writer_start(s->shm, shm_room, sink))) {
+        sink->playlist = NULL;
+        return err;
+    }
+
+    // left over from before a detach
+    batch_drop(s);
+    // gain above 1.0 could clip, so it is soft limited
+    groove_gain_set(&s->gain_stage, sink->gain, sink->gain > 1.0, true);
+
+    struct SinkMapEdit edit;
+    err = sink_map_edit_begin(p, &edit);
+    if (err >= 0) {
+        if ((err = add_sink_to_map(&edit, sink)) < 0) {
+            sink_map_edit_abort(p, &edit);
+        } else {
+            // join before the decode thread can see the sink so that no
+            // buffer is missed
+            groove_sink_log_join(sink_map_find_log(edit.sink_map, sink), &s->reader,
+                    sink_takes_shared(sink));
+            sink_map_edit_commit(p, &edit);
+        }
+    }
 
     if (err < 0) {
+        if (s->shm)
+            groove_shm_writer_stop(s->shm);
         sink->playlist = NULL;
         av_log(NULL, AV_LOG_ERROR, "unable to attach device: out of memory\n");
         return err;
     }
 
-    // in case we've called abort on the queue, reset
-    groove_queue_reset(s->audioq);
+    pthread_mutex_lock(&p->drain_cond_mutex);
+    pthread_cond_signal(&p->sink_drain_cond);
+    pthread_mutex_unlock(&p->drain_cond_mutex);
+
+    return 0;
+}
+
+// Feeds a buffer from the queue into the sink's own conversion graph,
+// building the graph if the format changed. Returns 1 if the graph is not
+// needed and `buffer` can be handed out as it is, 0 if it was consumed, or
+// a GrooveError. Called with get_mutex held.
+static int sink_convert_put(struct GrooveSink *sink, struct GrooveBuffer *buffer) {
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) sink->playlist;
+    struct GrooveBufferPrivate *b = (struct GrooveBufferPrivate *) buffer;
+    AVFrame *frame = b->frame;
+    struct FilterGraph *fg = s->convert_graph;
+    int err;
+
+    // a graph in use was ended by sink_convert_end before the format
+    // changed, so only a bypassed one can be left over here.
+    if (fg && (fg->sample_rate != frame->sample_rate || fg->sample_fmt != frame->format ||
+                av_channel_layout_compare(&fg->ch_layout, &frame->ch_layout) != 0 ||
+                av_cmp_q(fg->time_base, frame->time_base) != 0))
+    {
+        filter_graph_destroy(fg);
+        fg = s->convert_graph = NULL;
+    }
+    if (!fg) {
+        if (!p)
+            return GrooveErrorInvalid;
+        fg = ALLOCATE(struct FilterGraph, 1);
+        if (!fg)
+            return GrooveErrorNoMem;
+        if ((err = filter_graph_set_input(fg, frame->sample_rate, &frame->ch_layout,
+                        (enum AVSampleFormat)frame->format, frame->time_base)) < 0 ||
+            (err = init_filter_graph(p, fg, &s->convert_map, 1, false)) < 0)
+        {
+            filter_graph_destroy(fg);
+            return err;
+        }
+        s->convert_graph = fg;
+        s->convert_pos = buffer->pos;
+        s->convert_out_samples = 0;
+    }
+
+    s->convert_item = buffer->item;
+    if (fg->bypass)
+        return 1;
+
+    AVFrame *in_frame = av_frame_clone(frame);
+    if (!in_frame)
+        return GrooveErrorNoMem;
+    err = filter_graph_feed(s->groove, fg, in_frame);
+    av_frame_free(&in_frame);
+    if (err < 0) {
+        av_strerror(err, fg->strbuf, sizeof(fg->strbuf));
+        av_log(NULL, AV_LOG_ERROR, "error feeding the sink filtergraph: %s\n", fg->strbuf);
+        return (err == AVERROR(ENOMEM)) ? GrooveErrorNoMem : GrooveErrorDecoding;
+    }
+    groove_buffer_unref(buffer);
+    return 0;
+}
+
+// Sends the sink's graph EOF if `buffer` does not carry on from what is in
+// it: at the end of the playlist, or when the item or format changes. The
+// resampler and a fixed buffer_sample_count hold samples back, and EOF lets
+// them out, the last block short. Returns true if the graph must be drained
+// before `buffer` goes in. Called with get_mutex held.
+static bool sink_convert_end(struct GrooveSink *sink, struct GrooveBuffer *buffer) {
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    struct FilterGraph *fg = s->convert_graph;
+
+    if (!fg || fg->bypass || fg->eof)
+        return false;
+    if (buffer != end_of_q_sentinel) {
+        AVFrame *frame = ((struct GrooveBufferPrivate *) buffer)->frame;
+        if (buffer->item == s->convert_item && fg->sample_rate == frame->sample_rate &&
+                fg->sample_fmt == frame->format &&
+                av_channel_layout_compare(&fg->ch_layout, &frame->ch_layout) == 0)
+        {
+            return false;
+        }
+    }
+    filter_graph_feed(s->groove, fg, NULL);
+    fg->eof = true;
+    return true;
+}
+
+// Pulls a converted buffer from the sink's graph. Returns 1 if one was
+// ready, 0 if the graph needs more input, or a GrooveError. A graph which
+// was sent EOF is destroyed once it is empty. Called with get_mutex held.
+static int sink_convert_get(struct GrooveSink *sink, struct GrooveBuffer **buffer) {
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    struct FilterGraph *fg = s->convert_graph;
+
+    if (!fg || fg->bypass)
+        return 0;
+
+    AVFrame *frame = groove_frame_alloc(s->groove);
+    if (!frame)
+        return GrooveErrorNoMem;
+    AVFilterContext *abuffersink_ctx = fg->abuffersink_ctxs[0];
+    int err = sink->buffer_sample_count == 0 ?
+        av_buffersink_get_frame(abuffersink_ctx, frame) :
+        av_buffersink_get_samples(abuffersink_ctx, frame, sink->buffer_sample_count);
+    if (err == AVERROR_EOF || err == AVERROR(EAGAIN)) {
+        groove_frame_free(s->groove, &frame);
+        if (fg->eof) {
+            filter_graph_destroy(fg);
+            s->convert_graph = NULL;
+        }
+        return 0;
+    } else if (err < 0) {
+        groove_frame_free(s->groove, &frame);
+        av_log(NULL, AV_LOG_ERROR, "error reading buffer from sink buffersink\n");
+        return GrooveErrorDecoding;
+    }
+    // pts comes through the graph; the resampler keeps it in step with
+    // the output samples.
+    frame->time_base = av_buffersink_get_time_base(abuffersink_ctx);
+    double pos = s->convert_pos + s->convert_out_samples / (double) frame->sample_rate;
+    *buffer = create_frame_buffer(s->groove, frame, s->convert_item, pos);
+    if (!*buffer) {
+        groove_frame_free(s->groove, &frame);
+        return GrooveErrorNoMem;
+    }
+    s->convert_out_samples += frame->nb_samples;
+    groove_buffer_ref(*buffer);
+    return 1;
+}
+
+// Wakes the decode thread if it is waiting for this sink to drain.
+static void sink_drained(struct GrooveSink *sink) {
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) sink->playlist;
+    if (p && groove_sink_log_fill_level(&s->reader) < s->min_audioq_size) {
+        pthread_mutex_lock(&p->drain_cond_mutex);
+        pthread_cond_signal(&p->sink_drain_cond);
+        pthread_mutex_unlock(&p->drain_cond_mutex);
+    }
+}
 
+// A shared reader's buffers are the ones every sink in its entry gets, so
+// its gain is applied to a copy here rather than on the decode thread. If
+// out of memory, `*buffer` is dropped, as the decode thread would, and
+// GrooveErrorNoMem is returned. Called with get_mutex held.
+static int sink_apply_shared_gain(struct GrooveSink *sink, struct GrooveBuffer **buffer) {
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    if (!s->reader.shared || groove_gain_is_identity(&s->gain_stage))
+        return 0;
+    struct GrooveBuffer *gain_buffer = apply_sink_gain(sink->playlist, sink, *buffer);
+    groove_buffer_unref(*buffer);
+    *buffer = gain_buffer;
+    if (!gain_buffer) {
+        av_log(NULL, AV_LOG_ERROR, "unable to apply sink gain: out of memory\n");
+        return GrooveErrorNoMem;
+    }
     return 0;
 }
 
-int groove_sink_buffer_get(struct GrooveSink *sink, struct GrooveBuffer **buffer, int block) {
-    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+// groove_sink_buffer_get for sinks with GrooveSinkFlagConvertOnGet. The
+// queue holds decoded audio as it is; conversion happens here.
+static int sink_buffer_get_converted(struct GrooveSink *sink, struct GrooveBuffer **buffer,
+        int block)
+{
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    int result;
+
+    *buffer = NULL;
+    pthread_mutex_lock(&s->get_mutex);
+    for (;;) {
+        if ((result = sink_convert_get(sink, buffer)) != 0)
+            break;
+
+        // the graph needs more input. don't hold the lock while blocking, so
+        // that flush and purge can get through.
+        struct GrooveBuffer *in_buffer = s->convert_pending;
+        s->convert_pending = NULL;
+        if (!in_buffer) {
+            pthread_mutex_unlock(&s->get_mutex);
+            result = groove_sink_log_get(&s->reader, &in_buffer, block);
+            pthread_mutex_lock(&s->get_mutex);
+            if (result != 1) {
+                result = GROOVE_BUFFER_NO;
+                break;
+            }
+            if (in_buffer != end_of_q_sentinel) {
+                sink_drained(sink);
+                if (sink_apply_shared_gain(sink, &in_buffer) < 0)
+                    continue;
+            }
+        }
+        // what is still in the graph comes out before this
+        if (sink_convert_end(sink, in_buffer)) {
+            s->convert_pending = in_buffer;
+            continue;
+        }
+        if (in_buffer == end_of_q_sentinel) {
+            result = GROOVE_BUFFER_END;
+            break;
+        }
+        if ((result = sink_convert_put(sink, in_buffer)) != 0) {
+            if (result == 1)
+                *buffer = in_buffer;
+            else
+                groove_buffer_unref(in_buffer);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->get_mutex);
+
+    return (result == 1) ? GROOVE_BUFFER_YES : result;
+}
+
+int groove_sink_buffer_get(struct GrooveSink *sink, struct GrooveBuffer **buffer, int block) {
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+
+    // the log of a ring sink holds what the decode thread has yet to write
+    if (s->ring) {
+        *buffer = NULL;
+        return GrooveErrorInvalid;
+    }
+
+    if (sink->flags & GrooveSinkFlagConvertOnGet)
+        return sink_buffer_get_converted(sink, buffer, block);
 
-    if (groove_queue_get(s->audioq, (void**)buffer, block) == 1) {
-        if (*buffer == end_of_q_sentinel) {
+    for (;;) {
+        if (groove_sink_log_get(&s->reader, buffer, block) != 1) {
             *buffer = NULL;
+            return GROOVE_BUFFER_NO;
+        }
+        if (*buffer == end_of_q_sentinel)
             return GROOVE_BUFFER_END;
-        } else {
+        sink_drained(sink);
+        if (!s->reader.shared)
+            return GROOVE_BUFFER_YES;
+
+        pthread_mutex_lock(&s->get_mutex);
+        int err = sink_apply_shared_gain(sink, buffer);
+        pthread_mutex_unlock(&s->get_mutex);
+        if (err >= 0)
             return GROOVE_BUFFER_YES;
+    }
+}
+
+int groove_sink_buffer_get_many(struct GrooveSink *sink, struct GrooveBuffer **buffers,
+        int max, int block)
+{
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+
+    if (max <= 0 || s->ring)
+        return GrooveErrorInvalid;
+
+    // conversion costs far more than the lock, so these take one at a time
+    if (sink->flags & GrooveSinkFlagConvertOnGet) {
+        int count = 0;
+        while (count < max) {
+            int result = sink_buffer_get_converted(sink, &buffers[count],
+                    block && count == 0);
+            if (result < 0 && count == 0)
+                return result;
+            if (result != GROOVE_BUFFER_YES && result != GROOVE_BUFFER_END)
+                break;
+            count += 1;
+            if (result == GROOVE_BUFFER_END)
+                break;
         }
-    } else {
-        *buffer = NULL;
-        return GROOVE_BUFFER_NO;
+        return count;
+    }
+
+    for (;;) {
+        int count = groove_sink_log_get_many(&s->reader, buffers, max, block);
+        if (count <= 0)
+            return 0;
+        sink_drained(sink);
+        if (!s->reader.shared)
+            return count;
+
+        // buffers whose gain could not be applied are dropped
+        int kept = 0;
+        pthread_mutex_lock(&s->get_mutex);
+        for (int i = 0; i < count; i += 1) {
+            if (buffers[i] == end_of_q_sentinel || sink_apply_shared_gain(sink, &buffers[i]) >= 0) {
+                buffers[kept] = buffers[i];
+                kept += 1;
+            }
+        }
+        pthread_mutex_unlock(&s->get_mutex);
+        if (kept > 0 || !block)
+            return kept;
     }
 }
 
 int groove_sink_buffer_peek(struct GrooveSink *sink, int block) {
     struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
-    return groove_queue_peek(s->audioq, block);
+    if (s->ring)
+        return GrooveErrorInvalid;
+    return groove_sink_log_peek(&s->reader, block);
+}
+
+int groove_sink_get_fd(struct GrooveSink *sink) {
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    int err = 0;
+
+    if (s->ring)
+        return GrooveErrorInvalid;
+
+    pthread_mutex_lock(&s->get_mutex);
+    if (!s->reader.notify) {
+        struct GrooveOsNotify *notify;
+        if (!(err = groove_os_notify_create(&notify)))
+            groove_sink_log_set_notify(&s->reader, notify);
+    }
+    int fd = err ? err : groove_os_notify_fd(s->reader.notify);
+    pthread_mutex_unlock(&s->get_mutex);
+
+    return fd;
 }
 
 struct GroovePlaylist * groove_playlist_create(struct Groove *groove) {
@@ -1146,6 +3039,7 @@ struct GroovePlaylist * groove_playlist_create(struct Groove *groove) {
     playlist->gain = 1.0;
     // the other volume multiplied by the playlist item's gain
     p->volume = 1.0;
+    groove_gain_init(&p->volume_gain, 1.0);
 
     // set this flag to true so that a race condition does not send the end of
     // queue sentinel early.
@@ -1167,6 +3061,13 @@ struct GroovePlaylist * groove_playlist_create(struct Groove *groove) {
     }
     p->drain_cond_mutex_inited = 1;
 
+    if (pthread_mutex_init(&p->sink_map_mutex, NULL) != 0) {
+        groove_playlist_destroy(playlist);
+        av_log(NULL, AV_LOG_ERROR, "unable to allocate sink map mutex\n");
+        return NULL;
+    }
+    p->sink_map_mutex_inited = 1;
+
     if (pthread_cond_init(&p->decode_head_cond, NULL) != 0) {
         groove_playlist_destroy(playlist);
         av_log(NULL, AV_LOG_ERROR, "unable to allocate decode head mutex condition\n");
@@ -1196,20 +3097,6 @@ struct GroovePlaylist * groove_playlist_create(struct Groove *groove) {
     }
     p->thread_inited = true;
 
-    p->volume_filter = avfilter_get_by_name("volume");
-    if (!p->volume_filter) {
-        groove_playlist_destroy(playlist);
-        av_log(NULL, AV_LOG_ERROR, "unable to get volume filter\n");
-        return NULL;
-    }
-
-    p->compand_filter = avfilter_get_by_name("compand");
-    if (!p->compand_filter) {
-        groove_playlist_destroy(playlist);
-        av_log(NULL, AV_LOG_ERROR, "unable to get compand filter\n");
-        return NULL;
-    }
-
     p->abuffer_filter = avfilter_get_by_name("abuffer");
     if (!p->abuffer_filter) {
         groove_playlist_destroy(playlist);
@@ -1238,6 +3125,14 @@ struct GroovePlaylist * groove_playlist_create(struct Groove *groove) {
         return NULL;
     }
 
+    // aformat converts with aresample, which libavfilter inserts by itself
+    if (!avfilter_get_by_name("aresample")) {
+        groove_playlist_destroy(playlist);
+        av_log(NULL, AV_LOG_ERROR, "unable to get aresample filter\n");
+        return NULL;
+    }
+    p->soxr_available = probe_soxr();
+
     return playlist;
 }
 
@@ -1262,10 +3157,16 @@ void groove_playlist_destroy(struct GroovePlaylist *playlist) {
 
     pthread_join(p->thread_id, NULL);
 
-    every_sink(playlist, groove_sink_detach, 0);
+    // detaching replaces the map, so it cannot be iterated while doing so
+    while (p->sink_map) {
+        if (groove_sink_detach(p->sink_map->stack_head->sink) < 0)
+            break;
+    }
 
-    avfilter_graph_free(&p->filter_graph);
+    for (int i = 0; i < FILTER_GRAPH_CACHE_SIZE; i += 1)
+        filter_graph_destroy(p->filter_graph_cache[i]);
     av_frame_free(&p->in_frame);
+    groove_gain_deinit(&p->volume_gain);
 
     if (p->decode_head_mutex_inited)
         pthread_mutex_destroy(&p->decode_head_mutex);
@@ -1273,6 +3174,9 @@ void groove_playlist_destroy(struct GroovePlaylist *playlist) {
     if (p->drain_cond_mutex_inited)
         pthread_mutex_destroy(&p->drain_cond_mutex);
 
+    if (p->sink_map_mutex_inited)
+        pthread_mutex_destroy(&p->sink_map_mutex);
+
     if (p->decode_head_cond_inited)
         pthread_cond_destroy(&p->decode_head_cond);
 
@@ -1296,25 +3200,42 @@ void groove_playlist_pause(struct GroovePlaylist *playlist) {
     every_sink(playlist, groove_sink_pause, 0);
 }
 
-void groove_playlist_seek(struct GroovePlaylist *playlist, struct GroovePlaylistItem *item, double seconds) {
-    struct GrooveFile * file = item->file;
-    struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
-
+static int64_t seconds_to_seek_pos(struct GrooveFilePrivate *f, double seconds) {
     int64_t ts = seconds * f->audio_st->time_base.den / f->audio_st->time_base.num;
     if (f->ic->start_time != AV_NOPTS_VALUE)
         ts += f->ic->start_time;
+    return ts;
+}
+
+static double seek_pos_to_seconds(struct GrooveFilePrivate *f, int64_t ts) {
+    if (f->ic->start_time != AV_NOPTS_VALUE)
+        ts -= f->ic->start_time;
+    return ts * av_q2d(f->audio_st->time_base);
+}
 
+void groove_playlist_seek(struct GroovePlaylist *playlist, struct GroovePlaylistItem *item, double seconds) {
+    struct GrooveFile * file = item->file;
+    struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
     struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
 
+    // a file restored from a snapshot must be open to know its time base.
+    // it is opened before taking decode_head_mutex, which the decode thread
+    // needs in the meantime.
+    int64_t ts = 0;
+    if (groove_file_open_lazy(file) == 0)
+        ts = seconds_to_seek_pos(f, seconds);
+
     pthread_mutex_lock(&p->decode_head_mutex);
+
     pthread_mutex_lock(&f->seek_mutex);
 
     f->seek_pos = ts;
+    f->seek_byte_pos = -1;
     f->seek_flush = 1;
 
     pthread_mutex_unlock(&f->seek_mutex);
 
-    p->decode_head = item;
+    set_decode_head(p, item);
     pthread_cond_signal(&p->decode_head_cond);
     pthread_mutex_unlock(&p->decode_head_mutex);
 }
@@ -1338,6 +3259,8 @@ struct GroovePlaylistItem *groove_playlist_insert(struct GroovePlaylist *playlis
     // while we're screwing around with the queue
     pthread_mutex_lock(&p->decode_head_mutex);
 
+    item->id = ++p->last_item_id;
+
     if (next) {
         if (next->prev) {
             item->prev = next->prev;
@@ -1352,10 +3275,11 @@ struct GroovePlaylistItem *groove_playlist_insert(struct GroovePlaylist *playlis
 
         pthread_mutex_lock(&f->seek_mutex);
         f->seek_pos = 0;
+        f->seek_byte_pos = -1;
         f->seek_flush = 0;
         pthread_mutex_unlock(&f->seek_mutex);
 
-        p->decode_head = playlist->head;
+        set_decode_head(p, playlist->head);
         pthread_cond_signal(&p->decode_head_cond);
     } else {
         item->prev = playlist->tail;
@@ -1369,13 +3293,16 @@ struct GroovePlaylistItem *groove_playlist_insert(struct GroovePlaylist *playlis
 
 static int purge_sink(struct GrooveSink *sink) {
     struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
-
-    groove_queue_purge(s->audioq);
-
     struct GroovePlaylist *playlist = sink->playlist;
     struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
     struct GroovePlaylistItem *item = p->purge_item;
 
+    if (s->batch_item == item)
+        batch_drop(s);
+    sink_convert_reset(s, item);
+    if (s->ring_partial && s->ring_partial->item == item)
+        ring_drop_partial(s);
+
     if (sink->purge)
         sink->purge(sink, item);
 
@@ -1389,8 +3316,11 @@ void groove_playlist_remove(struct GroovePlaylist *playlist, struct GroovePlayli
 
     // if it's currently being played, seek to the next item
     if (item == p->decode_head) {
-        p->decode_head = item->next;
+        set_decode_head(p, item->next);
     }
+    // what the filter graph holds back of the item goes with it
+    if (p->filter_graph && p->filter_graph->item == item)
+        filter_graph_reset(p->filter_graph);
 
     if (item->prev) {
         item->prev->next = item->next;
@@ -1406,6 +3336,8 @@ void groove_playlist_remove(struct GroovePlaylist *playlist, struct GroovePlayli
     // in each sink,
     // we must be absolutely sure to purge the audio buffer queue
     // of references to item before freeing it at the bottom of this method
+    for (struct SinkMap *map_item = p->sink_map; map_item; map_item = map_item->next)
+        groove_sink_log_purge(map_item->log, item);
     p->purge_item = item;
     every_sink(playlist, purge_sink, 0);
     p->purge_item = NULL;
@@ -1499,27 +3431,29 @@ struct GrooveSink * groove_sink_create(struct Groove *groove) {
     s->groove = groove;
 
     GROOVE_ATOMIC_STORE(s->buffer_size_bytes_request, -1);
-    GROOVE_ATOMIC_STORE(s->audioq_size, 0);
-    GROOVE_ATOMIC_STORE(s->audioq_contains_end, false);
+    GROOVE_ATOMIC_STORE(s->reader.read_bytes, 0);
+    GROOVE_ATOMIC_STORE(s->reader.private_bytes, 0);
+    GROOVE_ATOMIC_STORE(s->reader.contains_end, false);
+    s->ring_indexes = &s->ring_own_indexes;
+    GROOVE_ATOMIC_STORE(s->ring_indexes->write_index, 0);
+    GROOVE_ATOMIC_STORE(s->ring_indexes->read_index, 0);
+    GROOVE_ATOMIC_STORE(s->ring_indexes->end_index, -1);
 
     struct GrooveSink *sink = &s->externals;
 
     sink->buffer_size_bytes = 64 * 1024;
     sink->gain = 1.0;
+    groove_gain_init(&s->gain_stage, 1.0);
+    groove_sink_set_resample_preset(sink, GrooveResamplePresetDefault);
 
-    s->audioq = groove_queue_create();
-
-    if (!s->audioq) {
+    s->convert_stack.sink = sink;
+    s->convert_map.stack_head = &s->convert_stack;
+    if (pthread_mutex_init(&s->get_mutex, NULL) != 0) {
         groove_sink_destroy(sink);
-        av_log(NULL, AV_LOG_ERROR, "could not create audio buffer: out of memory\n");
+        av_log(NULL, AV_LOG_ERROR, "could not create sink: unable to create mutex\n");
         return NULL;
     }
-
-    s->audioq->context = sink;
-    s->audioq->cleanup = audioq_cleanup;
-    s->audioq->put = audioq_put;
-    s->audioq->get = audioq_get;
-    s->audioq->purge = audioq_purge;
+    s->get_mutex_inited = true;
 
     return sink;
 }
@@ -1530,40 +3464,44 @@ void groove_sink_destroy(struct GrooveSink *sink) {
 
     struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
 
-    if (s->audioq)
-        groove_queue_destroy(s->audioq);
-
+    groove_gain_deinit(&s->gain_stage);
+    groove_os_notify_destroy(s->reader.notify);
+    batch_drop(s);
+    av_buffer_pool_uninit(&s->data_pool);
+    sink_convert_drop_pending(s);
+    filter_graph_destroy(s->convert_graph);
+    groove_shm_writer_destroy(s->shm);
+    if (s->get_mutex_inited)
+        pthread_mutex_destroy(&s->get_mutex);
     DEALLOCATE(s);
 }
 
 int groove_sink_set_gain(struct GrooveSink *sink, double gain) {
-    // we must re-create the sink mapping and the filter graph
-    // if the gain changes
-
     struct GroovePlaylist *playlist = sink->playlist;
     struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
 
+    if (!playlist) {
+        sink->gain = gain;
+        return 0;
+    }
 
+    // gain is applied per sink when buffers are handed out, so this does
+    // not touch the filter graph. the change is ramped to avoid a click.
     pthread_mutex_lock(&p->decode_head_mutex);
+    pthread_mutex_lock(&s->get_mutex);
     sink->gain = gain;
-    int err = remove_sink_from_map(sink);
-    if (err) {
-        pthread_mutex_unlock(&p->decode_head_mutex);
-        return err;
-    }
-    err = add_sink_to_map(playlist, sink);
-    if (err) {
-        pthread_mutex_unlock(&p->decode_head_mutex);
-        return err;
-    }
-    p->rebuild_filter_graph_flag = 1;
+    groove_gain_set(&s->gain_stage, gain, gain > 1.0, false);
+    pthread_mutex_unlock(&s->get_mutex);
     pthread_mutex_unlock(&p->decode_head_mutex);
     return 0;
 }
 
 int groove_sink_get_fill_level(struct GrooveSink *sink) {
     struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
-    return GROOVE_ATOMIC_LOAD(s->audioq_size);
+    if (s->ring)
+        return s->ring_capacity - ring_free_bytes(s);
+    return groove_sink_log_fill_level(&s->reader);
 }
 
 void groove_sink_set_buffer_size_bytes(struct GrooveSink *sink, int buffer_size_bytes) {
@@ -1582,7 +3520,101 @@ void groove_sink_set_buffer_size_bytes(struct GrooveSink *sink, int buffer_size_
 
 int groove_sink_contains_end_of_playlist(struct GrooveSink *sink) {
     struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
-    return GROOVE_ATOMIC_LOAD(s->audioq_contains_end);
+    if (s->ring) {
+        int64_t end_index = GROOVE_ATOMIC_LOAD(s->ring_indexes->end_index);
+        return end_index >= 0 && end_index >= GROOVE_ATOMIC_LOAD(s->ring_indexes->read_index);
+    }
+    return GROOVE_ATOMIC_LOAD(s->reader.contains_end);
+}
+
+static bool ring_params_valid(int capacity, const struct GrooveAudioFormat *audio_format) {
+    if (audio_format->is_planar || capacity <= 0)
+        return false;
+    int bytes_per_frame = soundio_get_bytes_per_frame(audio_format->format,
+            audio_format->layout.channel_count);
+    return bytes_per_frame > 0 && capacity % bytes_per_frame == 0;
+}
+
+// Replaces the ring and the shared memory, if any, of a detached sink.
+static void sink_set_ring(struct GrooveSinkPrivate *s, void *memory, int capacity,
+        struct GrooveRingIndexes *indexes, struct GrooveShmWriter *shm)
+{
+    groove_shm_writer_destroy(s->shm);
+    s->shm = shm;
+    s->ring = (uint8_t *)memory;
+    s->ring_capacity = memory ? capacity : 0;
+    s->ring_indexes = indexes;
+    GROOVE_ATOMIC_STORE(s->ring_indexes->write_index, 0);
+    GROOVE_ATOMIC_STORE(s->ring_indexes->read_index, 0);
+    GROOVE_ATOMIC_STORE(s->ring_indexes->end_index, -1);
+}
+
+int groove_sink_set_ring(struct GrooveSink *sink, void *memory, int capacity,
+        const struct GrooveAudioFormat *audio_format)
+{
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+
+    if (sink->playlist)
+        return GrooveErrorInvalid;
+
+    if (memory) {
+        if (!ring_params_valid(capacity, audio_format))
+            return GrooveErrorInvalid;
+        groove_sink_set_only_format(sink, audio_format);
+    }
+
+    sink_set_ring(s, memory, capacity, &s->ring_own_indexes, NULL);
+    return 0;
+}
+
+int groove_sink_set_shm(struct GrooveSink *sink, const char *name, int capacity,
+        const struct GrooveAudioFormat *audio_format)
+{
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+
+    if (sink->playlist || !ring_params_valid(capacity, audio_format))
+        return GrooveErrorInvalid;
+
+    struct GrooveShmWriter *shm;
+    int err;
+    if ((err = groove_shm_writer_create(name, capacity, audio_format, &shm)))
+        return err;
+
+    groove_sink_set_only_format(sink, audio_format);
+    sink_set_ring(s, groove_shm_writer_data(shm), capacity,
+            groove_shm_writer_indexes(shm), shm);
+    return 0;
+}
+
+int64_t groove_sink_ring_write_index(struct GrooveSink *sink) {
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    return GROOVE_ATOMIC_LOAD(s->ring_indexes->write_index);
+}
+
+int64_t groove_sink_ring_read_index(struct GrooveSink *sink) {
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+    return GROOVE_ATOMIC_LOAD(s->ring_indexes->read_index);
+}
+
+int groove_sink_ring_advance_read_index(struct GrooveSink *sink, int bytes) {
+    struct GrooveSinkPrivate *s = (struct GrooveSinkPrivate *) sink;
+
+    // only the caller moves the read index, so it cannot change under us.
+    // the write index only grows, so the check stays true.
+    int64_t read_index = GROOVE_ATOMIC_LOAD(s->ring_indexes->read_index);
+    int64_t write_index = GROOVE_ATOMIC_LOAD(s->ring_indexes->write_index);
+    if (bytes < 0 || bytes > write_index - read_index)
+        return GrooveErrorInvalid;
+    GROOVE_ATOMIC_STORE(s->ring_indexes->read_index, read_index + bytes);
+
+    // the decode thread may be waiting for room
+    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) sink->playlist;
+    if (p) {
+        pthread_mutex_lock(&p->drain_cond_mutex);
+        pthread_cond_signal(&p->sink_drain_cond);
+        pthread_mutex_unlock(&p->drain_cond_mutex);
+    }
+    return 0;
 }
 
 void groove_sink_set_only_format(struct GrooveSink *sink,
@@ -1604,7 +3636,34 @@ void groove_sink_set_only_format(struct GrooveSink *sink,
     sink->sample_formats = &sink->sample_format_default;
     sink->sample_format_count = 1;
 
-    sink->flags = (audio_format->is_planar ? GrooveSinkFlagPlanarOk : GrooveSinkFlagInterleavedOk);
+    sink->flags = (sink->flags & GrooveSinkFlagConvertOnGet) |
+        (audio_format->is_planar ? GrooveSinkFlagPlanarOk : GrooveSinkFlagInterleavedOk);
+}
+
+void groove_sink_set_resample_preset(struct GrooveSink *sink,
+        enum GrooveResamplePreset preset)
+{
+    sink->resampler = GrooveResamplerSwr;
+    sink->resample_filter_size = 0;
+    sink->resample_cutoff = 0.0;
+    sink->resample_linear_interp = -1;
+    sink->resample_precision = 0;
+
+    switch (preset) {
+        case GrooveResamplePresetDefault:
+            break;
+        case GrooveResamplePresetFastest:
+            sink->resample_filter_size = 8;
+            sink->resample_linear_interp = 0;
+            break;
+        case GrooveResamplePresetBest:
+            // the swr settings apply if soxr is not available
+            sink->resampler = GrooveResamplerSoxr;
+            sink->resample_precision = 28;
+            sink->resample_filter_size = 64;
+            sink->resample_linear_interp = 1;
+            break;
+    }
 }
 
 void groove_playlist_set_fill_mode(struct GroovePlaylist *playlist, enum GrooveFillMode mode) {
@@ -1621,3 +3680,395 @@ void groove_playlist_set_fill_mode(struct GroovePlaylist *playlist, enum GrooveF
     pthread_mutex_unlock(&p->decode_head_mutex);
 }
 
+static const char snapshot_magic[4] = {'G', 'R', 'V', 'S'};
+static const int32_t snapshot_version = 1;
+
+struct SnapshotWriter {
+    uint8_t *data;
+    int size;
+    int capacity;
+    int err;
+};
+
+struct SnapshotReader {
+    const uint8_t *data;
+    int size;
+    int pos;
+    bool err;
+};
+
+static void snapshot_write(struct SnapshotWriter *w, const void *src, int len) {
+    if (w->err)
+        return;
+    if (len > INT_MAX - w->size) {
+        w->err = GrooveErrorNoMem;
+        return;
+    }
+    if (w->size + len > w->capacity) {
+        int new_capacity = groove_max_int(w->capacity < INT_MAX / 2 ? w->capacity * 2 : INT_MAX,
+                w->size + len);
+        uint8_t *new_data = REALLOCATE_NONZERO(uint8_t, w->data, new_capacity);
+        if (!new_data) {
+            w->err = GrooveErrorNoMem;
+            return;
+        }
+        w->data = new_data;
+        w->capacity = new_capacity;
+    }
+    memcpy(w->data + w->size, src, len);
+    w->size += len;
+}
+
+static void snapshot_write_int32(struct SnapshotWriter *w, int32_t x) {
+    snapshot_write(w, &x, sizeof(x));
+}
+
+static void snapshot_write_int64(struct SnapshotWriter *w, int64_t x) {
+    snapshot_write(w, &x, sizeof(x));
+}
+
+static void snapshot_write_double(struct SnapshotWriter *w, double x) {
+    snapshot_write(w, &x, sizeof(x));
+}
+
+// NULL is written as length -1
+static void snapshot_write_str(struct SnapshotWriter *w, const char *str) {
+    if (!str) {
+        snapshot_write_int32(w, -1);
+        return;
+    }
+    size_t len = strlen(str);
+    if (len > INT_MAX) {
+        w->err = GrooveErrorInvalid;
+        return;
+    }
+    snapshot_write_int32(w, (int32_t)len);
+    snapshot_write(w, str, (int)len);
+}
+
+static void snapshot_read(struct SnapshotReader *r, void *dest, int len) {
+    if (r->err || len < 0 || r->size - r->pos < len) {
+        r->err = true;
+        memset(dest, 0, len > 0 ? len : 0);
+        return;
+    }
+    memcpy(dest, r->data + r->pos, len);
+    r->pos += len;
+}
+
+static int32_t snapshot_read_int32(struct SnapshotReader *r) {
+    int32_t x;
+    snapshot_read(r, &x, sizeof(x));
+    return x;
+}
+
+static int64_t snapshot_read_int64(struct SnapshotReader *r) {
+    int64_t x;
+    snapshot_read(r, &x, sizeof(x));
+    return x;
+}
+
+static double snapshot_read_double(struct SnapshotReader *r) {
+    double x;
+    snapshot_read(r, &x, sizeof(x));
+    return x;
+}
+
+// returns NULL for a NULL string or on error. check r->err to tell apart.
+static char *snapshot_read_str(struct SnapshotReader *r) {
+    int32_t len = snapshot_read_int32(r);
+    if (r->err || len == -1)
+        return NULL;
+    if (len < 0 || r->size - r->pos < len) {
+        r->err = true;
+        return NULL;
+    }
+    char *str = ALLOCATE_NONZERO(char, len + 1);
+    if (!str) {
+        r->err = true;
+        return NULL;
+    }
+    memcpy(str, r->data + r->pos, len);
+    str[len] = 0;
+    r->pos += len;
+    return str;
+}
+
+static void snapshot_write_item(struct SnapshotWriter *w, struct GroovePlaylistItem *item) {
+    struct GrooveFile *file = item->file;
+    struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) file;
+
+    // files opened with custom IO cannot be reopened from a path
+    if (!f->path) {
+        w->err = GrooveErrorInvalid;
+        return;
+    }
+
+    snapshot_write_str(w, f->path);
+    snapshot_write_str(w, file->filename);
+    snapshot_write_str(w, groove_file_short_names(file));
+    snapshot_write_double(w, file->override_duration);
+    snapshot_write_double(w, groove_file_duration(file));
+
+    struct GrooveAudioFormat audio_format;
+    groove_file_audio_format(file, &audio_format);
+    snapshot_write_int32(w, audio_format.sample_rate);
+    snapshot_write_int32(w, audio_format.layout.channel_count);
+    for (int i = 0; i < audio_format.layout.channel_count; i += 1)
+        snapshot_write_int32(w, audio_format.layout.channels[i]);
+    snapshot_write_int32(w, audio_format.format);
+    snapshot_write_int32(w, audio_format.is_planar);
+
+    snapshot_write_double(w, item->gain);
+    snapshot_write_double(w, item->peak);
+
+    // the decode thread may open the file meanwhile
+    pthread_mutex_lock(&f->state_mutex);
+    AVDictionary *metadata = f->lazy ? f->lazy_metadata : f->ic->metadata;
+    snapshot_write_int32(w, av_dict_count(metadata));
+    const AVDictionaryEntry *tag = NULL;
+    while ((tag = av_dict_get(metadata, "", tag, AV_DICT_IGNORE_SUFFIX))) {
+        snapshot_write_str(w, tag->key);
+        snapshot_write_str(w, tag->value);
+    }
+    pthread_mutex_unlock(&f->state_mutex);
+}
+
+int groove_playlist_snapshot(struct GroovePlaylist *playlist, uint8_t **out_data, int *out_size) {
+    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
+    struct SnapshotWriter w = {0};
+
+    pthread_mutex_lock(&p->decode_head_mutex);
+
+    int32_t item_count = 0;
+    int32_t current_index = -1;
+    for (struct GroovePlaylistItem *item = playlist->head; item; item = item->next) {
+        if (item == p->decode_head)
+            current_index = item_count;
+        item_count += 1;
+    }
+    // a playlist that has played to the end has items but no decode head.
+    // restoring it must not start over from the first item.
+    int32_t ended = (item_count > 0 && !p->decode_head);
+
+    double current_seconds = 0.0;
+    int64_t current_byte_pos = -1;
+    if (p->decode_head) {
+        struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) p->decode_head->file;
+        if (f->ic) {
+            pthread_mutex_lock(&f->seek_mutex);
+            if (f->seek_pos >= 0) {
+                // the decode thread has not gotten to this seek yet
+                current_seconds = seek_pos_to_seconds(f, f->seek_pos);
+                current_byte_pos = f->seek_byte_pos;
+            } else {
+                current_seconds = f->audio_clock;
+                current_byte_pos = f->clock_byte_pos;
+            }
+            pthread_mutex_unlock(&f->seek_mutex);
+        }
+    }
+
+    snapshot_write(&w, snapshot_magic, sizeof(snapshot_magic));
+    snapshot_write_int32(&w, snapshot_version);
+    snapshot_write_double(&w, playlist->gain);
+    snapshot_write_int32(&w, item_count);
+    snapshot_write_int32(&w, current_index);
+    snapshot_write_int32(&w, ended);
+    snapshot_write_double(&w, current_seconds);
+    snapshot_write_int64(&w, current_byte_pos);
+
+    for (struct GroovePlaylistItem *item = playlist->head; item; item = item->next)
+        snapshot_write_item(&w, item);
+
+    pthread_mutex_unlock(&p->decode_head_mutex);
+
+    if (w.err) {
+        DEALLOCATE(w.data);
+        return w.err;
+    }
+
+    *out_data = w.data;
+    *out_size = w.size;
+    return 0;
+}
+
+void groove_playlist_snapshot_free(uint8_t *data) {
+    DEALLOCATE(data);
+}
+
+static void destroy_restored_items(struct GroovePlaylistItem *head) {
+    while (head) {
+        struct GroovePlaylistItem *next = head->next;
+        groove_file_destroy(head->file);
+        DEALLOCATE(head);
+        head = next;
+    }
+}
+
+static struct GroovePlaylistItem *read_snapshot_item(struct GroovePlaylistPrivate *p,
+        struct SnapshotReader *r, int *err)
+{
+    AVDictionary *metadata = NULL;
+    struct GroovePlaylistItem *item = NULL;
+    struct GrooveFile *file = NULL;
+
+    char *path = snapshot_read_str(r);
+    char *hint = snapshot_read_str(r);
+    char *short_names = snapshot_read_str(r);
+    double override_duration = snapshot_read_double(r);
+    double duration = snapshot_read_double(r);
+
+    struct GrooveAudioFormat audio_format;
+    memset(&audio_format, 0, sizeof(audio_format));
+    audio_format.sample_rate = snapshot_read_int32(r);
+    int32_t channel_count = snapshot_read_int32(r);
+    if (channel_count < 0 || channel_count > SOUNDIO_MAX_CHANNELS)
+        r->err = true;
+    audio_format.layout.channel_count = r->err ? 0 : channel_count;
+    for (int i = 0; i < audio_format.layout.channel_count; i += 1)
+        audio_format.layout.channels[i] = (enum SoundIoChannelId)snapshot_read_int32(r);
+    soundio_channel_layout_detect_builtin(&audio_format.layout);
+    audio_format.format = (enum SoundIoFormat)snapshot_read_int32(r);
+    audio_format.is_planar = snapshot_read_int32(r);
+
+    double gain = snapshot_read_double(r);
+    double peak = snapshot_read_double(r);
+
+    int32_t tag_count = snapshot_read_int32(r);
+    for (int32_t i = 0; !r->err && i < tag_count; i += 1) {
+        char *key = snapshot_read_str(r);
+        char *value = snapshot_read_str(r);
+        if (key && value) {
+            av_dict_set(&metadata, key, value, AV_DICT_DONT_STRDUP_KEY | AV_DICT_DONT_STRDUP_VAL);
+        } else {
+            r->err = true;
+            DEALLOCATE(key);
+            DEALLOCATE(value);
+        }
+    }
+
+    if (r->err || !path || !hint || !short_names) {
+        *err = GrooveErrorInvalid;
+        goto fail;
+    }
+
+    file = groove_file_create(p->groove);
+    item = ALLOCATE(struct GroovePlaylistItem, 1);
+    if (!file || !item) {
+        *err = GrooveErrorNoMem;
+        goto fail;
+    }
+
+    *err = groove_file_init_lazy(file, path, hint, short_names, duration, &audio_format, metadata);
+    metadata = NULL;
+    if (*err)
+        goto fail;
+    file->override_duration = override_duration;
+
+    item->file = file;
+    item->gain = gain;
+    item->peak = peak;
+
+    DEALLOCATE(path);
+    DEALLOCATE(hint);
+    DEALLOCATE(short_names);
+    return item;
+fail:
+    groove_file_destroy(file);
+    DEALLOCATE(item);
+    av_dict_free(&metadata);
+    DEALLOCATE(path);
+    DEALLOCATE(hint);
+    DEALLOCATE(short_names);
+    return NULL;
+}
+
+int groove_playlist_restore(struct GroovePlaylist *playlist, const uint8_t *data, int size) {
+    struct GroovePlaylistPrivate *p = (struct GroovePlaylistPrivate *) playlist;
+    struct SnapshotReader r = {data, size, 0, false};
+
+    if (playlist->head)
+        return GrooveErrorInvalid;
+
+    char magic[sizeof(snapshot_magic)];
+    snapshot_read(&r, magic, sizeof(magic));
+    int32_t version = snapshot_read_int32(&r);
+    if (r.err || memcmp(magic, snapshot_magic, sizeof(magic)) != 0 || version != snapshot_version)
+        return GrooveErrorInvalid;
+
+    double gain = snapshot_read_double(&r);
+    int32_t item_count = snapshot_read_int32(&r);
+    int32_t current_index = snapshot_read_int32(&r);
+    int32_t ended = snapshot_read_int32(&r);
+    double current_seconds = snapshot_read_double(&r);
+    int64_t current_byte_pos = snapshot_read_int64(&r);
+    if (r.err || item_count < 0 || current_index >= item_count)
+        return GrooveErrorInvalid;
+    // every non-empty playlist has either a decode head or has ended
+    if (item_count > 0 && (current_index < 0) != (ended != 0))
+        return GrooveErrorInvalid;
+
+    // build the list on the side; the decode thread sees nothing until it
+    // is complete.
+    struct GroovePlaylistItem *head = NULL;
+    struct GroovePlaylistItem *tail = NULL;
+    struct GroovePlaylistItem *current = NULL;
+    for (int32_t i = 0; i < item_count; i += 1) {
+        int err;
+        struct GroovePlaylistItem *item = read_snapshot_item(p, &r, &err);
+        if (!item) {
+            destroy_restored_items(head);
+            return err;
+        }
+        item->prev = tail;
+        if (tail)
+            tail->next = item;
+        else
+            head = item;
+        tail = item;
+        if (i == current_index)
+            current = item;
+    }
+
+    // only the current item is opened up front. the rest are opened by
+    // the decode thread when it gets to them.
+    int64_t seek_pos = 0;
+    int64_t seek_byte_pos = -1;
+    if (current && groove_file_open_lazy(current->file) == 0) {
+        struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) current->file;
+        seek_pos = seconds_to_seek_pos(f, current_seconds);
+        seek_byte_pos = current_byte_pos;
+    }
+
+    pthread_mutex_lock(&p->decode_head_mutex);
+
+    if (playlist->head) {
+        pthread_mutex_unlock(&p->decode_head_mutex);
+        destroy_restored_items(head);
+        return GrooveErrorInvalid;
+    }
+
+    playlist->head = head;
+    playlist->tail = tail;
+    playlist->gain = gain;
+    for (struct GroovePlaylistItem *item = head; item; item = item->next)
+        item->id = ++p->last_item_id;
+
+    // an ended playlist is restored ended: the decode head stays NULL
+    if (current) {
+        struct GrooveFilePrivate *f = (struct GrooveFilePrivate *) current->file;
+        pthread_mutex_lock(&f->seek_mutex);
+        f->seek_pos = seek_pos;
+        f->seek_byte_pos = seek_byte_pos;
+        f->seek_flush = 0;
+        pthread_mutex_unlock(&f->seek_mutex);
+
+        set_decode_head(p, current);
+        pthread_cond_signal(&p->decode_head_cond);
+    }
+
+    pthread_mutex_unlock(&p->decode_head_mutex);
+
+    return 0;
+}
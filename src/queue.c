@@ -7,35 +7,67 @@
 
 #include "queue.h"
 #include "util.h"
+#include "os.h"
 
 #include <pthread.h>
 
-struct ItemList {
-    void *obj;
-    struct ItemList *next;
-};
+// the ring starts with room for this many items and doubles when full
+#define INITIAL_CAPACITY 16
 
 struct GrooveQueuePrivate {
     struct GrooveQueue externals;
-    struct ItemList *first;
-    struct ItemList *last;
+    // ring of queued items, oldest at items[head]. capacity is a power of
+    // two, and the ring only grows, so that put and get do not allocate
+    // once the queue has seen its usual depth.
+    void **items;
+    int capacity;
+    int head;
+    int count;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
+    // threads blocked in get or peek. put only signals if this is not 0.
+    int waiter_count;
     int abort_request;
+    // readable while there are items or the queue is aborted. created by
+    // groove_queue_get_fd.
+    struct GrooveOsNotify *notify;
 };
 
+// Called with the mutex held after the queue changed.
+static void update_notify(struct GrooveQueuePrivate *q) {
+    if (!q->notify)
+        return;
+    if (q->count > 0 || q->abort_request)
+        groove_os_notify_set(q->notify);
+    else
+        groove_os_notify_clear(q->notify);
+}
+
+static void *item_at(struct GrooveQueuePrivate *q, int index) {
+    return q->items[(q->head + index) & (q->capacity - 1)];
+}
+
 struct GrooveQueue *groove_queue_create(void) {
     struct GrooveQueuePrivate *q = ALLOCATE(struct GrooveQueuePrivate, 1);
     if (!q)
         return NULL;
 
+    q->items = ALLOCATE_NONZERO(void *, INITIAL_CAPACITY);
+    if (!q->items) {
+        DEALLOCATE(q);
+        return NULL;
+    }
+    q->capacity = INITIAL_CAPACITY;
+
     if (pthread_mutex_init(&q->mutex, NULL) != 0) {
+        DEALLOCATE(q->items);
         DEALLOCATE(q);
         return NULL;
     }
     if (pthread_cond_init(&q->cond, NULL) != 0) {
-        DEALLOCATE(q);
         pthread_mutex_destroy(&q->mutex);
+        DEALLOCATE(q->items);
+        DEALLOCATE(q);
         return NULL;
     }
     struct GrooveQueue *queue = &q->externals;
@@ -48,16 +80,13 @@ void groove_queue_flush(struct GrooveQueue *queue) {
 
     pthread_mutex_lock(&q->mutex);
 
-    struct ItemList *el;
-    struct ItemList *el1;
-    for (el = q->first; el != NULL; el = el1) {
-        el1 = el->next;
-        if (queue->cleanup)
-            queue->cleanup(queue, el->obj);
-        DEALLOCATE(el);
+    if (queue->cleanup) {
+        for (int i = 0; i < q->count; i += 1)
+            queue->cleanup(queue, item_at(q, i));
     }
-    q->first = NULL;
-    q->last = NULL;
+    q->head = 0;
+    q->count = 0;
+    update_notify(q);
 
     pthread_mutex_unlock(&q->mutex);
 }
@@ -67,6 +96,8 @@ void groove_queue_destroy(struct GrooveQueue *queue) {
     struct GrooveQueuePrivate *q = (struct GrooveQueuePrivate *) queue;
     pthread_mutex_destroy(&q->mutex);
     pthread_cond_destroy(&q->cond);
+    groove_os_notify_destroy(q->notify);
+    DEALLOCATE(q->items);
     DEALLOCATE(q);
 }
 
@@ -76,8 +107,9 @@ void groove_queue_abort(struct GrooveQueue *queue) {
     pthread_mutex_lock(&q->mutex);
 
     q->abort_request = 1;
+    update_notify(q);
 
-    pthread_cond_signal(&q->cond);
+    pthread_cond_broadcast(&q->cond);
     pthread_mutex_unlock(&q->mutex);
 }
 
@@ -87,31 +119,46 @@ void groove_queue_reset(struct GrooveQueue *queue) {
     pthread_mutex_lock(&q->mutex);
 
     q->abort_request = 0;
+    update_notify(q);
 
     pthread_mutex_unlock(&q->mutex);
 }
 
-int groove_queue_put(struct GrooveQueue *queue, void *obj) {
-    struct ItemList * el1 = ALLOCATE(struct ItemList, 1);
-
-    if (!el1)
+// Doubles the ring, moving the items so that they start at index 0.
+static int grow(struct GrooveQueuePrivate *q) {
+    int new_capacity = q->capacity * 2;
+    void **new_items = ALLOCATE_NONZERO(void *, new_capacity);
+    if (!new_items)
         return GrooveErrorNoMem;
+    for (int i = 0; i < q->count; i += 1)
+        new_items[i] = item_at(q, i);
+    DEALLOCATE(q->items);
+    q->items = new_items;
+    q->capacity = new_capacity;
+    q->head = 0;
+    return 0;
+}
 
-    el1->obj = obj;
-
+int groove_queue_put(struct GrooveQueue *queue, void *obj) {
     struct GrooveQueuePrivate *q = (struct GrooveQueuePrivate *) queue;
     pthread_mutex_lock(&q->mutex);
 
-    if (!q->last)
-        q->first = el1;
-    else
-        q->last->next = el1;
-    q->last = el1;
+    if (q->count == q->capacity) {
+        int err = grow(q);
+        if (err) {
+            pthread_mutex_unlock(&q->mutex);
+            return err;
+        }
+    }
+    q->items[(q->head + q->count) & (q->capacity - 1)] = obj;
+    q->count += 1;
 
     if (queue->put)
         queue->put(queue, obj);
+    update_notify(q);
 
-    pthread_cond_signal(&q->cond);
+    if (q->waiter_count > 0)
+        pthread_cond_signal(&q->cond);
     pthread_mutex_unlock(&q->mutex);
 
     return 0;
@@ -129,14 +176,16 @@ int groove_queue_peek(struct GrooveQueue *queue, int block) {
             break;
         }
 
-        if (q->first) {
+        if (q->count > 0) {
             ret = 1;
             break;
         } else if (!block) {
             ret = 0;
             break;
         } else {
+            q->waiter_count += 1;
             pthread_cond_wait(&q->cond, &q->mutex);
+            q->waiter_count -= 1;
         }
     }
 
@@ -145,7 +194,6 @@ int groove_queue_peek(struct GrooveQueue *queue, int block) {
 }
 
 int groove_queue_get(struct GrooveQueue *queue, void **obj_ptr, int block) {
-    struct ItemList *ev1;
     int ret;
 
     struct GrooveQueuePrivate *q = (struct GrooveQueuePrivate *) queue;
@@ -157,24 +205,25 @@ int groove_queue_get(struct GrooveQueue *queue, void **obj_ptr, int block) {
             break;
         }
 
-        ev1 = q->first;
-        if (ev1) {
-            q->first = ev1->next;
-            if (!q->first)
-                q->last = NULL;
+        if (q->count > 0) {
+            void *obj = q->items[q->head];
+            q->head = (q->head + 1) & (q->capacity - 1);
+            q->count -= 1;
 
             if (queue->get)
-                queue->get(queue, ev1->obj);
+                queue->get(queue, obj);
+            update_notify(q);
 
-            *obj_ptr = ev1->obj;
-            DEALLOCATE(ev1);
+            *obj_ptr = obj;
             ret = 1;
             break;
         } else if(!block) {
             ret = 0;
             break;
         } else {
+            q->waiter_count += 1;
             pthread_cond_wait(&q->cond, &q->mutex);
+            q->waiter_count -= 1;
         }
     }
 
@@ -186,34 +235,37 @@ void groove_queue_purge(struct GrooveQueue *queue) {
     struct GrooveQueuePrivate *q = (struct GrooveQueuePrivate *) queue;
 
     pthread_mutex_lock(&q->mutex);
-    struct ItemList *node = q->first;
-    struct ItemList *prev = NULL;
-    while (node) {
-        if (queue->purge(queue, node->obj)) {
-            if (prev) {
-                prev->next = node->next;
-                if (queue->cleanup)
-                    queue->cleanup(queue, node->obj);
-                DEALLOCATE(node);
-                node = prev->next;
-                if (!node)
-                    q->last = prev;
-            } else {
-                struct ItemList *next = node->next;
-                if (queue->cleanup)
-                    queue->cleanup(queue, node->obj);
-                DEALLOCATE(node);
-                q->first = next;
-                node = next;
-                if (!node)
-                    q->last = NULL;
-            }
+    // slide the items which stay towards the head, keeping their order
+    int kept = 0;
+    for (int i = 0; i < q->count; i += 1) {
+        void *obj = item_at(q, i);
+        if (queue->purge(queue, obj)) {
+            if (queue->cleanup)
+                queue->cleanup(queue, obj);
         } else {
-            prev = node;
-            node = node->next;
+            q->items[(q->head + kept) & (q->capacity - 1)] = obj;
+            kept += 1;
         }
     }
+    q->count = kept;
+    update_notify(q);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+int groove_queue_get_fd(struct GrooveQueue *queue) {
+    struct GrooveQueuePrivate *q = (struct GrooveQueuePrivate *) queue;
+    int err = 0;
+
+    pthread_mutex_lock(&q->mutex);
+    if (!q->notify) {
+        err = groove_os_notify_create(&q->notify);
+        if (!err)
+            update_notify(q);
+    }
+    int fd = err ? err : groove_os_notify_fd(q->notify);
     pthread_mutex_unlock(&q->mutex);
+
+    return fd;
 }
 
 void groove_queue_cleanup_default(struct GrooveQueue *queue, void *obj) {
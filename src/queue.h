@@ -35,6 +35,10 @@ int groove_queue_peek(struct GrooveQueue *queue, int block);
 
 void groove_queue_purge(struct GrooveQueue *queue);
 
+// returns a file descriptor which is readable while get would not block,
+// or a GrooveError.
+int groove_queue_get_fd(struct GrooveQueue *queue);
+
 void groove_queue_cleanup_default(struct GrooveQueue *queue, void *obj);
 
 #endif
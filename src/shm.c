@@ -0,0 +1,554 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of libgroove, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#include "shm_private.h"
+#include "groove/shm.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_MAGIC 0x4d485347 // "GSHM"
+#define SHM_VERSION 1
+// how many changes of item or position a reader can be behind by and still
+// know where its audio came from
+#define SHM_MARK_COUNT 64
+#define SHM_DATA_ALIGN 64
+
+// The audio from `index` on is `pos_frame` frames into item `item_id`.
+struct ShmMark {
+    struct GrooveAtomicLongLong index;
+    struct GrooveAtomicLongLong item_id;
+    struct GrooveAtomicLongLong pos_frame;
+};
+
+// The start of the shared memory. The ring follows at data_offset. Apart
+// from the pthread objects only fixed size types, since the reader may be a
+// different program.
+struct ShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    int32_t data_offset;
+    int32_t capacity;
+
+    int32_t sample_rate;
+    int32_t format;
+    int32_t channel_count;
+    int32_t channels[SOUNDIO_MAX_CHANNELS];
+    int32_t bytes_per_frame;
+
+    // process shared. the reader waits on data_cond and the writer's room
+    // thread on room_cond. whoever moves an index only takes the mutex to
+    // signal when the other side said it is waiting.
+    pthread_mutex_t mutex;
+    pthread_cond_t data_cond;
+    pthread_cond_t room_cond;
+    struct GrooveAtomicInt reader_waiting;
+    struct GrooveAtomicInt writer_waiting;
+    struct GrooveAtomicBool closed;
+
+    struct GrooveRingIndexes indexes;
+    // write index at the most recent flush, stored before flush_generation
+    // goes up
+    struct GrooveAtomicLongLong flush_index;
+    struct GrooveAtomicInt flush_generation;
+
+    // marks written so far. mark n is in marks[n % SHM_MARK_COUNT].
+    struct GrooveAtomicLongLong mark_count;
+    struct ShmMark marks[SHM_MARK_COUNT];
+};
+
+struct GrooveShmWriter {
+    char *name;
+    struct ShmHeader *header;
+    size_t size;
+
+    pthread_t room_thread;
+    bool room_thread_running;
+    // protected by the header's mutex
+    bool quit;
+    void (*room)(void *arg);
+    void *room_arg;
+
+    // a copy of the newest mark
+    bool have_mark;
+    uint64_t mark_item_id;
+    int64_t mark_index;
+    int64_t mark_pos_frame;
+    int64_t mark_count;
+    // how far in frames the position may drift before it is marked again.
+    // filters make the clock a little uneven.
+    int64_t mark_tolerance;
+};
+
+struct GrooveShmReader {
+    struct ShmHeader *header;
+    size_t size;
+    unsigned char *data;
+    int flush_generation;
+    int64_t end_reported;
+};
+
+static int shm_data_offset(void) {
+    return (sizeof(struct ShmHeader) + SHM_DATA_ALIGN - 1) / SHM_DATA_ALIGN * SHM_DATA_ALIGN;
+}
+
+static void shm_lock(struct ShmHeader *h) {
+    int err = pthread_mutex_lock(&h->mutex);
+#if defined(__linux__)
+    // the other process died holding it
+    if (err == EOWNERDEAD)
+        pthread_mutex_consistent(&h->mutex);
+#else
+    (void)err;
+#endif
+}
+
+static void shm_unlock(struct ShmHeader *h) {
+    pthread_mutex_unlock(&h->mutex);
+}
+
+static int errno_to_groove_error(int err) {
+    switch (err) {
+        case ENOMEM:
+            return GrooveErrorNoMem;
+        case EACCES:
+        case EPERM:
+            return GrooveErrorPermissions;
+        case ENOENT:
+            return GrooveErrorFileNotFound;
+        case EEXIST:
+            return GrooveErrorFileSystem;
+        case EINVAL:
+        case ENAMETOOLONG:
+            return GrooveErrorInvalid;
+        default:
+            return GrooveErrorSystemResources;
+    }
+}
+
+static int init_sync(struct ShmHeader *h) {
+    pthread_mutexattr_t mutex_attr;
+    pthread_condattr_t cond_attr;
+    if (pthread_mutexattr_init(&mutex_attr))
+        return GrooveErrorSystemResources;
+    if (pthread_condattr_init(&cond_attr)) {
+        pthread_mutexattr_destroy(&mutex_attr);
+        return GrooveErrorSystemResources;
+    }
+    int err = pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED) ||
+        pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+#if defined(__linux__)
+    err = err || pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+#endif
+    if (!err && pthread_mutex_init(&h->mutex, &mutex_attr))
+        err = 1;
+    if (!err && pthread_cond_init(&h->data_cond, &cond_attr)) {
+        pthread_mutex_destroy(&h->mutex);
+        err = 1;
+    }
+    if (!err && pthread_cond_init(&h->room_cond, &cond_attr)) {
+        pthread_cond_destroy(&h->data_cond);
+        pthread_mutex_destroy(&h->mutex);
+        err = 1;
+    }
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    return err ? GrooveErrorSystemResources : 0;
+}
+
+int groove_shm_writer_create(const char *name, int capacity,
+        const struct GrooveAudioFormat *audio_format, struct GrooveShmWriter **out_writer)
+{
+    *out_writer = NULL;
+
+    struct GrooveShmWriter *w = ALLOCATE(struct GrooveShmWriter, 1);
+    if (!w)
+        return GrooveErrorNoMem;
+    w->name = av_strdup(name);
+    if (!w->name) {
+        DEALLOCATE(w);
+        return GrooveErrorNoMem;
+    }
+
+    int data_offset = shm_data_offset();
+    w->size = (size_t)data_offset + capacity;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        int err = errno_to_groove_error(errno);
+        av_log(NULL, AV_LOG_ERROR, "unable to create shared memory %s\n", name);
+        DEALLOCATE(w->name);
+        DEALLOCATE(w);
+        return err;
+    }
+    void *addr = MAP_FAILED;
+    int err = 0;
+    if (ftruncate(fd, w->size) < 0)
+        err = errno_to_groove_error(errno);
+    else if ((addr = mmap(NULL, w->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        err = errno_to_groove_error(errno);
+    close(fd);
+
+    if (!err) {
+        w->header = (struct ShmHeader *)addr;
+        // the other process cannot take part in a lock inside the atomics
+        if (!atomic_is_lock_free(&w->header->indexes.write_index.x))
+            err = GrooveErrorSystemResources;
+        else
+            err = init_sync(w->header);
+    }
+    if (err) {
+        if (addr != MAP_FAILED)
+            munmap(addr, w->size);
+        shm_unlink(name);
+        DEALLOCATE(w->name);
+        DEALLOCATE(w);
+        return err;
+    }
+
+    // ftruncate zeroed the rest
+    struct ShmHeader *h = w->header;
+    h->version = SHM_VERSION;
+    h->data_offset = data_offset;
+    h->capacity = capacity;
+    h->sample_rate = audio_format->sample_rate;
+    h->format = audio_format->format;
+    h->channel_count = audio_format->layout.channel_count;
+    for (int i = 0; i < audio_format->layout.channel_count; i += 1)
+        h->channels[i] = audio_format->layout.channels[i];
+    h->bytes_per_frame = soundio_get_bytes_per_frame(audio_format->format,
+            audio_format->layout.channel_count);
+    GROOVE_ATOMIC_STORE(h->indexes.write_index, 0);
+    GROOVE_ATOMIC_STORE(h->indexes.read_index, 0);
+    GROOVE_ATOMIC_STORE(h->indexes.end_index, -1);
+    GROOVE_ATOMIC_STORE(h->flush_index, 0);
+    // a reader may open it as soon as the name exists; the magic says that
+    // it is ready
+    atomic_thread_fence(memory_order_release);
+    h->magic = SHM_MAGIC;
+
+    w->mark_tolerance = audio_format->sample_rate / 20;
+
+    *out_writer = w;
+    return 0;
+}
+
+void groove_shm_writer_destroy(struct GrooveShmWriter *w) {
+    if (!w)
+        return;
+
+    groove_shm_writer_stop(w);
+
+    struct ShmHeader *h = w->header;
+    shm_lock(h);
+    GROOVE_ATOMIC_STORE(h->closed, true);
+    pthread_cond_broadcast(&h->data_cond);
+    shm_unlock(h);
+
+    // the reader may still be using the mutex and conditions, so they are
+    // not destroyed
+    munmap(h, w->size);
+    shm_unlink(w->name);
+    DEALLOCATE(w->name);
+    DEALLOCATE(w);
+}
+
+unsigned char *groove_shm_writer_data(struct GrooveShmWriter *w) {
+    return (unsigned char *)w->header + w->header->data_offset;
+}
+
+struct GrooveRingIndexes *groove_shm_writer_indexes(struct GrooveShmWriter *w) {
+    return &w->header->indexes;
+}
+
+static void *room_thread(void *arg) {
+    struct GrooveShmWriter *w = (struct GrooveShmWriter *)arg;
+    struct ShmHeader *h = w->header;
+    int64_t seen = GROOVE_ATOMIC_LOAD(h->indexes.read_index);
+
+    shm_lock(h);
+    while (!w->quit) {
+        // say so before looking, so that the reader either sees this or
+        // moved the index before we look
+        GROOVE_ATOMIC_STORE(h->writer_waiting, 1);
+        int64_t read_index = GROOVE_ATOMIC_LOAD(h->indexes.read_index);
+        if (read_index == seen) {
+            pthread_cond_wait(&h->room_cond, &h->mutex);
+            continue;
+        }
+        GROOVE_ATOMIC_STORE(h->writer_waiting, 0);
+        seen = read_index;
+
+        shm_unlock(h);
+        w->room(w->room_arg);
+        shm_lock(h);
+    }
+    shm_unlock(h);
+    return NULL;
+}
+
+int groove_shm_writer_start(struct GrooveShmWriter *w, void (*room)(void *arg), void *arg) {
+    w->room = room;
+    w->room_arg = arg;
+    w->quit = false;
+    if (pthread_create(&w->room_thread, NULL, room_thread, w)) {
+        av_log(NULL, AV_LOG_ERROR, "unable to create shared memory thread\n");
+        return GrooveErrorSystemResources;
+    }
+    w->room_thread_running = true;
+    return 0;
+}
+
+void groove_shm_writer_stop(struct GrooveShmWriter *w) {
+    if (!w->room_thread_running)
+        return;
+
+    struct ShmHeader *h = w->header;
+    shm_lock(h);
+    w->quit = true;
+    pthread_cond_broadcast(&h->room_cond);
+    shm_unlock(h);
+
+    pthread_join(w->room_thread, NULL);
+    w->room_thread_running = false;
+}
+
+void groove_shm_writer_notify(struct GrooveShmWriter *w) {
+    struct ShmHeader *h = w->header;
+    if (!GROOVE_ATOMIC_LOAD(h->reader_waiting))
+        return;
+    shm_lock(h);
+    GROOVE_ATOMIC_STORE(h->reader_waiting, 0);
+    pthread_cond_signal(&h->data_cond);
+    shm_unlock(h);
+}
+
+void groove_shm_writer_mark(struct GrooveShmWriter *w, struct GroovePlaylistItem *item,
+        double pos)
+{
+    struct ShmHeader *h = w->header;
+    int64_t write_index = GROOVE_ATOMIC_LOAD(h->indexes.write_index);
+    int64_t pos_frame = (int64_t)(pos * h->sample_rate + 0.5);
+    uint64_t item_id = item ? item->id : 0;
+
+    if (w->have_mark && item_id == w->mark_item_id) {
+        int64_t expected = w->mark_pos_frame + (write_index - w->mark_index) / h->bytes_per_frame;
+        int64_t drift = pos_frame - expected;
+        if (drift <= w->mark_tolerance && drift >= -w->mark_tolerance)
+            return;
+    }
+
+    struct ShmMark *mark = &h->marks[w->mark_count % SHM_MARK_COUNT];
+    GROOVE_ATOMIC_STORE(mark->index, write_index);
+    GROOVE_ATOMIC_STORE(mark->item_id, (long long)item_id);
+    GROOVE_ATOMIC_STORE(mark->pos_frame, pos_frame);
+    w->mark_count += 1;
+    GROOVE_ATOMIC_STORE(h->mark_count, w->mark_count);
+
+    w->have_mark = true;
+    w->mark_item_id = item_id;
+    w->mark_index = write_index;
+    w->mark_pos_frame = pos_frame;
+}
+
+void groove_shm_writer_flush(struct GrooveShmWriter *w) {
+    struct ShmHeader *h = w->header;
+    GROOVE_ATOMIC_STORE(h->flush_index, GROOVE_ATOMIC_LOAD(h->indexes.write_index));
+    GROOVE_ATOMIC_FETCH_ADD(h->flush_generation, 1);
+    // whatever comes next starts somewhere new
+    w->have_mark = false;
+    groove_shm_writer_notify(w);
+}
+
+int groove_shm_reader_open(const char *name, struct GrooveShmReader **out_reader) {
+    *out_reader = NULL;
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return errno_to_groove_error(errno);
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int err = errno_to_groove_error(errno);
+        close(fd);
+        return err;
+    }
+    if ((size_t)st.st_size < sizeof(struct ShmHeader)) {
+        close(fd);
+        return GrooveErrorInvalid;
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+    if (addr == MAP_FAILED)
+        return errno_to_groove_error(err);
+
+    struct ShmHeader *h = (struct ShmHeader *)addr;
+    bool ok = h->magic == SHM_MAGIC;
+    atomic_thread_fence(memory_order_acquire);
+    ok = ok && h->version == SHM_VERSION && h->capacity > 0 && h->bytes_per_frame > 0 &&
+        (size_t)h->data_offset + h->capacity <= (size_t)st.st_size;
+    if (!ok) {
+        munmap(addr, st.st_size);
+        return GrooveErrorInvalid;
+    }
+
+    struct GrooveShmReader *r = ALLOCATE(struct GrooveShmReader, 1);
+    if (!r) {
+        munmap(addr, st.st_size);
+        return GrooveErrorNoMem;
+    }
+    r->header = h;
+    r->size = st.st_size;
+    r->data = (unsigned char *)addr + h->data_offset;
+    r->flush_generation = GROOVE_ATOMIC_LOAD(h->flush_generation);
+    r->end_reported = -1;
+
+    *out_reader = r;
+    return 0;
+}
+
+void groove_shm_reader_close(struct GrooveShmReader *r) {
+    if (!r)
+        return;
+    munmap(r->header, r->size);
+    DEALLOCATE(r);
+}
+
+void groove_shm_reader_audio_format(struct GrooveShmReader *r,
+        struct GrooveAudioFormat *audio_format)
+{
+    struct ShmHeader *h = r->header;
+    memset(audio_format, 0, sizeof(struct GrooveAudioFormat));
+    audio_format->sample_rate = h->sample_rate;
+    audio_format->format = (enum SoundIoFormat)h->format;
+    audio_format->is_planar = false;
+    audio_format->layout.channel_count = h->channel_count;
+    for (int i = 0; i < h->channel_count; i += 1)
+        audio_format->layout.channels[i] = (enum SoundIoChannelId)h->channels[i];
+    soundio_channel_layout_detect_builtin(&audio_format->layout);
+}
+
+// Finds the newest mark at or before `index`. Marks are rewritten in a
+// circle, so one which changed while we looked at it is not used.
+static void find_mark(struct ShmHeader *h, int64_t index, struct GrooveShmRegion *region) {
+    region->item_id = 0;
+    region->pos = -1.0;
+
+    int64_t count = GROOVE_ATOMIC_LOAD(h->mark_count);
+    for (int64_t n = count - 1; n >= 0 && n > count - SHM_MARK_COUNT; n -= 1) {
+        struct ShmMark *mark = &h->marks[n % SHM_MARK_COUNT];
+        int64_t mark_index = GROOVE_ATOMIC_LOAD(mark->index);
+        int64_t item_id = GROOVE_ATOMIC_LOAD(mark->item_id);
+        int64_t pos_frame = GROOVE_ATOMIC_LOAD(mark->pos_frame);
+        if (n <= GROOVE_ATOMIC_LOAD(h->mark_count) - SHM_MARK_COUNT)
+            return;
+        if (mark_index <= index) {
+            region->item_id = (uint64_t)item_id;
+            pos_frame += (index - mark_index) / h->bytes_per_frame;
+            region->pos = pos_frame / (double)h->sample_rate;
+            return;
+        }
+    }
+}
+
+// Lets the writer's room thread know the read index moved.
+static void wake_writer(struct ShmHeader *h, bool locked) {
+    if (!GROOVE_ATOMIC_LOAD(h->writer_waiting))
+        return;
+    if (!locked)
+        shm_lock(h);
+    GROOVE_ATOMIC_STORE(h->writer_waiting, 0);
+    pthread_cond_signal(&h->room_cond);
+    if (!locked)
+        shm_unlock(h);
+}
+
+static int reader_poll(struct GrooveShmReader *r, struct GrooveShmRegion *region,
+        bool locked)
+{
+    struct ShmHeader *h = r->header;
+
+    // skip what was in the ring before the flush. the writer may be waiting
+    // for that room.
+    int flush_generation = GROOVE_ATOMIC_LOAD(h->flush_generation);
+    if (flush_generation != r->flush_generation) {
+        r->flush_generation = flush_generation;
+        r->end_reported = -1;
+        int64_t flush_index = GROOVE_ATOMIC_LOAD(h->flush_index);
+        if (GROOVE_ATOMIC_LOAD(h->indexes.read_index) < flush_index) {
+            GROOVE_ATOMIC_STORE(h->indexes.read_index, flush_index);
+            wake_writer(h, locked);
+        }
+    }
+
+    int64_t read_index = GROOVE_ATOMIC_LOAD(h->indexes.read_index);
+    int64_t write_index = GROOVE_ATOMIC_LOAD(h->indexes.write_index);
+    int64_t end_index = GROOVE_ATOMIC_LOAD(h->indexes.end_index);
+
+    bool end_pending = end_index >= read_index && end_index != r->end_reported;
+    if (end_pending && end_index == read_index) {
+        r->end_reported = end_index;
+        return GROOVE_BUFFER_END;
+    }
+    if (write_index == read_index)
+        return GROOVE_BUFFER_NO;
+
+    int offset = (int)(read_index % h->capacity);
+    int64_t size = write_index - read_index;
+    if (end_pending && end_index < write_index)
+        size = end_index - read_index;
+    region->data = r->data + offset;
+    region->size = groove_min_int((int)size, h->capacity - offset);
+    region->flush_generation = flush_generation;
+    find_mark(h, read_index, region);
+    return GROOVE_BUFFER_YES;
+}
+
+int groove_shm_reader_get(struct GrooveShmReader *r, struct GrooveShmRegion *region, int block) {
+    struct ShmHeader *h = r->header;
+    int result;
+    if ((result = reader_poll(r, region, false)) != GROOVE_BUFFER_NO || !block)
+        return result;
+
+    shm_lock(h);
+    for (;;) {
+        // say so before looking, so that the writer either sees this or
+        // moved the index before we look
+        GROOVE_ATOMIC_STORE(h->reader_waiting, 1);
+        if ((result = reader_poll(r, region, true)) != GROOVE_BUFFER_NO ||
+            GROOVE_ATOMIC_LOAD(h->closed))
+        {
+            break;
+        }
+        pthread_cond_wait(&h->data_cond, &h->mutex);
+    }
+    GROOVE_ATOMIC_STORE(h->reader_waiting, 0);
+    shm_unlock(h);
+    return result;
+}
+
+int groove_shm_reader_advance(struct GrooveShmReader *r, int bytes) {
+    struct ShmHeader *h = r->header;
+    // as with groove_sink_ring_advance_read_index, only we move the read index
+    int64_t read_index = GROOVE_ATOMIC_LOAD(h->indexes.read_index);
+    int64_t write_index = GROOVE_ATOMIC_LOAD(h->indexes.write_index);
+    if (bytes < 0 || bytes > write_index - read_index)
+        return GrooveErrorInvalid;
+    GROOVE_ATOMIC_STORE(h->indexes.read_index, read_index + bytes);
+    wake_writer(h, false);
+    return 0;
+}
+
+int groove_shm_reader_closed(struct GrooveShmReader *r) {
+    return GROOVE_ATOMIC_LOAD(r->header->closed);
+}
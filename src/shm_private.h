@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of libgroove, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#ifndef GROOVE_SHM_PRIVATE_H
+#define GROOVE_SHM_PRIVATE_H
+
+#include "groove_internal.h"
+#include "atomics.h"
+#include "config.h"
+
+#include <stddef.h>
+
+// Where a ring sink is up to, in bytes since the ring was set. For a shared
+// memory sink these live in the shared memory, so the reader may be another
+// process.
+struct GrooveRingIndexes {
+    // only the decode thread moves the write index and only the reader moves
+    // the read index
+    struct GrooveAtomicLongLong write_index;
+    struct GrooveAtomicLongLong read_index;
+    // write index at the end of the playlist, or -1
+    struct GrooveAtomicLongLong end_index;
+};
+
+// The writing side of a shared memory object made by groove_sink_set_shm.
+// Everything but create, destroy, start and stop is called from the decode
+// thread.
+struct GrooveShmWriter;
+
+#ifdef GROOVE_HAVE_SHM
+
+int groove_shm_writer_create(const char *name, int capacity,
+        const struct GrooveAudioFormat *audio_format, struct GrooveShmWriter **out_writer);
+// Tells the reader there will be nothing more and unlinks the name. A reader
+// keeps its mapping until it closes.
+void groove_shm_writer_destroy(struct GrooveShmWriter *writer);
+
+unsigned char *groove_shm_writer_data(struct GrooveShmWriter *writer);
+struct GrooveRingIndexes *groove_shm_writer_indexes(struct GrooveShmWriter *writer);
+
+// Starts a thread which calls `room` whenever the reader frees some of the
+// ring, since the reader cannot signal the playlist from another process.
+int groove_shm_writer_start(struct GrooveShmWriter *writer,
+        void (*room)(void *arg), void *arg);
+void groove_shm_writer_stop(struct GrooveShmWriter *writer);
+
+// Wakes the reader after the indexes changed.
+void groove_shm_writer_notify(struct GrooveShmWriter *writer);
+// Records that the audio from the write index on is `pos` seconds into
+// `item`, unless that is where the audio before it already led.
+void groove_shm_writer_mark(struct GrooveShmWriter *writer,
+        struct GroovePlaylistItem *item, double pos);
+// Everything before the write index is stale.
+void groove_shm_writer_flush(struct GrooveShmWriter *writer);
+
+#else
+
+// without shm.c creating a writer fails, so the rest is never reached
+static inline int groove_shm_writer_create(const char *name, int capacity,
+        const struct GrooveAudioFormat *audio_format, struct GrooveShmWriter **out_writer)
+{
+    *out_writer = NULL;
+    return GrooveErrorSystemResources;
+}
+static inline void groove_shm_writer_destroy(struct GrooveShmWriter *writer) {}
+static inline unsigned char *groove_shm_writer_data(struct GrooveShmWriter *writer) {
+    return NULL;
+}
+static inline struct GrooveRingIndexes *groove_shm_writer_indexes(struct GrooveShmWriter *writer) {
+    return NULL;
+}
+static inline int groove_shm_writer_start(struct GrooveShmWriter *writer,
+        void (*room)(void *arg), void *arg)
+{
+    return 0;
+}
+static inline void groove_shm_writer_stop(struct GrooveShmWriter *writer) {}
+static inline void groove_shm_writer_notify(struct GrooveShmWriter *writer) {}
+static inline void groove_shm_writer_mark(struct GrooveShmWriter *writer,
+        struct GroovePlaylistItem *item, double pos)
+{
+}
+static inline void groove_shm_writer_flush(struct GrooveShmWriter *writer) {}
+
+#endif
+
+#endif
@@ -0,0 +1,595 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of libgroove, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#include "sink_log.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <string.h>
+
+// the ring starts with room for this many entries and doubles when full
+#define INITIAL_CAPACITY 64
+#define INITIAL_SEGMENT_CAPACITY 8
+
+struct SinkLogEntry {
+    // NULL marks the end of the playlist
+    struct GrooveBuffer *buffer;
+    // NULL if the entry is for every shared reader
+    struct GrooveSinkLogReader *target;
+    // readers which have yet to pass this entry. 0 once it is let go.
+    int remaining;
+};
+
+// A run of entries whose buffers all belong to one playlist item. The decode
+// thread works through one item at a time, so there are only a few of these
+// and purging an item does not have to look at the other items' entries.
+struct SinkLogSegment {
+    // NULL once purged
+    struct GroovePlaylistItem *item;
+    int64_t start;
+    int64_t end;
+};
+
+struct GrooveSinkLog {
+    struct GrooveAtomicInt ref_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    // ring of entries indexed by sequence number. entries from head up to
+    // but not including tail are in the log; some of them may have been let
+    // go already, head only moves past those at the front.
+    struct SinkLogEntry *entries;
+    int capacity;
+    int64_t head;
+    int64_t tail;
+
+    // in sequence order. the first segment_first of them are no longer used.
+    struct SinkLogSegment *segments;
+    int segment_first;
+    int segment_count;
+    int segment_capacity;
+
+    struct GrooveSinkLogReader *reader_head;
+    int shared_count;
+    // readers which have a notifier
+    int notify_count;
+    int waiter_count;
+    // bytes of entries for every reader put in so far
+    struct GrooveAtomicLong shared_bytes;
+};
+
+static struct SinkLogEntry *entry_at(struct GrooveSinkLog *log, int64_t seq) {
+    return &log->entries[seq & (log->capacity - 1)];
+}
+
+struct GrooveSinkLog *groove_sink_log_create(void) {
+    struct GrooveSinkLog *log = ALLOCATE(struct GrooveSinkLog, 1);
+    if (!log)
+        return NULL;
+
+    log->entries = ALLOCATE(struct SinkLogEntry, INITIAL_CAPACITY);
+    if (!log->entries) {
+        DEALLOCATE(log);
+        return NULL;
+    }
+    log->capacity = INITIAL_CAPACITY;
+
+    log->segments = ALLOCATE_NONZERO(struct SinkLogSegment, INITIAL_SEGMENT_CAPACITY);
+    if (!log->segments) {
+        DEALLOCATE(log->entries);
+        DEALLOCATE(log);
+        return NULL;
+    }
+    log->segment_capacity = INITIAL_SEGMENT_CAPACITY;
+
+    if (pthread_mutex_init(&log->mutex, NULL) != 0) {
+        DEALLOCATE(log->segments);
+        DEALLOCATE(log->entries);
+        DEALLOCATE(log);
+        return NULL;
+    }
+    if (pthread_cond_init(&log->cond, NULL) != 0) {
+        pthread_mutex_destroy(&log->mutex);
+        DEALLOCATE(log->segments);
+        DEALLOCATE(log->entries);
+        DEALLOCATE(log);
+        return NULL;
+    }
+    GROOVE_ATOMIC_STORE(log->ref_count, 1);
+    GROOVE_ATOMIC_STORE(log->shared_bytes, 0);
+    return log;
+}
+
+void groove_sink_log_ref(struct GrooveSinkLog *log) {
+    GROOVE_ATOMIC_FETCH_ADD(log->ref_count, 1);
+}
+
+static void release_entry(struct SinkLogEntry *entry) {
+    if (entry->buffer)
+        groove_buffer_unref(entry->buffer);
+    entry->buffer = NULL;
+    entry->remaining = 0;
+}
+
+void groove_sink_log_unref(struct GrooveSinkLog *log) {
+    if (!log)
+        return;
+    if (GROOVE_ATOMIC_FETCH_ADD(log->ref_count, -1) != 1)
+        return;
+
+    for (int64_t seq = log->head; seq < log->tail; seq += 1) {
+        struct SinkLogEntry *entry = entry_at(log, seq);
+        if (entry->remaining > 0)
+            release_entry(entry);
+    }
+    pthread_cond_destroy(&log->cond);
+    pthread_mutex_destroy(&log->mutex);
+    DEALLOCATE(log->segments);
+    DEALLOCATE(log->entries);
+    DEALLOCATE(log);
+}
+
+// Moves head past the entries which have been let go. Called with the mutex
+// held.
+static void advance_head(struct GrooveSinkLog *log) {
+    while (log->head < log->tail && entry_at(log, log->head)->remaining == 0)
+        log->head += 1;
+    while (log->segment_first < log->segment_count &&
+            log->segments[log->segment_first].end <= log->head)
+    {
+        log->segment_first += 1;
+    }
+}
+
+// Adds the entry at tail to the segment of its item. Returns 0 or a
+// GrooveError. Called with the mutex held.
+static int add_to_segment(struct GrooveSinkLog *log, struct GroovePlaylistItem *item) {
+    if (log->segment_count > log->segment_first) {
+        struct SinkLogSegment *last = &log->segments[log->segment_count - 1];
+        if (last->item == item && last->end == log->tail) {
+            last->end += 1;
+            return 0;
+        }
+    }
+    if (log->segment_count == log->segment_capacity) {
+        int used = log->segment_count - log->segment_first;
+        if (used < log->segment_capacity / 2) {
+            memmove(log->segments, &log->segments[log->segment_first],
+                    used * sizeof(struct SinkLogSegment));
+        } else {
+            int new_capacity = log->segment_capacity * 2;
+            struct SinkLogSegment *new_segments = REALLOCATE_NONZERO(struct SinkLogSegment,
+                    log->segments, new_capacity);
+            if (!new_segments)
+                return GrooveErrorNoMem;
+            log->segments = new_segments;
+            log->segment_capacity = new_capacity;
+            memmove(log->segments, &log->segments[log->segment_first],
+                    used * sizeof(struct SinkLogSegment));
+        }
+        log->segment_first = 0;
+        log->segment_count = used;
+    }
+    struct SinkLogSegment *segment = &log->segments[log->segment_count];
+    segment->item = item;
+    segment->start = log->tail;
+    segment->end = log->tail + 1;
+    log->segment_count += 1;
+    return 0;
+}
+
+static bool entry_is_for(const struct SinkLogEntry *entry,
+        const struct GrooveSinkLogReader *reader)
+{
+    if (entry->remaining == 0)
+        return false;
+    return entry->target ? (entry->target == reader) : reader->shared;
+}
+
+static int entry_size(const struct SinkLogEntry *entry) {
+    return entry->buffer ? entry->buffer->size : 0;
+}
+
+static bool seek_next(struct GrooveSinkLog *log, struct GrooveSinkLogReader *reader);
+
+// Called with the mutex held after something changed for this reader.
+static void update_notify(struct GrooveSinkLog *log, struct GrooveSinkLogReader *reader) {
+    if (!reader->notify)
+        return;
+    if (reader->aborted || seek_next(log, reader))
+        groove_os_notify_set(reader->notify);
+    else
+        groove_os_notify_clear(reader->notify);
+}
+
+// Called with the mutex held.
+static void update_every_notify(struct GrooveSinkLog *log) {
+    if (log->notify_count == 0)
+        return;
+    for (struct GrooveSinkLogReader *reader = log->reader_head; reader; reader = reader->next)
+        update_notify(log, reader);
+}
+
+void groove_sink_log_join(struct GrooveSinkLog *log, struct GrooveSinkLogReader *reader,
+        bool shared)
+{
+    groove_sink_log_ref(log);
+
+    pthread_mutex_lock(&log->mutex);
+    reader->log = log;
+    reader->shared = shared;
+    reader->aborted = false;
+    reader->cursor = log->tail;
+    GROOVE_ATOMIC_STORE(reader->read_bytes, GROOVE_ATOMIC_LOAD(log->shared_bytes));
+    GROOVE_ATOMIC_STORE(reader->private_bytes, 0);
+    GROOVE_ATOMIC_STORE(reader->contains_end, false);
+    reader->next = log->reader_head;
+    log->reader_head = reader;
+    if (shared)
+        log->shared_count += 1;
+    if (reader->notify)
+        log->notify_count += 1;
+    update_notify(log, reader);
+    pthread_mutex_unlock(&log->mutex);
+}
+
+void groove_sink_log_leave(struct GrooveSinkLogReader *reader) {
+    struct GrooveSinkLog *log = reader->log;
+    if (!log)
+        return;
+
+    pthread_mutex_lock(&log->mutex);
+    for (int64_t seq = reader->cursor; seq < log->tail; seq += 1) {
+        struct SinkLogEntry *entry = entry_at(log, seq);
+        if (!entry_is_for(entry, reader))
+            continue;
+        entry->remaining -= 1;
+        if (entry->remaining == 0)
+            release_entry(entry);
+    }
+    advance_head(log);
+
+    struct GrooveSinkLogReader **link = &log->reader_head;
+    while (*link != reader)
+        link = &(*link)->next;
+    *link = reader->next;
+    if (reader->shared)
+        log->shared_count -= 1;
+    if (reader->notify)
+        log->notify_count -= 1;
+    pthread_mutex_unlock(&log->mutex);
+
+    reader->log = NULL;
+    reader->next = NULL;
+    GROOVE_ATOMIC_STORE(reader->private_bytes, 0);
+    GROOVE_ATOMIC_STORE(reader->contains_end, false);
+    groove_sink_log_unref(log);
+}
+
+void groove_sink_log_abort(struct GrooveSinkLogReader *reader) {
+    struct GrooveSinkLog *log = reader->log;
+    if (!log)
+        return;
+
+    pthread_mutex_lock(&log->mutex);
+    reader->aborted = true;
+    update_notify(log, reader);
+    pthread_cond_broadcast(&log->cond);
+    pthread_mutex_unlock(&log->mutex);
+}
+
+void groove_sink_log_set_notify(struct GrooveSinkLogReader *reader,
+        struct GrooveOsNotify *notify)
+{
+    struct GrooveSinkLog *log = reader->log;
+    if (!log) {
+        reader->notify = notify;
+        return;
+    }
+
+    pthread_mutex_lock(&log->mutex);
+    if (reader->notify)
+        log->notify_count -= 1;
+    reader->notify = notify;
+    if (reader->notify)
+        log->notify_count += 1;
+    update_notify(log, reader);
+    pthread_mutex_unlock(&log->mutex);
+}
+
+// Doubles the ring. Entries keep their sequence numbers.
+static int grow(struct GrooveSinkLog *log) {
+    int new_capacity = log->capacity * 2;
+    struct SinkLogEntry *new_entries = ALLOCATE_NONZERO(struct SinkLogEntry, new_capacity);
+    if (!new_entries)
+        return GrooveErrorNoMem;
+    for (int64_t seq = log->head; seq < log->tail; seq += 1)
+        new_entries[seq & (new_capacity - 1)] = *entry_at(log, seq);
+    DEALLOCATE(log->entries);
+    log->entries = new_entries;
+    log->capacity = new_capacity;
+    return 0;
+}
+
+int groove_sink_log_put(struct GrooveSinkLog *log, struct GrooveSinkLogReader *target,
+        struct GrooveBuffer *buffer)
+{
+    pthread_mutex_lock(&log->mutex);
+
+    // nobody would read it
+    if (!target && log->shared_count == 0) {
+        pthread_mutex_unlock(&log->mutex);
+        groove_buffer_unref(buffer);
+        return 0;
+    }
+
+    int err = 0;
+    if (log->tail - log->head == log->capacity)
+        err = grow(log);
+    // the end of the playlist is never purged, so it needs no segment
+    if (!err && buffer)
+        err = add_to_segment(log, buffer->item);
+    if (err) {
+        pthread_mutex_unlock(&log->mutex);
+        if (buffer)
+            groove_buffer_unref(buffer);
+        return err;
+    }
+
+    struct SinkLogEntry *entry = entry_at(log, log->tail);
+    entry->buffer = buffer;
+    entry->target = target;
+    entry->remaining = target ? 1 : log->shared_count;
+    log->tail += 1;
+
+    if (!target) {
+        GROOVE_ATOMIC_FETCH_ADD(log->shared_bytes, buffer->size);
+        if (log->notify_count > 0) {
+            for (struct GrooveSinkLogReader *reader = log->reader_head; reader;
+                    reader = reader->next)
+            {
+                if (reader->shared && reader->notify)
+                    groove_os_notify_set(reader->notify);
+            }
+        }
+    } else {
+        if (buffer)
+            GROOVE_ATOMIC_FETCH_ADD(target->private_bytes, buffer->size);
+        else
+            GROOVE_ATOMIC_STORE(target->contains_end, true);
+        if (target->notify)
+            groove_os_notify_set(target->notify);
+    }
+
+    // readers all wait on the one cond, and any of them may be the target
+    if (log->waiter_count > 0)
+        pthread_cond_broadcast(&log->cond);
+    pthread_mutex_unlock(&log->mutex);
+    return 0;
+}
+
+// Moves the cursor up to the next entry for this reader. Returns true if
+// there is one. Called with the mutex held.
+static bool seek_next(struct GrooveSinkLog *log, struct GrooveSinkLogReader *reader) {
+    for (; reader->cursor < log->tail; reader->cursor += 1) {
+        if (entry_is_for(entry_at(log, reader->cursor), reader))
+            return true;
+    }
+    return false;
+}
+
+// Takes the entry at the cursor, which must be for this reader, and moves
+// past it. Returns a reference to its buffer. Called with the mutex held.
+static struct GrooveBuffer *take_next(struct GrooveSinkLog *log,
+        struct GrooveSinkLogReader *reader)
+{
+    struct SinkLogEntry *entry = entry_at(log, reader->cursor);
+    struct GrooveBuffer *buffer = entry->buffer;
+    reader->cursor += 1;
+    if (entry->target) {
+        if (buffer)
+            GROOVE_ATOMIC_FETCH_ADD(reader->private_bytes, -entry_size(entry));
+        else
+            GROOVE_ATOMIC_STORE(reader->contains_end, false);
+    } else {
+        GROOVE_ATOMIC_FETCH_ADD(reader->read_bytes, entry_size(entry));
+    }
+    // the last reader to pass an entry takes the log's reference
+    entry->remaining -= 1;
+    if (entry->remaining == 0)
+        entry->buffer = NULL;
+    else
+        groove_buffer_ref(buffer);
+    return buffer;
+}
+
+int groove_sink_log_get(struct GrooveSinkLogReader *reader, struct GrooveBuffer **buffer,
+        int block)
+{
+    struct GrooveSinkLog *log = reader->log;
+    int ret;
+
+    // not attached to a playlist
+    if (!log)
+        return -1;
+
+    pthread_mutex_lock(&log->mutex);
+
+    for (;;) {
+        if (reader->aborted) {
+            ret = -1;
+            break;
+        }
+
+        if (seek_next(log, reader)) {
+            *buffer = take_next(log, reader);
+            advance_head(log);
+            update_notify(log, reader);
+            ret = 1;
+            break;
+        } else if (!block) {
+            ret = 0;
+            break;
+        } else {
+            log->waiter_count += 1;
+            pthread_cond_wait(&log->cond, &log->mutex);
+            log->waiter_count -= 1;
+        }
+    }
+
+    pthread_mutex_unlock(&log->mutex);
+    return ret;
+}
+
+int groove_sink_log_get_many(struct GrooveSinkLogReader *reader,
+        struct GrooveBuffer **buffers, int max, int block)
+{
+    struct GrooveSinkLog *log = reader->log;
+    int ret;
+
+    // not attached to a playlist
+    if (!log)
+        return -1;
+
+    pthread_mutex_lock(&log->mutex);
+
+    for (;;) {
+        if (reader->aborted) {
+            ret = -1;
+            break;
+        }
+
+        ret = 0;
+        while (ret < max && seek_next(log, reader)) {
+            struct GrooveBuffer *buffer = take_next(log, reader);
+            buffers[ret] = buffer;
+            ret += 1;
+            if (!buffer)
+                break;
+        }
+        if (ret > 0 || !block) {
+            advance_head(log);
+            update_notify(log, reader);
+            break;
+        }
+        log->waiter_count += 1;
+        pthread_cond_wait(&log->cond, &log->mutex);
+        log->waiter_count -= 1;
+    }
+
+    pthread_mutex_unlock(&log->mutex);
+    return ret;
+}
+
+int groove_sink_log_peek(struct GrooveSinkLogReader *reader, int block) {
+    struct GrooveSinkLog *log = reader->log;
+    int ret;
+
+    // not attached to a playlist
+    if (!log)
+        return -1;
+
+    pthread_mutex_lock(&log->mutex);
+
+    for (;;) {
+        if (reader->aborted) {
+            ret = -1;
+            break;
+        }
+
+        if (seek_next(log, reader)) {
+            ret = 1;
+            break;
+        } else if (!block) {
+            ret = 0;
+            break;
+        } else {
+            log->waiter_count += 1;
+            pthread_cond_wait(&log->cond, &log->mutex);
+            log->waiter_count -= 1;
+        }
+    }
+
+    pthread_mutex_unlock(&log->mutex);
+    return ret;
+}
+
+void groove_sink_log_flush(struct GrooveSinkLog *log) {
+    pthread_mutex_lock(&log->mutex);
+
+    for (int64_t seq = log->head; seq < log->tail; seq += 1) {
+        struct SinkLogEntry *entry = entry_at(log, seq);
+        if (entry->remaining > 0)
+            release_entry(entry);
+    }
+    log->head = log->tail;
+    log->segment_first = 0;
+    log->segment_count = 0;
+
+    long shared_bytes = GROOVE_ATOMIC_LOAD(log->shared_bytes);
+    for (struct GrooveSinkLogReader *reader = log->reader_head; reader; reader = reader->next) {
+        reader->cursor = log->tail;
+        GROOVE_ATOMIC_STORE(reader->read_bytes, shared_bytes);
+        GROOVE_ATOMIC_STORE(reader->private_bytes, 0);
+        GROOVE_ATOMIC_STORE(reader->contains_end, false);
+    }
+    update_every_notify(log);
+
+    pthread_mutex_unlock(&log->mutex);
+}
+
+// Lets go of the entries of one segment. Called with the mutex held.
+static void purge_segment(struct GrooveSinkLog *log, struct SinkLogSegment *segment) {
+    // the shared bytes still in the segment count as read for the readers
+    // which have not got past it
+    for (struct GrooveSinkLogReader *reader = log->reader_head; reader; reader = reader->next) {
+        if (!reader->shared || reader->cursor >= segment->end)
+            continue;
+        int64_t seq = (reader->cursor > segment->start) ? reader->cursor : segment->start;
+        long size = 0;
+        for (; seq < segment->end; seq += 1) {
+            struct SinkLogEntry *entry = entry_at(log, seq);
+            if (!entry->target && entry->remaining > 0)
+                size += entry_size(entry);
+        }
+        GROOVE_ATOMIC_FETCH_ADD(reader->read_bytes, size);
+    }
+
+    for (int64_t seq = segment->start; seq < segment->end; seq += 1) {
+        struct SinkLogEntry *entry = entry_at(log, seq);
+        if (entry->remaining == 0)
+            continue;
+        if (entry->target)
+            GROOVE_ATOMIC_FETCH_ADD(entry->target->private_bytes, -entry_size(entry));
+        release_entry(entry);
+    }
+    segment->item = NULL;
+}
+
+void groove_sink_log_purge(struct GrooveSinkLog *log, struct GroovePlaylistItem *item) {
+    pthread_mutex_lock(&log->mutex);
+
+    for (int i = log->segment_first; i < log->segment_count; i += 1) {
+        struct SinkLogSegment *segment = &log->segments[i];
+        if (segment->item == item)
+            purge_segment(log, segment);
+    }
+    advance_head(log);
+    update_every_notify(log);
+
+    pthread_mutex_unlock(&log->mutex);
+}
+
+int groove_sink_log_fill_level(struct GrooveSinkLogReader *reader) {
+    struct GrooveSinkLog *log = reader->log;
+    if (!log)
+        return 0;
+    long size = GROOVE_ATOMIC_LOAD(reader->private_bytes);
+    if (reader->shared)
+        size += GROOVE_ATOMIC_LOAD(log->shared_bytes) - GROOVE_ATOMIC_LOAD(reader->read_bytes);
+    return (int)size;
+}
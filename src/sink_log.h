@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of libgroove, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#ifndef GROOVE_SINK_LOG_H
+#define GROOVE_SINK_LOG_H
+
+#include "groove_internal.h"
+#include "atomics.h"
+#include "os.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct GrooveSinkLog;
+
+// A sink's position in the log of its sink map entry. Embedded in the sink.
+struct GrooveSinkLogReader {
+    struct GrooveSinkLog *log;
+    // true if this reader takes the entries that are for every reader.
+    // does not change while the reader is in a log.
+    bool shared;
+
+    // the rest is protected by the log's mutex
+    struct GrooveSinkLogReader *next;
+    bool aborted;
+    // sequence number of the next entry to look at
+    int64_t cursor;
+    // bytes of entries for every reader that this reader has passed. the
+    // log's shared_bytes minus this is how much is waiting for it.
+    struct GrooveAtomicLong read_bytes;
+    // bytes waiting in entries addressed to this reader alone
+    struct GrooveAtomicLong private_bytes;
+    struct GrooveAtomicBool contains_end;
+    // optional. set while there is an entry for this reader or it is
+    // aborted. stays with the reader when it leaves the log.
+    struct GrooveOsNotify *notify;
+};
+
+// An append-only log of buffers for the sinks of one sink map entry. A
+// buffer which every sink takes as it is goes in once, however many sinks
+// there are; each sink reads it at its own cursor. Sinks which change the
+// audio on the decode thread get entries addressed to them alone. An entry
+// is let go once every reader it is for has passed it.
+struct GrooveSinkLog *groove_sink_log_create(void);
+void groove_sink_log_ref(struct GrooveSinkLog *log);
+void groove_sink_log_unref(struct GrooveSinkLog *log);
+
+// The reader starts at the end of the log.
+void groove_sink_log_join(struct GrooveSinkLog *log, struct GrooveSinkLogReader *reader,
+        bool shared);
+// Lets go of everything the reader has not read yet.
+void groove_sink_log_leave(struct GrooveSinkLogReader *reader);
+// Makes get and peek return -1 for this reader until it joins again.
+void groove_sink_log_abort(struct GrooveSinkLogReader *reader);
+// Gives the reader a notifier to keep up to date, which the caller owns.
+void groove_sink_log_set_notify(struct GrooveSinkLogReader *reader,
+        struct GrooveOsNotify *notify);
+
+// Takes over the reference the caller holds to `buffer`. A `target` of NULL
+// means every shared reader. `buffer` may be NULL to mark the end of the
+// playlist, which must have a target. Returns 0 or a GrooveError.
+int groove_sink_log_put(struct GrooveSinkLog *log, struct GrooveSinkLogReader *target,
+        struct GrooveBuffer *buffer);
+
+// returns -1 if aborted, 1 if got a buffer, 0 if no buffer ready.
+// a buffer of NULL is the end of the playlist.
+int groove_sink_log_get(struct GrooveSinkLogReader *reader, struct GrooveBuffer **buffer,
+        int block);
+// Gets up to `max` buffers under one lock. Returns -1 if aborted, or how many
+// were stored in `buffers`. The end of the playlist is always the last one.
+int groove_sink_log_get_many(struct GrooveSinkLogReader *reader,
+        struct GrooveBuffer **buffers, int max, int block);
+int groove_sink_log_peek(struct GrooveSinkLogReader *reader, int block);
+
+// Empties the log for every reader.
+void groove_sink_log_flush(struct GrooveSinkLog *log);
+// Drops every buffer of `item` for every reader. Only the entries of that
+// item are looked at.
+void groove_sink_log_purge(struct GrooveSinkLog *log, struct GroovePlaylistItem *item);
+
+// In bytes.
+int groove_sink_log_fill_level(struct GrooveSinkLogReader *reader);
+
+#endif
@@ -5,10 +5,11 @@
  * See http://opensource.org/licenses/MIT
  */
 
-#include "groove_internal.h"
+#include "groove_private.h"
 #include "groove/waveform.h"
 #include "util.h"
 #include "queue.h"
+#include "worker_pool.h"
 
 #include <pthread.h>
 #include <math.h>
@@ -23,7 +24,9 @@ struct GrooveWaveformPrivate {
     struct GrooveSink *sink;
     struct GrooveQueue *info_queue;
     int info_queue_bytes;
-    pthread_t thread_id;
+    // runs on the worker pool while the sink has buffers and the info
+    // queue has room
+    struct GrooveWorkerTask task;
     struct GrooveWaveformInfo *cur_info;
     int cur_data_index;
 
@@ -43,9 +46,6 @@ struct GrooveWaveformPrivate {
     // current playlist item pointer
     struct GroovePlaylistItem *info_head;
     double info_pos;
-    // analyze_thread waits on this when the info queue is full
-    pthread_cond_t drain_cond;
-    bool drain_cond_inited;
 
     // set temporarily
     struct GroovePlaylistItem *purge_item;
@@ -100,37 +100,111 @@ static void emit_track_info(struct GrooveWaveformPrivate *w) {
     w->cur_info = NULL;
 }
 
-static void *waveform_thread(void *arg) {
-    struct GrooveWaveformPrivate *w = (struct GrooveWaveformPrivate *)arg;
+// call with info_head_mutex held
+static void process_end(struct GrooveWaveformPrivate *w) {
+    emit_track_info(w);
+
+    int err;
+    if ((err = groove_queue_put(w->info_queue, create_info(w, NULL))))
+        groove_panic("unable to put in queue: %s", groove_strerror(err));
+
+    w->info_head = NULL;
+    w->info_pos = -1.0;
+}
+
+// call with info_head_mutex held
+static void process_buffer(struct GrooveWaveformPrivate *w, struct GrooveBuffer *buffer) {
     struct GrooveWaveform *waveform = &w->externals;
 
-    struct GrooveBuffer *buffer;
+    if (buffer->item != w->info_head) {
+        emit_track_info(w);
 
-    pthread_mutex_lock(&w->info_head_mutex);
-    while (!w->abort_request) {
-        if (w->info_queue_bytes >= waveform->info_queue_size_bytes) {
-            pthread_cond_wait(&w->drain_cond, &w->info_head_mutex);
-            continue;
+        if (buffer->item) {
+            // start a track
+            struct GrooveFile *file = buffer->item->file;
+            w->estimated_track_duration = (file->override_duration != 0.0) ?
+                file->override_duration : groove_file_duration(file);
+            if (w->estimated_track_duration <= 0.0) {
+                w->estimated_track_duration = 0.0;
+            }
+            w->estimated_track_frame_count = sample_rate * w->estimated_track_duration;
+            w->track_frames_per_pixel = w->estimated_track_frame_count / waveform->width_in_frames;
+            w->track_frames_per_pixel = groove_max_int(w->track_frames_per_pixel, 1);
+            w->frames_until_emit = w->track_frames_per_pixel;
+            w->emit_count = 0;
+            w->max_sample_value = 0.0f;
+
+            w->actual_track_frame_count = 0;
+            w->info_head = buffer->item;
+            w->info_pos = buffer->pos;
+
+            w->cur_info = create_info(w, buffer->item);
+            w->cur_data_index = 0;
         }
+    }
+
+    w->actual_track_frame_count += buffer->frame_count;
+
+    for (int i = 0; i < buffer->frame_count && w->emit_count < waveform->width_in_frames;
+            i += 1, w->frames_until_emit -= 1)
+    {
+        if (w->frames_until_emit == 0) {
+            w->emit_count += 1;
+            uint8_t *ptr = (uint8_t *)&w->cur_info->data[w->cur_data_index];
+            *ptr = w->max_sample_value * UINT8_MAX;
+            w->cur_data_index += 1;
+
+            w->max_sample_value = 0.0f;
+            w->frames_until_emit = w->track_frames_per_pixel;
+        }
+        float *data = (float *) buffer->data[0];
+        float *left = &data[i];
+        float *right = &data[i + 1];
+        float abs_left = fabsf(*left);
+        float abs_right = fabsf(*right);
+        w->max_sample_value = groove_max_float(w->max_sample_value, groove_max_float(abs_left, abs_right));
+    }
+}
+
+// called on the decode thread when process_inline is set
+static void sink_process(struct GrooveSink *sink, struct GrooveBuffer *buffer) {
+    struct GrooveWaveformPrivate *w = (struct GrooveWaveformPrivate *)sink->userdata;
+
+    pthread_mutex_lock(&w->info_head_mutex);
+    if (buffer)
+        process_buffer(w, buffer);
+    else
+        process_end(w);
+    pthread_mutex_unlock(&w->info_head_mutex);
+}
+
+static void schedule_task(struct GrooveWaveformPrivate *w) {
+    int err;
+    if ((err = groove_worker_pool_schedule(&w->groove->worker_pool, &w->task)))
+        av_log(NULL, AV_LOG_ERROR, "waveform: unable to schedule: %s\n", groove_strerror(err));
+}
+
+// Measures what the sink has until it runs dry or the info queue is full.
+// Putting a buffer in the sink or taking info out of the queue schedules
+// this again.
+static void waveform_task(struct GrooveWorkerTask *task) {
+    struct GrooveWaveformPrivate *w = (struct GrooveWaveformPrivate *)task->context;
+    struct GrooveWaveform *waveform = &w->externals;
+
+    struct GrooveBuffer *buffer;
 
-        // we definitely want to unlock the mutex while we wait for the
-        // next buffer. Otherwise there will be a deadlock when sink_flush or
-        // sink_purge is called.
+    pthread_mutex_lock(&w->info_head_mutex);
+    while (!w->abort_request && w->info_queue_bytes < waveform->info_queue_size_bytes) {
+        // the mutex must not be held while getting the buffer. Otherwise
+        // there will be a deadlock when sink_flush or sink_purge is called.
         pthread_mutex_unlock(&w->info_head_mutex);
 
-        int result = groove_sink_buffer_get(w->sink, &buffer, 1);
+        int result = groove_sink_buffer_get(w->sink, &buffer, 0);
 
         pthread_mutex_lock(&w->info_head_mutex);
 
         if (result == GROOVE_BUFFER_END) {
-            emit_track_info(w);
-
-            int err;
-            if ((err = groove_queue_put(w->info_queue, create_info(w, NULL))))
-                groove_panic("unable to put in queue: %s", groove_strerror(err));
-
-            w->info_head = NULL;
-            w->info_pos = -1.0;
+            process_end(w);
             continue;
         }
 
@@ -138,60 +212,10 @@ static void *waveform_thread(void *arg) {
             break;
         }
 
-        if (buffer->item != w->info_head) {
-            emit_track_info(w);
-
-            if (buffer->item) {
-                // start a track
-                struct GrooveFile *file = buffer->item->file;
-                w->estimated_track_duration = (file->override_duration != 0.0) ?
-                    file->override_duration : groove_file_duration(file);
-                if (w->estimated_track_duration <= 0.0) {
-                    w->estimated_track_duration = 0.0;
-                }
-                w->estimated_track_frame_count = sample_rate * w->estimated_track_duration;
-                w->track_frames_per_pixel = w->estimated_track_frame_count / waveform->width_in_frames;
-                w->track_frames_per_pixel = groove_max_int(w->track_frames_per_pixel, 1);
-                w->frames_until_emit = w->track_frames_per_pixel;
-                w->emit_count = 0;
-                w->max_sample_value = 0.0f;
-
-                w->actual_track_frame_count = 0;
-                w->info_head = buffer->item;
-                w->info_pos = buffer->pos;
-
-                w->cur_info = create_info(w, buffer->item);
-                w->cur_data_index = 0;
-            }
-        }
-
-        w->actual_track_frame_count += buffer->frame_count;
-
-        for (int i = 0; i < buffer->frame_count && w->emit_count < waveform->width_in_frames;
-                i += 1, w->frames_until_emit -= 1)
-        {
-            if (w->frames_until_emit == 0) {
-                w->emit_count += 1;
-                uint8_t *ptr = (uint8_t *)&w->cur_info->data[w->cur_data_index];
-                *ptr = w->max_sample_value * UINT8_MAX;
-                w->cur_data_index += 1;
-
-                w->max_sample_value = 0.0f;
-                w->frames_until_emit = w->track_frames_per_pixel;
-            }
-            float *data = (float *) buffer->data[0];
-            float *left = &data[i];
-            float *right = &data[i + 1];
-            float abs_left = fabsf(*left);
-            float abs_right = fabsf(*right);
-            w->max_sample_value = groove_max_float(w->max_sample_value, groove_max_float(abs_left, abs_right));
-        }
-
+        process_buffer(w, buffer);
         groove_buffer_unref(buffer);
     }
     pthread_mutex_unlock(&w->info_head_mutex);
-
-    return NULL;
 }
 
 static void info_queue_cleanup(struct GrooveQueue* queue, void *obj) {
@@ -214,8 +238,8 @@ static void info_queue_get(struct GrooveQueue *queue, void *obj) {
 
     w->info_queue_bytes -= info_size(info);
 
-    if (w->info_queue_bytes < waveform->info_queue_size_bytes)
-        pthread_cond_signal(&w->drain_cond);
+    if (w->info_queue_bytes < waveform->info_queue_size_bytes && !w->sink->process)
+        schedule_task(w);
 }
 
 static int info_queue_purge(struct GrooveQueue* queue, void *obj) {
@@ -237,8 +261,10 @@ static void sink_purge(struct GrooveSink *sink, struct GroovePlaylistItem *item)
         w->info_head = NULL;
         w->info_pos = -1.0;
     }
-    pthread_cond_signal(&w->drain_cond);
     pthread_mutex_unlock(&w->info_head_mutex);
+
+    if (!sink->process)
+        schedule_task(w);
 }
 
 static void sink_flush(struct GrooveSink *sink) {
@@ -252,9 +278,15 @@ static void sink_flush(struct GrooveSink *sink) {
     w->actual_track_frame_count = 0.0;
     w->info_head = NULL;
     w->info_pos = -1.0;
-
-    pthread_cond_signal(&w->drain_cond);
     pthread_mutex_unlock(&w->info_head_mutex);
+
+    if (!sink->process)
+        schedule_task(w);
+}
+
+static void sink_filled(struct GrooveSink *sink) {
+    struct GrooveWaveformPrivate *w = (struct GrooveWaveformPrivate *)sink->userdata;
+    schedule_task(w);
 }
 
 struct GrooveWaveform *groove_waveform_create(struct Groove *groove) {
@@ -273,12 +305,6 @@ struct GrooveWaveform *groove_waveform_create(struct Groove *groove) {
 
     w->info_head_mutex_inited = true;
 
-    if (pthread_cond_init(&w->drain_cond, NULL) != 0) {
-        groove_waveform_destroy(waveform);
-        return NULL;
-    }
-    w->drain_cond_inited = 1;
-
     w->info_queue = groove_queue_create();
     if (!w->info_queue) {
         groove_waveform_destroy(waveform);
@@ -303,9 +329,13 @@ struct GrooveWaveform *groove_waveform_create(struct Groove *groove) {
     audio_format.is_planar = false;
 
     groove_sink_set_only_format(w->sink, &audio_format);
+    // convert on the worker pool rather than the decode thread
+    w->sink->flags |= GrooveSinkFlagConvertOnGet;
+    groove_sink_set_resample_preset(w->sink, GrooveResamplePresetFastest);
     w->sink->userdata = waveform;
     w->sink->purge = sink_purge;
     w->sink->flush = sink_flush;
+    w->sink->filled = sink_filled;
 
     // set some defaults
     waveform->width_in_frames = 1920;
@@ -331,9 +361,6 @@ void groove_waveform_destroy(struct GrooveWaveform *waveform) {
     if (w->info_head_mutex_inited)
         pthread_mutex_destroy(&w->info_head_mutex);
 
-    if (w->drain_cond_inited)
-        pthread_cond_destroy(&w->drain_cond);
-
     DEALLOCATE(w);
 }
 
@@ -348,15 +375,27 @@ int groove_waveform_attach(struct GrooveWaveform *waveform,
     waveform->playlist = playlist;
     groove_queue_reset(w->info_queue);
 
+    if (waveform->process_inline) {
+        w->sink->process = sink_process;
+    } else {
+        w->sink->process = NULL;
+        // convert on the worker pool rather than the decode thread
+        w->sink->flags |= GrooveSinkFlagConvertOnGet;
+    }
+
+    groove_worker_task_init(&w->task, waveform_task, w);
+
     int err;
     if ((err = groove_sink_attach(w->sink, playlist))) {
         groove_waveform_detach(waveform);
         return err;
     }
 
-    if (pthread_create(&w->thread_id, NULL, waveform_thread, waveform)) {
+    if (!w->sink->process &&
+        (err = groove_worker_pool_schedule(&w->groove->worker_pool, &w->task)))
+    {
         groove_waveform_detach(waveform);
-        return GrooveErrorSystemResources;
+        return err;
     }
 
     return 0;
@@ -367,14 +406,13 @@ int groove_waveform_detach(struct GrooveWaveform *waveform) {
 
     pthread_mutex_lock(&w->info_head_mutex);
     w->abort_request = 1;
-    pthread_cond_signal(&w->drain_cond);
     pthread_mutex_unlock(&w->info_head_mutex);
 
+    groove_worker_task_cancel(&w->groove->worker_pool, &w->task);
     int err = groove_sink_detach(w->sink);
     assert(!err);
     groove_queue_flush(w->info_queue);
     groove_queue_abort(w->info_queue);
-    pthread_join(w->thread_id, NULL);
 
     waveform->playlist = NULL;
 
@@ -403,6 +441,11 @@ int groove_waveform_info_peek(struct GrooveWaveform *waveform, int block) {
     return groove_queue_peek(w->info_queue, block);
 }
 
+int groove_waveform_info_get_fd(struct GrooveWaveform *waveform) {
+    struct GrooveWaveformPrivate *w = (struct GrooveWaveformPrivate *) waveform;
+    return groove_queue_get_fd(w->info_queue);
+}
+
 void groove_waveform_position(struct GrooveWaveform *waveform,
         struct GroovePlaylistItem **item, double *seconds)
 {
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of libgroove, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#include "worker_pool.h"
+#include "os.h"
+#include "util.h"
+
+#include <string.h>
+
+#define INITIAL_CAPACITY 16
+
+enum TaskState {
+    TaskStateIdle,
+    TaskStateQueued,
+    TaskStateRunning,
+    // scheduled again while running
+    TaskStateRerun,
+};
+
+struct GrooveWorker {
+    struct GrooveWorkerPool *pool;
+    int index;
+    pthread_t thread_id;
+
+    // protects the queue
+    pthread_mutex_t mutex;
+    bool mutex_inited;
+    // ring array; capacity is a power of two
+    struct GrooveWorkerTask **tasks;
+    int capacity;
+    int head;
+    int count;
+};
+
+// so that a task scheduled by a worker stays on that worker
+static _Thread_local struct GrooveWorker *current_worker = NULL;
+
+static int worker_push(struct GrooveWorker *worker, struct GrooveWorkerTask *task) {
+    pthread_mutex_lock(&worker->mutex);
+    if (worker->count == worker->capacity) {
+        int new_capacity = worker->capacity ? worker->capacity * 2 : INITIAL_CAPACITY;
+        struct GrooveWorkerTask **new_tasks = ALLOCATE_NONZERO(struct GrooveWorkerTask *,
+                new_capacity);
+        if (!new_tasks) {
+            pthread_mutex_unlock(&worker->mutex);
+            return GrooveErrorNoMem;
+        }
+        for (int i = 0; i < worker->count; i += 1)
+            new_tasks[i] = worker->tasks[(worker->head + i) & (worker->capacity - 1)];
+        DEALLOCATE(worker->tasks);
+        worker->tasks = new_tasks;
+        worker->capacity = new_capacity;
+        worker->head = 0;
+    }
+    worker->tasks[(worker->head + worker->count) & (worker->capacity - 1)] = task;
+    worker->count += 1;
+    pthread_mutex_unlock(&worker->mutex);
+    return 0;
+}
+
+static struct GrooveWorkerTask *worker_pop(struct GrooveWorker *worker) {
+    struct GrooveWorkerTask *task = NULL;
+    pthread_mutex_lock(&worker->mutex);
+    if (worker->count > 0) {
+        task = worker->tasks[worker->head];
+        worker->head = (worker->head + 1) & (worker->capacity - 1);
+        worker->count -= 1;
+    }
+    pthread_mutex_unlock(&worker->mutex);
+    return task;
+}
+
+// own queue first, then steal from the next ones along
+static struct GrooveWorkerTask *find_task(struct GrooveWorker *worker) {
+    struct GrooveWorkerPool *pool = worker->pool;
+    for (int i = 0; i < pool->worker_count; i += 1) {
+        struct GrooveWorker *victim = &pool->workers[(worker->index + i) % pool->worker_count];
+        struct GrooveWorkerTask *task = worker_pop(victim);
+        if (task)
+            return task;
+    }
+    return NULL;
+}
+
+static void run_task(struct GrooveWorkerPool *pool, struct GrooveWorkerTask *task) {
+    GROOVE_ATOMIC_STORE(task->state, TaskStateRunning);
+    for (;;) {
+        if (!GROOVE_ATOMIC_LOAD(task->cancelled))
+            task->run(task);
+        int expected = TaskStateRunning;
+        if (GROOVE_ATOMIC_COMPARE_EXCHANGE(task->state, expected, TaskStateIdle))
+            break;
+        GROOVE_ATOMIC_STORE(task->state, TaskStateRunning);
+    }
+
+    // the task may be gone once it is idle; only the pool is touched now
+    if (GROOVE_ATOMIC_LOAD(pool->cancel_waiter_count) > 0) {
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+static void *worker_thread(void *arg) {
+    struct GrooveWorker *worker = (struct GrooveWorker *)arg;
+    struct GrooveWorkerPool *pool = worker->pool;
+    current_worker = worker;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        GROOVE_ATOMIC_FETCH_ADD(pool->sleeping_count, 1);
+        while (!pool->quit && GROOVE_ATOMIC_LOAD(pool->queued_count) <= 0)
+            pthread_cond_wait(&pool->work_cond, &pool->mutex);
+        GROOVE_ATOMIC_FETCH_ADD(pool->sleeping_count, -1);
+        if (pool->quit)
+            break;
+        pthread_mutex_unlock(&pool->mutex);
+
+        struct GrooveWorkerTask *task;
+        while ((task = find_task(worker))) {
+            GROOVE_ATOMIC_FETCH_ADD(pool->queued_count, -1);
+            run_task(pool, task);
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+static void destroy_worker(struct GrooveWorker *worker) {
+    if (worker->mutex_inited)
+        pthread_mutex_destroy(&worker->mutex);
+    DEALLOCATE(worker->tasks);
+}
+
+static void stop_workers(struct GrooveWorkerPool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < pool->worker_count; i += 1) {
+        struct GrooveWorker *worker = &pool->workers[i];
+        pthread_join(worker->thread_id, NULL);
+        destroy_worker(worker);
+    }
+    DEALLOCATE(pool->workers);
+    pool->workers = NULL;
+    pool->worker_count = 0;
+}
+
+// Call with mutex held. If only some threads can be made, the pool makes do
+// with those.
+static int start_workers(struct GrooveWorkerPool *pool) {
+    int count = groove_os_cpu_count();
+    struct GrooveWorker *workers = ALLOCATE(struct GrooveWorker, count);
+    if (!workers)
+        return GrooveErrorNoMem;
+
+    for (int i = 0; i < count; i += 1) {
+        struct GrooveWorker *worker = &workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        if (pthread_mutex_init(&worker->mutex, NULL) != 0) {
+            for (int j = 0; j < i; j += 1)
+                destroy_worker(&workers[j]);
+            DEALLOCATE(workers);
+            return GrooveErrorSystemResources;
+        }
+        worker->mutex_inited = true;
+    }
+
+    // the threads sleep until there is a task, and there is none until this
+    // returns, so they do not look at the workers yet
+    pool->workers = workers;
+    int started = 0;
+    for (; started < count; started += 1) {
+        if (pthread_create(&workers[started].thread_id, NULL, worker_thread, &workers[started]))
+            break;
+    }
+    for (int i = started; i < count; i += 1)
+        destroy_worker(&workers[i]);
+    if (started == 0) {
+        DEALLOCATE(workers);
+        pool->workers = NULL;
+        return GrooveErrorSystemResources;
+    }
+    pool->worker_count = started;
+
+    av_log(NULL, AV_LOG_INFO, "worker pool: started %d of %d threads\n", started, count);
+    GROOVE_ATOMIC_STORE(pool->started, true);
+    return 0;
+}
+
+int groove_worker_pool_init(struct GrooveWorkerPool *pool) {
+    memset(pool, 0, sizeof(struct GrooveWorkerPool));
+
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0)
+        return GrooveErrorSystemResources;
+    pool->mutex_inited = true;
+
+    if (pthread_cond_init(&pool->work_cond, NULL) != 0)
+        return GrooveErrorSystemResources;
+    pool->work_cond_inited = true;
+
+    if (pthread_cond_init(&pool->done_cond, NULL) != 0)
+        return GrooveErrorSystemResources;
+    pool->done_cond_inited = true;
+
+    return 0;
+}
+
+void groove_worker_pool_deinit(struct GrooveWorkerPool *pool) {
+    if (pool->workers)
+        stop_workers(pool);
+
+    if (pool->mutex_inited) {
+        pthread_mutex_destroy(&pool->mutex);
+        pool->mutex_inited = false;
+    }
+    if (pool->work_cond_inited) {
+        pthread_cond_destroy(&pool->work_cond);
+        pool->work_cond_inited = false;
+    }
+    if (pool->done_cond_inited) {
+        pthread_cond_destroy(&pool->done_cond);
+        pool->done_cond_inited = false;
+    }
+}
+
+void groove_worker_task_init(struct GrooveWorkerTask *task,
+        void (*run)(struct GrooveWorkerTask *task), void *context)
+{
+    task->run = run;
+    task->context = context;
+    GROOVE_ATOMIC_STORE(task->state, TaskStateIdle);
+    GROOVE_ATOMIC_STORE(task->cancelled, false);
+}
+
+int groove_worker_pool_schedule(struct GrooveWorkerPool *pool, struct GrooveWorkerTask *task) {
+    if (GROOVE_ATOMIC_LOAD(task->cancelled))
+        return 0;
+
+    int state = GROOVE_ATOMIC_LOAD(task->state);
+    for (;;) {
+        if (state == TaskStateQueued || state == TaskStateRerun)
+            return 0;
+        int desired = (state == TaskStateIdle) ? TaskStateQueued : TaskStateRerun;
+        if (GROOVE_ATOMIC_COMPARE_EXCHANGE(task->state, state, desired))
+            break;
+    }
+    // the worker running it will run it again
+    if (state == TaskStateRunning)
+        return 0;
+
+    int err;
+    if (!GROOVE_ATOMIC_LOAD(pool->started)) {
+        pthread_mutex_lock(&pool->mutex);
+        err = GROOVE_ATOMIC_LOAD(pool->started) ? 0 : start_workers(pool);
+        pthread_mutex_unlock(&pool->mutex);
+        if (err) {
+            GROOVE_ATOMIC_STORE(task->state, TaskStateIdle);
+            return err;
+        }
+    }
+
+    struct GrooveWorker *worker = current_worker;
+    if (!worker || worker->pool != pool) {
+        unsigned index = GROOVE_ATOMIC_FETCH_ADD(pool->next_worker, 1);
+        worker = &pool->workers[index % pool->worker_count];
+    }
+    if ((err = worker_push(worker, task))) {
+        GROOVE_ATOMIC_STORE(task->state, TaskStateIdle);
+        return err;
+    }
+
+    GROOVE_ATOMIC_FETCH_ADD(pool->queued_count, 1);
+    if (GROOVE_ATOMIC_LOAD(pool->sleeping_count) > 0) {
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_signal(&pool->work_cond);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return 0;
+}
+
+void groove_worker_task_cancel(struct GrooveWorkerPool *pool, struct GrooveWorkerTask *task) {
+    GROOVE_ATOMIC_STORE(task->cancelled, true);
+
+    pthread_mutex_lock(&pool->mutex);
+    GROOVE_ATOMIC_FETCH_ADD(pool->cancel_waiter_count, 1);
+    while (GROOVE_ATOMIC_LOAD(task->state) != TaskStateIdle)
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    GROOVE_ATOMIC_FETCH_ADD(pool->cancel_waiter_count, -1);
+    pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2015 Andrew Kelley
+ *
+ * This file is part of libgroove, which is MIT licensed.
+ * See http://opensource.org/licenses/MIT
+ */
+
+#ifndef GROOVE_WORKER_POOL_H
+#define GROOVE_WORKER_POOL_H
+
+#include "groove_internal.h"
+#include "atomics.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+
+struct GrooveWorker;
+
+// Something for the pool to run whenever it is scheduled. run must not block;
+// it does what it can and returns, and whatever makes more work possible
+// schedules the task again. A task is never run by two workers at once, and
+// scheduling it while it runs makes it run once more afterwards.
+struct GrooveWorkerTask {
+    void (*run)(struct GrooveWorkerTask *task);
+    void *context;
+
+    struct GrooveAtomicInt state;
+    struct GrooveAtomicBool cancelled;
+};
+
+// A fixed set of threads, one per core, shared by everything in a Groove.
+// Each worker has its own queue of tasks and runs them in the order they
+// were scheduled; a worker with nothing to do steals the oldest task from
+// another. The threads are started the first time a task is scheduled.
+struct GrooveWorkerPool {
+    pthread_mutex_t mutex;
+    bool mutex_inited;
+    // idle workers wait on this
+    pthread_cond_t work_cond;
+    bool work_cond_inited;
+    // groove_worker_task_cancel waits on this
+    pthread_cond_t done_cond;
+    bool done_cond_inited;
+
+    // set once, under mutex, when the threads are started
+    struct GrooveWorker *workers;
+    int worker_count;
+    struct GrooveAtomicBool started;
+    // protected by mutex
+    bool quit;
+
+    // where the next task scheduled from outside the pool goes
+    struct GrooveAtomicInt next_worker;
+    // tasks sitting in any worker's queue
+    struct GrooveAtomicInt queued_count;
+    struct GrooveAtomicInt sleeping_count;
+    struct GrooveAtomicInt cancel_waiter_count;
+};
+
+int groove_worker_pool_init(struct GrooveWorkerPool *pool);
+// Every task must be cancelled first.
+void groove_worker_pool_deinit(struct GrooveWorkerPool *pool);
+
+// Readies a task to be scheduled, including after it was cancelled.
+void groove_worker_task_init(struct GrooveWorkerTask *task,
+        void (*run)(struct GrooveWorkerTask *task), void *context);
+
+// Safe to call from any thread, as often as you like; it is cheap when the
+// task is already waiting to run. Returns 0 or a GrooveError.
+int groove_worker_pool_schedule(struct GrooveWorkerPool *pool, struct GrooveWorkerTask *task);
+
+// Stops the task from being scheduled and waits until it is not running.
+// Must not be called from the task itself.
+void groove_worker_task_cancel(struct GrooveWorkerPool *pool, struct GrooveWorkerTask *task);
+
+#endif